@@ -0,0 +1,124 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace rtpmidid {
+template <typename Signature, size_t Capacity = 64> class callable_t;
+
+/**
+ * Move only std::function, that never allocates.
+ *
+ * The callable is always stored inline, so a lambda that captures more than
+ * Capacity bytes is a compile error. Capture less, or a pointer to the
+ * state. Used for the poller and signal callbacks, so scheduling timers and
+ * calls later does not use the heap.
+ */
+template <typename R, typename... Args, size_t Capacity>
+class callable_t<R(Args...), Capacity> {
+public:
+  callable_t() {}
+  callable_t(std::nullptr_t) {}
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, callable_t> &&
+                std::is_invocable_r_v<R, std::decay_t<F> &, Args...>>>
+  callable_t(F &&f) {
+    using T = std::decay_t<F>;
+    static_assert(sizeof(T) <= Capacity,
+                  "Callable too big for callable_t. Capture less, or a "
+                  "pointer to the state.");
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "Callable over aligned for callable_t.");
+    new (storage) T(std::forward<F>(f));
+    ops = &ops_for<T>;
+  }
+
+  callable_t(callable_t &&other) noexcept { move_from(other); }
+  callable_t &operator=(callable_t &&other) noexcept {
+    if (this != &other) {
+      reset();
+      move_from(other);
+    }
+    return *this;
+  }
+  callable_t &operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+  ~callable_t() { reset(); }
+
+  // No copying
+  callable_t(const callable_t &) = delete;
+  callable_t &operator=(const callable_t &) = delete;
+
+  explicit operator bool() const { return ops != nullptr; }
+
+  R operator()(Args... args) const {
+    if (!ops)
+      throw std::bad_function_call();
+    return ops->call(storage, std::forward<Args>(args)...);
+  }
+
+private:
+  struct ops_t {
+    R (*call)(void *f, Args &&...args);
+    void (*move)(void *to, void *from);
+    void (*destroy)(void *f);
+  };
+
+  template <typename T>
+  static inline const ops_t ops_for{
+      [](void *f, Args &&...args) -> R {
+        return (*static_cast<T *>(f))(std::forward<Args>(args)...);
+      },
+      [](void *to, void *from) {
+        new (to) T(std::move(*static_cast<T *>(from)));
+        static_cast<T *>(from)->~T();
+      },
+      [](void *f) { static_cast<T *>(f)->~T(); },
+  };
+
+  void move_from(callable_t &other) {
+    if (other.ops) {
+      other.ops->move(storage, other.storage);
+      ops = other.ops;
+      other.ops = nullptr;
+    }
+  }
+
+  void reset() {
+    if (ops) {
+      auto current = ops;
+      ops = nullptr;
+      current->destroy(storage);
+    }
+  }
+
+  // mutable, as std::function, calls non const lambdas from a const call
+  alignas(std::max_align_t) mutable unsigned char storage[Capacity];
+  const ops_t *ops = nullptr;
+};
+} // namespace rtpmidid
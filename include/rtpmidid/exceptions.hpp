@@ -33,6 +33,16 @@ public:
   const char *what() const noexcept { return msg.c_str(); }
 };
 
+/**
+ * @short Could not get local ports or sockets
+ *
+ * A local resource problem, not a network one.
+ */
+class port_allocation_error : public exception {
+public:
+  using exception::exception;
+};
+
 class not_implemented : public std::exception {
 public:
   const char *what() const noexcept { return "Not Implemented"; }
@@ -0,0 +1,120 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./iobytes.hpp"
+#include "./shmring.hpp"
+#include "./signal.hpp"
+
+namespace rtpmidid {
+/**
+ * @short Raw MIDI exchange with a process at the same host
+ *
+ * Instead of RTP over UDP, the data goes through two shared memory rings,
+ * one per direction, and the other side is woken up with an eventfd only
+ * when its ring was empty. There is no RTP header, no journal and no
+ * timestamps, just the MIDI commands as given to send_midi.
+ *
+ * The session is set up through a UNIX socket: the client sends the session
+ * name, and the server answers with the shared memory (a memfd) and both
+ * eventfds. The socket is kept open to know when the other side is gone.
+ *
+ * Same signals as rtppeer. Do not destroy it from inside its own signals,
+ * use poller.call_later.
+ */
+class local_session_t : public std::enable_shared_from_this<local_session_t> {
+public:
+  static const uint32_t RING_CAPACITY = 64 * 1024;
+
+  std::string name;
+  // Messages not sent as the other side ring was full
+  uint64_t dropped = 0;
+
+  signal_t<const io_bytes_reader &> midi_event;
+  signal_t<> connected_event;
+  signal_t<> disconnect_event;
+
+  // Server side. Takes ownership of the fds.
+  local_session_t(const std::string &name, int control_socket, int memfd,
+                  int rx_eventfd, int tx_eventfd);
+  // Client side. Gets the shared memory when the server answers.
+  local_session_t(const std::string &name, int control_socket);
+  ~local_session_t();
+
+  // Connects to a local_server_t. Throws if the server is not there.
+  static std::shared_ptr<local_session_t> connect(const std::string &path,
+                                                  const std::string &name);
+
+  bool is_connected() const { return memory != nullptr; }
+  void send_midi(const io_bytes_reader &buffer);
+  // Reads all the pending messages. Called from the poller.
+  void data_ready();
+
+private:
+  int control_socket = -1;
+  int memfd = -1;
+  int rx_eventfd = -1;
+  int tx_eventfd = -1;
+  void *memory = nullptr;
+  size_t memory_size = 0;
+  bool closed = false;
+  bool control_polled = false;
+  shm_ring_t rx;
+  shm_ring_t tx;
+  std::vector<uint8_t> rx_buffer;
+
+  void attach(bool is_server);
+  void control_ready();
+  void recv_handshake();
+  void close_later();
+};
+
+/**
+ * @short Accepts local sessions at a UNIX socket
+ *
+ * Each client gets its own session, with the name it asked for. The
+ * session_event listeners decide what to do with it; if nobody keeps it, it
+ * is closed.
+ */
+class local_server_t {
+public:
+  static const size_t MAX_NAME = 255;
+
+  std::string path;
+  signal_t<const std::shared_ptr<local_session_t> &> session_event;
+
+  // Throws if can not listen at path
+  local_server_t(const std::string &path);
+  ~local_server_t();
+
+private:
+  int listen_socket = -1;
+  // Connected, waiting for the session name
+  std::set<int> pending;
+
+  void accept_connection();
+  void recv_name(int fd);
+  void start_session(int fd, const std::string &name);
+};
+} // namespace rtpmidid
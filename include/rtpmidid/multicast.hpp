@@ -0,0 +1,53 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#pragma once
+#include <optional>
+#include <string>
+#include <sys/socket.h>
+
+namespace rtpmidid {
+/**
+ * @short A multicast group address and port, IPv4 or IPv6
+ *
+ * Servers send the MIDI data once to the group, and clients join it. It is
+ * sent to the clients at the rtpmidid extension of the OK command.
+ */
+struct multicast_group_t {
+  struct sockaddr_storage addr = {};
+  socklen_t addrlen = 0;
+
+  // Numeric address. Throws if not a multicast address.
+  static multicast_group_t parse(const std::string &address,
+                                 const std::string &port);
+  // Family (4 or 6), address and port, network order
+  std::string encode() const;
+  static std::optional<multicast_group_t> decode(const std::string &data);
+
+  int family() const { return addr.ss_family; }
+  std::string to_string() const;
+};
+
+// Socket to send to the group. Throws on error.
+int multicast_sender_socket(const multicast_group_t &group);
+// Socket bound to the group port and joined to the group. Several sockets
+// can join the same group and port. Throws on error.
+int multicast_join(const multicast_group_t &group);
+} // namespace rtpmidid
@@ -18,56 +18,96 @@
  */
 
 #pragma once
+#include "callable.hpp"
 #include <chrono>
 #include <ctime>
 #include <functional>
 #include <map>
 #include <vector>
 #include <optional>
+#include <stdint.h>
 
 namespace rtpmidid {
 /**
  * Simplified fd poller
  *
- * Internally uses epoll, it is level triggered, so data must be read or
- * will retrigger.
+ * Internally uses epoll, or io_uring if selected. It is level triggered, so
+ * data must be read or will retrigger.
+ *
+ * Normally all uses the rtpmidid::poller, but there can be more, as one per
+ * thread. Each one is only used from its thread, and the objects on it
+ * (rtpserver, rtpclient, timers...) too.
  */
 class poller_t {
   void *private_data;
 
 public:
   class timer_t;
+  // Stored inline, so scheduling does not allocate
+  typedef callable_t<void(void)> callback_t;
+  typedef callable_t<void(int)> fd_callback_t;
+  enum backend_e {
+    EPOLL,
+    IO_URING,
+  };
 
   poller_t();
   ~poller_t();
+  poller_t(const poller_t &) = delete;
 
-  // Call this function in X seconds
-  timer_t add_timer_event(std::chrono::milliseconds ms,
-                          std::function<void(void)> event_f);
+  // Call this function in X time. Nanosecond precission, as timers are
+  // backed by a timerfd, so any std::chrono duration works.
+  timer_t add_timer_event(std::chrono::nanoseconds ns,
+                          callback_t event_f);
   void remove_timer(timer_t &tid);
   void clear_timers(); // This is used for destruction, and also for cleanup at
                        // tests.
 
   // Just call it later. after finishing current round of event loop
-  void call_later(std::function<void(void)> later_f);
+  void call_later(callback_t later_f);
 
-  void add_fd_in(int fd, std::function<void(int)> event_f);
-  void add_fd_out(int fd, std::function<void(int)> event_f);
-  void add_fd_inout(int fd, std::function<void(int)> event_f);
+  void add_fd_in(int fd, fd_callback_t event_f);
+  void add_fd_out(int fd, fd_callback_t event_f);
+  void add_fd_inout(int fd, fd_callback_t event_f);
   void remove_fd(int fd);
+  // For an fd added with add_fd_in, also wait (or stop waiting) for write
+  // ready. The same callback is called for both.
+  void set_fd_out(int fd, bool wants_out);
 
   void wait(std::optional<std::chrono::milliseconds> wait_ms = {});
+  // Before blocking, wait() checks for events without sleeping for up to this
+  // time. Trades CPU for latency. 0 (default) disables.
+  void set_busy_poll(std::chrono::microseconds budget);
+  // Select before adding any fd. Throws if not available, and keeps the
+  // current one.
+  void set_backend(backend_e backend);
+  backend_e get_backend();
+  // Syscalls done by the poller itself (epoll_* or io_uring_enter)
+  uint64_t syscalls();
+  // When the current event happened: the wake up for fd events, or the
+  // timer time. Code with its own schedule, as a MIDI clock, may set it
+  // before sending. Used for the SO_TXTIME of the MIDI packets.
+  std::chrono::steady_clock::time_point event_time();
+  void set_event_time(std::chrono::steady_clock::time_point time);
 
   void close();
   bool is_open();
 };
 
+/**
+ * Handle to a pending timer. Removes it when destroyed or assigned.
+ *
+ * The id is the timer slot at the poller in the low 32 bits, and a sequence
+ * number in the high ones, so old handles never remove a newer timer that
+ * reuses the slot.
+ */
 class poller_t::timer_t {
 public:
-  int id;
+  uint64_t id;
+  poller_t *poller; // Where it was added
 
   timer_t();
-  timer_t(int id_);
+  timer_t(poller_t *poller_, uint64_t id_);
   timer_t(timer_t &&);
   ~timer_t();
   timer_t &operator=(timer_t &&other);
@@ -77,6 +117,6 @@ public:
   timer_t(const timer_t &) = delete;
 };
 
-// Singleton for all events on the system.
+// Default poller for all events on the system.
 extern poller_t poller;
 } // namespace rtpmidid
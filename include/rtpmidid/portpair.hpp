@@ -0,0 +1,85 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#pragma once
+#include "./poller.hpp"
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+namespace rtpmidid {
+/**
+ * @short Two bound UDP sockets at consecutive ports
+ *
+ * The control port is even, and the MIDI port is the next one.
+ */
+struct port_pair_t {
+  int control_socket = -1;
+  int midi_socket = -1;
+  uint16_t control_port = 0;
+  int family = 0;
+};
+
+/**
+ * @short Reserves port pairs for the clients
+ *
+ * RTP MIDI needs the MIDI port to be the control port + 1. Binding both
+ * sockets is what reserves the ports, so a pair is only given when both
+ * binds succeeded. Some pairs per address family are kept bound in advance,
+ * so new connections get them at once; the pool is refilled later from the
+ * poller. Not thread safe, so each poller thread needs its own.
+ *
+ * On failure throws port_allocation_error.
+ */
+class port_pair_allocator_t {
+public:
+  static const int MAX_ATTEMPTS = 32;
+
+  // Where the pool is refilled
+  poller_t &poller;
+  // Pairs kept ready per address family. 0 disables the pool.
+  size_t pool_size = 4;
+  uint64_t allocated = 0;
+  uint64_t from_pool = 0;
+  uint64_t failures = 0;
+
+  port_pair_allocator_t(poller_t &poller_ = rtpmidid::poller);
+  ~port_pair_allocator_t();
+
+  port_pair_t get(int family);
+  // Fills the pool for the family. Normally done later by get().
+  void fill(int family);
+  size_t pooled(int family);
+  void clear();
+
+  // Binds a new pair, retrying with other ports if the next is taken
+  static port_pair_t bind_pair(int family);
+  static void close_pair(port_pair_t &pair);
+
+private:
+  std::map<int, std::vector<port_pair_t>> pool;
+  bool refill_pending = false;
+
+  void refill_later();
+};
+
+// Shared allocator for all the clients
+extern port_pair_allocator_t port_pairs;
+} // namespace rtpmidid
@@ -0,0 +1,85 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include "./iobytes.hpp"
+#include <netinet/in.h>
+#include <optional>
+#include <sys/socket.h>
+#include <time.h>
+#include <vector>
+
+namespace rtpmidid {
+/**
+ * @short Reads several UDP datagrams with a single syscall
+ *
+ * Uses recvmmsg to drain up to size() datagrams from a socket per call, into a
+ * set of buffers allocated once and reused on every call.
+ *
+ * After recv returns n, packets 0..n-1 are available with packet(i),
+ * address(i) and timestamp(i) until the next call to recv.
+ *
+ * Datagrams bigger than PACKET_SIZE would be cut by the kernel. These are
+ * dropped, and counted at truncated.
+ */
+class recv_batch_t {
+public:
+  static const int DEFAULT_SIZE = 16;
+  // Biggest datagram of rtppeer: a FEC parity of MAX_PACKET_SIZE packets. So
+  // a peer with a bigger MTU is not cut.
+  static const int PACKET_SIZE = 4096 + 12 + 15;
+  static const int CONTROL_SIZE =
+      CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t));
+
+  // Datagrams dropped as did not fit at PACKET_SIZE
+  uint64_t truncated = 0;
+
+  recv_batch_t(int size = DEFAULT_SIZE);
+
+  // Max number of datagrams read per call. Can be changed at any time.
+  void resize(int size);
+  int size() const { return msgs.size(); }
+
+  // Returns number of datagrams read, 0 if none ready, -1 on error (errno set)
+  int recv(int fd);
+
+  io_bytes_reader packet(int i);
+  struct sockaddr_in6 *address(int i) {
+    return static_cast<struct sockaddr_in6 *>(msgs[i].msg_hdr.msg_name);
+  }
+  socklen_t address_len(int i) { return msgs[i].msg_hdr.msg_namelen; }
+  // Kernel receive time (CLOCK_REALTIME), or 0 if not enabled at the socket
+  struct timespec timestamp(int i);
+  // Kernel drop counter for the socket (SO_RXQ_OVFL), if enabled
+  std::optional<uint32_t> drop_counter(int i);
+
+  // Ask the kernel to timestamp the received packets at this socket
+  static void enable_timestamps(int fd);
+
+private:
+  // Removes the truncated ones from the first n. Returns how many are left.
+  int drop_truncated(int n);
+
+  std::vector<uint8_t> buffers;
+  std::vector<struct mmsghdr> msgs;
+  std::vector<struct iovec> iovecs;
+  std::vector<struct sockaddr_in6> addresses;
+  std::vector<uint8_t> controls;
+};
+} // namespace rtpmidid
@@ -0,0 +1,129 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include "./poller.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+namespace rtpmidid {
+struct resolved_address_t {
+  int family;
+  int socktype;
+  int protocol;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+/**
+ * @short Resolves UDP addresses without blocking the poller
+ *
+ * getaddrinfo runs at a few helper threads, so one slow lookup does not delay
+ * the rest, and the callback is called from the poller loop when the result
+ * is ready. Results are cached for ttl, so reconnects do not resolve again.
+ * Each poller thread needs its own.
+ *
+ * The helper threads are detached and share their state with the resolver,
+ * so destroying it does not wait for the lookups in flight.
+ *
+ * On error the address list is empty and error is the getaddrinfo error
+ * (gai_strerror).
+ */
+class resolver_t {
+public:
+  typedef std::function<void(const std::vector<resolved_address_t> &,
+                             int error)>
+      callback_t;
+  typedef int (*lookup_t)(const char *node, const char *service,
+                          const struct addrinfo *hints,
+                          struct addrinfo **res);
+  static const int MAX_THREADS = 4;
+
+  // Where the callbacks are called
+  poller_t &poller;
+  std::chrono::seconds ttl{60};
+  uint64_t cache_hits = 0;
+  // getaddrinfo. Tests may change it to simulate a slow DNS.
+  lookup_t lookup;
+
+  resolver_t(poller_t &poller_ = rtpmidid::poller);
+  ~resolver_t();
+
+  // Returns an id to cancel the request. The callback is never called from
+  // inside resolve.
+  int resolve(const std::string &address, const std::string &port,
+              callback_t callback);
+  // The callback will not be called
+  void cancel(int id);
+  void clear_cache();
+
+private:
+  struct request_t {
+    int id;
+    std::string address;
+    std::string port;
+    lookup_t lookup;
+  };
+  struct result_t {
+    int id;
+    std::string key;
+    std::vector<resolved_address_t> addresses;
+    int error;
+  };
+  struct cache_entry_t {
+    std::vector<resolved_address_t> addresses;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  // Only used from the poller thread
+  int max_id = 1;
+  std::map<int, callback_t> callbacks;
+  std::map<std::string, cache_entry_t> cache;
+
+  // Shared with the resolver threads, that may outlive the resolver
+  struct shared_t {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<request_t> requests;
+    std::deque<result_t> results;
+    bool stop = false;
+    int threads = 0;
+    int idle = 0;
+    int eventfd = -1;
+    ~shared_t();
+  };
+  std::shared_ptr<shared_t> shared;
+
+  void start();
+  static void thread_loop(std::shared_ptr<shared_t> shared);
+  void results_ready();
+};
+
+// Shared resolver for all the clients
+extern resolver_t resolver;
+} // namespace rtpmidid
@@ -20,9 +20,16 @@
 #pragma once
 
 #include "./iobytes.hpp"
+#include "./multicast.hpp"
 #include "./poller.hpp"
+#include "./portpair.hpp"
+#include "./recvbatch.hpp"
+#include "./resolver.hpp"
 #include "./rtppeer.hpp"
+#include "./sendqueue.hpp"
 #include "./signal.hpp"
+#include "./sockopts.hpp"
+#include <chrono>
 #include <string>
 
 namespace rtpmidid {
@@ -36,13 +43,23 @@ struct address_port_t {
  *
  * It connects to a remote address and port, do all the connection parts,
  * and emits midi events or on_disconnect if not valid.
+ *
+ * On another poller than the global one it needs a resolver and a port pair
+ * allocator on that same poller too. Throws if not.
  */
 class rtpclient {
 
 public:
+  // Where the sockets and timers live
+  poller_t &poller;
+  resolver_t &resolver;
+  port_pair_allocator_t &port_pairs;
   rtppeer peer;
   // signal_t<> connect_failed_event;
   poller_t::timer_t connect_timer;
+  // Sends the MIDI invitation again if the parallel one got no answer
+  poller_t::timer_t midi_invite_timer;
+  std::chrono::steady_clock::time_point connect_start;
   poller_t::timer_t ck_timeout;
   int connect_count =
       3; // how many times we tried to connect, after 3, final fail.
@@ -58,16 +75,38 @@ public:
   /// A simple state machine. We need to send 6 CK one after another, and then
   /// every 10 secs.
   uint8_t timerstate;
+  // Datagrams are read in batches on each poller wakeup. Can be resized.
+  recv_batch_t recv_batch;
+  // Pending name resolution, or 0
+  int resolve_id = 0;
+  // Packets waiting for the sockets to be writable
+  send_queue_t send_queue;
+  bool write_wanted = false;
+  // Kernel drops at the sockets
+  socket_drops_t control_drops;
+  socket_drops_t midi_drops;
+  // Joined multicast group for the MIDI data, if the server uses one, or -1
+  int multicast_socket = -1;
 
-  rtpclient(std::string name);
+  rtpclient(std::string name, poller_t &poller = rtpmidid::poller,
+            resolver_t &resolver = rtpmidid::resolver,
+            port_pair_allocator_t &port_pairs = rtpmidid::port_pairs);
   ~rtpclient();
   void reset();
   void sendto(const io_bytes &pb, rtppeer::port_e port);
+  void flush_send_queue();
+  void close_sockets();
 
   void connect_to(const std::string &address, const std::string &port);
+  void connect_to(const std::vector<resolved_address_t> &addresses,
+                  const std::string &address, const std::string &port);
+  void invite_midi_in_order();
   void connected();
   void send_ck0_with_timeout();
 
   void data_ready(rtppeer::port_e port);
+  void join_multicast();
+  void leave_multicast_feature();
+  void multicast_data_ready();
 };
 } // namespace rtpmidid
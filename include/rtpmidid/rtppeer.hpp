@@ -19,13 +19,22 @@
 
 #pragma once
 #include "exceptions.hpp"
+#include "poller.hpp"
 #include "signal.hpp"
+#include <array>
 #include <arpa/inet.h>
+#include <chrono>
+#include <deque>
 #include <functional>
+#include <map>
+#include <set>
 #include <string>
+#include <time.h>
+#include <vector>
 
 namespace rtpmidid {
 class io_bytes_reader;
+class io_bytes_writer;
 class io_bytes;
 
 class bad_sysex_exception : public ::rtpmidid::exception {
@@ -68,8 +77,47 @@ public:
     DISCONNECT,
     CONNECT_TIMEOUT,
     CK_TIMEOUT,
+    // Could not get local ports. Not a network problem.
+    PORT_ALLOCATION_FAILED,
   };
+  // rtpmidid extension, after the name at IN and OK. Other implementations
+  // just read the name and ignore it. It is the magic and then TLVs of 1 byte
+  // type and 1 byte length.
+  static const uint32_t EXTENSION_MAGIC = 0x524d4944; // "RMID"
+  enum extension_e {
+    EXT_FEATURES = 1,        // uint32, feature_e flags
+    EXT_MULTICAST_GROUP = 2, // multicast_group_t::encode()
+    EXT_SESSION = 3,         // At IN, name of the wanted session
+  };
+  enum feature_e {
+    // Can get the MIDI data from a multicast group
+    FEATURE_MULTICAST = 0x01,
+    // Drops MIDI packets with an already seen sequence number, so it can get
+    // redundant copies
+    FEATURE_REDUNDANCY = 0x02,
+    // Can rebuild a lost MIDI packet from the FEC parity packets
+    FEATURE_FEC = 0x04,
+  };
+  // Window of recent sequence numbers to detect the duplicates
+  static const int DEDUPE_WINDOW = 64;
+  // FEC parity packets. RTP header with this payload type and the first
+  // sequence number of the group, then the packet count, the XOR of the
+  // packet lengths and the XOR of the packets.
+  static const uint8_t FEC_PAYLOAD_TYPE = 0x62;
+  static const int FEC_MAX_GROUP = 16;
+  // RTP header, packet count and length XOR, before the parity data
+  static const size_t FEC_HEADER_SIZE = 12 + 1 + 2;
+  // Partial groups send their parity after this time
+  static constexpr std::chrono::milliseconds FEC_FLUSH{10};
+  // Biggest MIDI packet we can send, and default and min path MTU
+  static const size_t MAX_PACKET_SIZE = 4096 + 12;
+  static const size_t DEFAULT_MTU = 1400;
+  static const size_t MIN_MTU = 64;
+  // Max packets waiting at the reorder window
+  static const size_t REORDER_MAX_HELD = 64;
 
+  // Where the timers run
+  poller_t &poller;
   status_e status;
   uint32_t initiator_id;
   uint32_t remote_ssrc;
@@ -81,7 +129,94 @@ public:
   uint16_t remote_seq_nr;
   uint64_t timestamp_start; // Time in ms
   uint64_t latency;
+  // Kernel receive time of the packet being processed, same units as
+  // get_timestamp(). If no kernel timestamp, time at data_ready.
+  uint64_t rx_timestamp;
+  // Time since the kernel received a packet until we finished processing it
+  struct internal_latency_t {
+    uint64_t count = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+    double average_ms() const {
+      return count ? total_us / (count * 1000.0) : 0.0;
+    }
+  } internal_latency;
   bool waiting_ck;
+  // The MIDI IN was sent before the control port connected. If it gets a NO
+  // it is not final, it is sent again after the control connects.
+  bool early_midi_invite = false;
+  // Our extension. Sent at IN, and at OK only if the IN had one.
+  uint32_t local_features = 0;
+  std::map<uint8_t, std::string> local_extension;
+  // Remote extension, from the last IN or OK
+  bool remote_has_extension = false;
+  uint32_t remote_features = 0;
+  std::map<uint8_t, std::string> remote_extension;
+  // Shared ports serve several sessions, and the remote may ask for one of
+  // them with EXT_SESSION. Then we answer with that name. If it did not ask,
+  // as peers that are not rtpmidid, it gets the default_session. Empty if
+  // the port is not shared.
+  std::set<std::string> sessions;
+  std::string default_session;
+  std::string session;
+  // Max UDP payload of the MIDI packets. Longer MIDI data is sent in several
+  // packets, and long SysEx in segments.
+  size_t mtu = DEFAULT_MTU;
+  // Redundant transmission, for lossy links as WiFi. Each MIDI packet is sent
+  // `copies` times, `gap` apart. Only to peers with FEATURE_REDUNDANCY.
+  struct redundancy_t {
+    int copies = 1;
+    std::chrono::microseconds gap{0};
+  } redundancy;
+  // Copies waiting for their time
+  struct pending_copy_t {
+    std::vector<uint8_t> data;
+    int remaining;
+    std::chrono::steady_clock::time_point when;
+  };
+  std::deque<pending_copy_t> pending_copies;
+  poller_t::timer_t copies_timer;
+  // Recently seen remote sequence numbers. Bit N is last_seq_nr - N.
+  bool seq_window_valid = false;
+  uint16_t seq_window_last = 0;
+  uint64_t seq_window = 0;
+  // MIDI packets dropped as duplicates
+  uint64_t duplicates = 0;
+  // Gaps at the remote sequence numbers, and packets that came later to fill
+  // them
+  uint64_t lost_packets = 0;
+  uint64_t reordered_packets = 0;
+  // After a gap, holds the next MIDI packets up to this time waiting for the
+  // missing ones, to deliver them in order. 0 (default) delivers at once.
+  // Also drops the duplicates.
+  std::chrono::microseconds reorder_window{0};
+  struct held_packet_t {
+    uint16_t seq_nr;
+    std::chrono::steady_clock::time_point arrival;
+    std::vector<uint8_t> data; // From the RTP MIDI header
+  };
+  std::deque<held_packet_t> reorder_held; // By sequence number
+  bool reorder_valid = false;
+  uint16_t reorder_next_seq_nr = 0;
+  poller_t::timer_t reorder_timer;
+  // Sends a XOR parity packet each fec_group MIDI packets, to rebuild one
+  // lost packet of the group. Only to peers with FEATURE_FEC. 0 disabled.
+  int fec_group = 0;
+  std::vector<uint8_t> fec_parity;
+  uint16_t fec_parity_length = 0;
+  uint16_t fec_base_seq_nr = 0;
+  int fec_count = 0;
+  poller_t::timer_t fec_timer;
+  // Last received MIDI packets, to rebuild from the parity
+  struct fec_slot_t {
+    bool valid = false;
+    uint16_t seq_nr;
+    std::vector<uint8_t> data;
+  };
+  std::array<fec_slot_t, FEC_MAX_GROUP> fec_received;
+  // MIDI packets rebuilt, or lost and could not
+  uint64_t fec_recovered = 0;
+  uint64_t fec_unrecoverable = 0;
   // Need some buffer space for sysex. This may require memory alloc.
   std::vector<uint8_t> sysex;
 
@@ -106,13 +241,17 @@ public:
 
   static bool is_command(io_bytes_reader &);
   static bool is_feedback(io_bytes_reader &);
+  static bool is_fec(io_bytes_reader &);
 
-  rtppeer(std::string _name);
+  rtppeer(std::string _name, poller_t &poller_ = rtpmidid::poller);
   ~rtppeer();
 
   bool is_connected() { return status == CONNECTED; }
   void reset();
   void data_ready(io_bytes_reader &&, port_e port);
+  // rx_time is the kernel receive time (SO_TIMESTAMPNS), or 0 if unknown
+  void data_ready(io_bytes_reader &&, port_e port,
+                  const struct timespec &rx_time);
 
   void parse_command(io_bytes_reader &, port_e port);
   void parse_feedback(io_bytes_reader &);
@@ -121,15 +260,38 @@ public:
   void parse_command_ck(io_bytes_reader &, port_e port);
   void parse_command_by(io_bytes_reader &, port_e port);
   void parse_command_no(io_bytes_reader &, port_e port);
+  void parse_extension(io_bytes_reader &);
+  void write_extension(io_bytes_writer &);
   void parse_midi(io_bytes_reader &);
+  void parse_midi_commands(io_bytes_reader &);
+  void reorder_midi(uint16_t seq_nr, io_bytes_reader &);
+  void release_reordered();
   void parse_sysex(io_bytes_reader &, int16_t length);
 
   void send_midi(const io_bytes_reader &buffer);
+  void send_midi_packet(const io_bytes_reader &commands);
+  void send_midi_split(const io_bytes_reader &events);
+  void send_sysex_segments(const uint8_t *sysex, size_t length,
+                           size_t max_commands);
+  size_t max_packet_size() const;
+  // Loss protection for an already sent MIDI packet, as enabled: redundant
+  // copies and FEC parity
+  void send_protection(const io_bytes_reader &packet);
+  void send_copies(const io_bytes_reader &packet);
+  void send_pending_copies();
+  bool is_duplicate(uint16_t seq_nr);
+  void add_fec(const io_bytes_reader &packet);
+  void send_fec_parity();
+  void parse_fec(io_bytes_reader &);
+  void write_midi_header(io_bytes_writer &buffer);
+  static void write_midi_commands(io_bytes_writer &buffer,
+                                  const io_bytes_reader &events);
   void send_goodbye(port_e to_port);
   void send_feedback(uint32_t seqnum);
   void connect_to(port_e rtp_port);
   void send_ck0();
   uint64_t get_timestamp();
+  uint64_t to_timestamp(const struct timespec &spec);
 
   // Journal
   void parse_journal(io_bytes_reader &);
@@ -19,47 +19,154 @@
 
 #pragma once
 
+#include "./multicast.hpp"
+#include "./recvbatch.hpp"
 #include "./rtppeer.hpp"
+#include "./sendqueue.hpp"
+#include "./sockopts.hpp"
+#include <array>
 #include <map>
 #include <memory>
-
-struct sockaddr_in6;
+#include <netinet/in.h>
+#include <set>
+#include <vector>
 
 namespace rtpmidid {
 class rtpserver {
 public:
+  // Network data of a connected peer
+  struct peer_conn_t {
+    rtppeer *peer;
+    struct sockaddr_in6 address;
+    uint16_t remote_base_port;
+    // Connected sockets only for this peer, if peer_sockets. Else -1.
+    int control_socket = -1;
+    int midi_socket = -1;
+    // Packets waiting for the socket to be writable
+    send_queue_t send_queue;
+    // Kernel drops at the peer sockets
+    socket_drops_t control_drops;
+    socket_drops_t midi_drops;
+  };
+
   // Stupid RTPMIDI uses initiator_id sometimes and ssrc other times.
 
   // Maps the peers to the initiator_id.
   std::map<uint32_t, std::shared_ptr<rtppeer>> initiator_to_peer;
   // Maps the peers to the ssrc.
   std::map<uint32_t, std::shared_ptr<rtppeer>> ssrc_to_peer;
+  // Maps the peer network data to the ssrc. Same keys as ssrc_to_peer.
+  std::map<uint32_t, std::shared_ptr<peer_conn_t>> ssrc_to_conn;
 
   // Callbacks to call when new connections
   signal_t<std::shared_ptr<rtppeer>> connected_event;
   signal_t<const io_bytes_reader &> midi_event;
 
+  // Where the sockets and the peers live
+  poller_t &poller;
   std::string name;
+  // Shared port: sessions served at these same ports, by name. See
+  // rtppeer::sessions.
+  std::set<std::string> sessions;
+  // For the peers that do not choose one. The first added.
+  std::string default_session;
 
   int midi_socket;
   int control_socket;
 
   uint16_t midi_port;
   uint16_t control_port;
+  // Kernel drops at the server sockets
+  socket_drops_t control_drops;
+  socket_drops_t midi_drops;
+
+  // Open a connected socket pair per established peer, sharing the server
+  // ports with SO_REUSEPORT. The kernel then does the route lookup once and
+  // demultiplexes the incoming packets to the right peer.
+  bool peer_sockets;
+
+  // Send queue settings for new peers
+  size_t send_queue_max = send_queue_t::DEFAULT_MAX_PACKETS;
+  send_queue_t::drop_policy_e send_drop_policy =
+      send_queue_t::DROP_OLDEST_NON_REALTIME;
+  // Loss protection settings for new peers
+  rtppeer::redundancy_t redundancy;
+  int fec_group = 0;
+  std::chrono::microseconds reorder_window{0};
+  size_t mtu = rtppeer::DEFAULT_MTU;
+  // Sockets with packets waiting, polled for write
+  std::set<int> write_wanted;
 
-  rtpserver(std::string name, const std::string &port);
+  // Datagrams are read in batches on each poller wakeup. Can be resized.
+  recv_batch_t recv_batch;
+
+  // Scratch space to send the same MIDI data to all peers at once. Reused
+  // between calls to avoid allocations.
+  std::vector<struct mmsghdr> fanout_msgs;
+  std::vector<struct iovec> fanout_iovecs;
+  std::vector<std::array<uint8_t, 12>> fanout_headers;
+  std::vector<peer_conn_t *> fanout_conns;
+
+  // Multicast fan-out. The MIDI data is sent once to the group for the peers
+  // that can join it (rtppeer::FEATURE_MULTICAST), and unicast to the rest.
+  // The session does not connect, just keeps the SSRC and sequence of the
+  // group, and all peers use its SSRC.
+  std::unique_ptr<rtppeer> multicast_session;
+  multicast_group_t multicast_group;
+  int multicast_socket = -1;
+  uint64_t multicast_drops = 0;
+
+  rtpserver(std::string name, const std::string &port,
+            bool peer_sockets = false, poller_t &poller = rtpmidid::poller);
   ~rtpserver();
 
   // Returns the peer for that packet, or nullptr
   std::shared_ptr<rtppeer> get_peer_by_packet(io_bytes_reader &b,
                                               rtppeer::port_e port);
   void create_peer_from(io_bytes_reader &&buffer, struct sockaddr_in6 *cliaddr,
-                        rtppeer::port_e port);
+                        const struct timespec &rx_time, rtppeer::port_e port);
 
   void send_midi_to_all_peers(const io_bytes_reader &bufer);
+  // To the peers of that session. Not shared ports have no sessions, so
+  // there it is to all.
+  void send_midi_to_session(const std::string &session,
+                            const io_bytes_reader &buffer);
+  void send_midi_fanout(const io_bytes_reader &buffer,
+                        const std::string *session);
+  void add_session(const std::string &session);
+  // Disconnects the peers that chose it
+  void remove_session(const std::string &session);
+  // Throws if can not create the multicast socket, or at shared ports, as
+  // the group would get the data of all the sessions.
+  void enable_multicast(const multicast_group_t &group);
+  void send_midi_to_multicast(const io_bytes_writer &commands);
+  void send_multicast_packet(const io_bytes_reader &packet);
+  void send_multicast_iov(struct iovec *iov, size_t iovlen);
+  bool is_multicast_peer(const rtppeer *peer) const;
+  // Packets dropped by the kernel, at the server and current peer sockets
+  uint64_t kernel_drops();
+  // Estimated packets rejected by the socket filter. See socket_drops_t.
+  uint64_t filtered_packets();
+  // With socket_options.filter_ssrc, RTP only from the current peers
+  void update_ssrc_filter();
 
   void data_ready(rtppeer::port_e port);
+  void packet_ready(io_bytes_reader &&buffer, struct sockaddr_in6 *cliaddr,
+                    socklen_t len, const struct timespec &rx_time,
+                    rtppeer::port_e port);
   void sendto(const io_bytes_reader &b, rtppeer::port_e port,
-              struct sockaddr_in6 *, int remote_base_port);
+              peer_conn_t *conn);
+  void want_write(int socket);
+  void flush_send_queues();
+  void queue_fanout_msg(peer_conn_t *conn, const struct mmsghdr &msg);
+  void send_fanout_peer_socket(peer_conn_t *conn, const struct mmsghdr &msg);
+  void send_fanout_protection(rtppeer *peer, const struct mmsghdr &msg);
+  static void msg_to_packet(const struct mmsghdr &msg, io_bytes_writer &packet);
+
+  void open_peer_sockets(std::shared_ptr<peer_conn_t> conn,
+                         std::weak_ptr<rtppeer> wpeer);
+  static void close_peer_sockets(poller_t &poller, peer_conn_t *conn);
+  void peer_data_ready(std::weak_ptr<rtppeer> wpeer, int socket,
+                       socket_drops_t *drops, rtppeer::port_e port);
 };
 } // namespace rtpmidid
@@ -0,0 +1,101 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include "./iobytes.hpp"
+#include "./poller.hpp"
+#include <deque>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace rtpmidid {
+/**
+ * @short Bounded outgoing packet queue for one peer
+ *
+ * Packets are sent at once while the socket accepts them. If the socket
+ * buffer is full (EAGAIN) they are parked here in order, and the owner must
+ * wait for the socket to be writable (poller_t::set_fd_out) and call flush().
+ * On other errors, ENOBUFS included, the packet is dropped and counted.
+ *
+ * When full, the drop_policy decides what to discard. By default the oldest
+ * normal MIDI packet is dropped; MIDI realtime (clock) and AppleMIDI command
+ * packets are kept.
+ */
+class send_queue_t {
+public:
+  static const size_t DEFAULT_MAX_PACKETS = 64;
+
+  enum drop_policy_e {
+    DROP_OLDEST_NON_REALTIME = 0,
+    DROP_OLDEST,
+    DROP_NEWEST,
+  };
+  enum packet_kind_e {
+    NORMAL = 0,
+    REALTIME, // MIDI realtime, as clock
+    COMMAND,  // AppleMIDI session commands
+  };
+  enum result_e {
+    SENT = 0,
+    QUEUED,
+    DROPPED,
+  };
+
+  size_t max_packets;
+  drop_policy_e drop_policy;
+  // Total packets dropped, because queue full or send error
+  uint64_t drops = 0;
+  // Its event time is the transmit time of the MIDI packets (SO_TXTIME)
+  poller_t *poller = &rtpmidid::poller;
+
+  send_queue_t(size_t max_packets = DEFAULT_MAX_PACKETS,
+               drop_policy_e drop_policy = DROP_OLDEST_NON_REALTIME);
+
+  // Sends now, or queues if the socket is full or there are packets waiting.
+  // Address can be nullptr for connected sockets. On other errors the packet
+  // is dropped, and counted.
+  result_e send(int fd, const io_bytes_reader &data,
+                const struct sockaddr_in6 *address = nullptr);
+  // Queues without trying to send first
+  result_e push(int fd, const io_bytes_reader &data,
+                const struct sockaddr_in6 *address = nullptr);
+  // Sends as much as possible. Returns true if the queue is now empty.
+  bool flush();
+
+  size_t size() const { return packets.size(); }
+  bool empty() const { return packets.empty(); }
+  // If there are packets waiting for this socket
+  bool pending(int fd) const;
+
+  static packet_kind_e packet_kind(const io_bytes_reader &data);
+
+private:
+  struct packet_t {
+    int fd;
+    packet_kind_e kind;
+    bool has_address;
+    struct sockaddr_in6 address;
+    std::vector<uint8_t> data;
+  };
+  std::deque<packet_t> packets;
+
+  bool make_room(packet_kind_e incoming);
+};
+} // namespace rtpmidid
@@ -0,0 +1,74 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace rtpmidid {
+/**
+ * @short Single producer, single consumer message ring in shared memory
+ *
+ * It is just a view over memory that may be mapped by two processes, one
+ * writing and the other reading. Messages are a 2 bytes length and the data,
+ * and may wrap around the end of the buffer.
+ *
+ * head is only written by the producer and tail only by the consumer, so no
+ * locks are needed.
+ */
+class shm_ring_t {
+public:
+  static const size_t MAX_MESSAGE = 0xFFFF;
+
+  shm_ring_t() = default;
+  // memory must be memory_size(capacity) bytes. The creator calls init().
+  shm_ring_t(void *memory, uint32_t capacity);
+
+  // Capacity must be a power of 2
+  static size_t memory_size(uint32_t capacity);
+  void init();
+
+  // False if there is no space, and then nothing is written. wake is set
+  // when the consumer may have seen the ring empty and must be woken up.
+  bool push(const uint8_t *data, size_t size, bool *wake = nullptr);
+  // Returns the copied size, or 0 if empty. Messages longer than max are
+  // truncated. Throws if the ring is corrupt, as the other side is not
+  // trusted; then nothing is read.
+  size_t pop(uint8_t *data, size_t max);
+  bool empty() const;
+  size_t used() const;
+  uint32_t capacity() const { return ring_capacity; }
+
+private:
+  struct header_t {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+  };
+  static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                "Shared memory needs lock free atomics");
+
+  header_t *header = nullptr;
+  uint8_t *data = nullptr;
+  uint32_t ring_capacity = 0;
+
+  void write_at(uint32_t pos, const uint8_t *src, size_t size);
+  void read_at(uint32_t pos, uint8_t *dst, size_t size) const;
+};
+} // namespace rtpmidid
@@ -19,13 +19,14 @@
 
 #pragma once
 
+#include "callable.hpp"
 #include "logger.hpp"
 #include <functional>
 #include <map>
 
 template <typename... Args> class signal_t {
 public:
-  int connect(std::function<void(Args...)> const &&f) {
+  int connect(rtpmidid::callable_t<void(Args...)> &&f) {
     auto cid = max_id++;
     slots[cid] = std::move(f);
     return cid;
@@ -45,5 +46,5 @@ public:
 
 private:
   uint32_t max_id = 0;
-  std::map<uint32_t, std::function<void(Args...)>> slots;
+  std::map<uint32_t, rtpmidid::callable_t<void(Args...)>> slots;
 };
@@ -0,0 +1,100 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+#include "./poller.hpp"
+#include <stdint.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace rtpmidid {
+/**
+ * @short Options for all the UDP sockets
+ *
+ * Set them before creating servers and clients.
+ */
+struct socket_options_t {
+  // SO_RCVBUF / SO_SNDBUF. 0 is the system default.
+  int rcvbuf = 0;
+  int sndbuf = 0;
+  // When the kernel drops packets the receive buffer grows up to this size
+  int max_rcvbuf = 1024 * 1024;
+  // SO_BUSY_POLL time in us, and SO_PREFER_BUSY_POLL. 0 disabled.
+  int busy_poll_us = 0;
+  // MIDI packets leave at the poller event time plus this (SO_TXTIME), so
+  // the event loop delays do not change the spacing between them. Needs the
+  // fq qdisc at the interface, else they are sent at once. 0 disabled.
+  int txtime_offset_us = 0;
+  // Classic BPF filter at the sockets, so other traffic does not wake the
+  // event loop: only AppleMIDI commands and RTP MIDI (and FEC) packets. With
+  // filter_ssrc, the server MIDI sockets only take RTP from connected peers.
+  bool filter = false;
+  bool filter_ssrc = false;
+};
+
+// Used for all sockets
+extern socket_options_t socket_options;
+
+// Sets the socket_options, and asks for the drop counter (SO_RXQ_OVFL)
+void setup_socket(int fd);
+// Replaces the socket filter. With ssrcs, RTP only from them. Throws on
+// error.
+void attach_rtpmidi_filter(int fd, const std::vector<uint32_t> &ssrcs = {});
+
+/**
+ * @short SCM_TXTIME control message for a MIDI packet
+ *
+ * The time is CLOCK_MONOTONIC, as the fq qdisc wants. Does nothing if
+ * socket_options.txtime_offset_us is 0.
+ */
+class txtime_cmsg_t {
+public:
+  txtime_cmsg_t(poller_t &poller_) : poller(poller_) {}
+  // Sets it as the msg control, for the current poller event time
+  void attach(struct msghdr &msg);
+
+private:
+  poller_t &poller;
+  union {
+    struct cmsghdr header;
+    uint8_t buffer[CMSG_SPACE(sizeof(uint64_t))];
+  } control;
+};
+
+/**
+ * @short Keeps count of the packets the kernel dropped at a socket
+ *
+ * The kernel gives a running counter with each packet (SO_RXQ_OVFL), so drops
+ * are known when the next packet arrives. On new drops it warns and grows the
+ * receive buffer.
+ *
+ * The counter also has the packets rejected by the socket filter. They are
+ * told apart by the receive queue: if it was not near full, the filter
+ * dropped them. So `filtered` is an estimate.
+ */
+class socket_drops_t {
+public:
+  uint64_t drops = 0;
+  uint64_t filtered = 0;
+  uint32_t last_counter = 0;
+
+  // Returns how many new drops
+  uint32_t update(int fd, uint32_t counter);
+};
+} // namespace rtpmidid
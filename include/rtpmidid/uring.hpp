@@ -0,0 +1,82 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace rtpmidid {
+/**
+ * @short Minimal io_uring, just what the poller needs
+ *
+ * Uses the raw syscalls, no liburing. Requests are queued at the submission
+ * ring and sent to the kernel at submit(), that also waits for completions,
+ * so a poller round is a single syscall.
+ *
+ * Throws if io_uring is not available (old kernel, or disabled with the
+ * kernel.io_uring_disabled sysctl).
+ */
+class uring_t {
+public:
+  // io_uring_enter calls, for stats and benchmarks
+  uint64_t syscalls = 0;
+
+  uring_t(unsigned entries = 256);
+  ~uring_t();
+
+  // Requests are queued, and sent at the next submit()
+  void poll_add(int fd, uint32_t events, uint64_t user_data);
+  void poll_remove(uint64_t target_user_data, uint64_t user_data);
+
+  // Sends the queued requests. If wait_ms != 0 and there are no completions
+  // yet, waits for one up to wait_ms (< 0 forever).
+  void submit(int wait_ms = 0);
+  bool has_completions();
+  // Gets the next completion, if any
+  bool next_completion(uint64_t *user_data, int32_t *res);
+
+  // Only closes the fd, so it can be called from a signal handler
+  void close();
+  bool is_open() { return fd >= 0; }
+
+private:
+  int fd = -1;
+  unsigned entries = 0;
+  // Requests queued but not yet given to the kernel
+  unsigned sqe_tail = 0;
+
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  struct io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_sqe *get_sqe();
+  unsigned flush();
+};
+} // namespace rtpmidid
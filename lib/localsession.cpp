@@ -0,0 +1,363 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/localsession.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+
+using namespace rtpmidid;
+
+// Ring 0 is server to client, and ring 1 client to server
+static size_t ring_offset(int ring) {
+  return ring * shm_ring_t::memory_size(local_session_t::RING_CAPACITY);
+}
+
+static void close_fd(int &fd) {
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
+
+static sockaddr_un unix_address(const std::string &path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    throw exception("Local socket path too long: {}", path);
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+local_session_t::local_session_t(const std::string &name_, int control_socket_,
+                                 int memfd_, int rx_eventfd_, int tx_eventfd_)
+    : name(name_), control_socket(control_socket_), memfd(memfd_),
+      rx_eventfd(rx_eventfd_), tx_eventfd(tx_eventfd_) {
+  try {
+    attach(true);
+  } catch (...) {
+    close_fd(control_socket);
+    close_fd(memfd);
+    close_fd(rx_eventfd);
+    close_fd(tx_eventfd);
+    throw;
+  }
+  poller.add_fd_in(control_socket, [this](int) { control_ready(); });
+  control_polled = true;
+}
+
+local_session_t::local_session_t(const std::string &name_,
+                                 int control_socket_)
+    : name(name_), control_socket(control_socket_) {
+  poller.add_fd_in(control_socket, [this](int) { control_ready(); });
+  control_polled = true;
+}
+
+local_session_t::~local_session_t() {
+  if (control_polled)
+    poller.remove_fd(control_socket);
+  if (memory)
+    poller.remove_fd(rx_eventfd);
+  if (memory)
+    munmap(memory, memory_size);
+  close_fd(control_socket);
+  close_fd(memfd);
+  close_fd(rx_eventfd);
+  close_fd(tx_eventfd);
+}
+
+std::shared_ptr<local_session_t>
+local_session_t::connect(const std::string &path, const std::string &name) {
+  if (name.empty() || name.size() > local_server_t::MAX_NAME)
+    throw exception("Invalid local session name: '{}'", name);
+  auto addr = unix_address(path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    throw exception("Can not create local socket. {}", strerror(errno));
+  if (::connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0 ||
+      send(fd, name.data(), name.size(), MSG_NOSIGNAL) < 0) {
+    auto error = strerror(errno);
+    close(fd);
+    throw exception("Can not connect to local session at {}. {}", path,
+                    error);
+  }
+  return std::make_shared<local_session_t>(name, fd);
+}
+
+void local_session_t::attach(bool is_server) {
+  memory_size = ring_offset(2);
+  // Touching the map past the end of the memfd is a SIGBUS
+  struct stat st;
+  if (fstat(memfd, &st) < 0)
+    throw exception("Can not check local session memory. {}", strerror(errno));
+  if ((size_t)st.st_size < memory_size)
+    throw exception("Local session memory too small: {} bytes", st.st_size);
+  memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                memfd, 0);
+  if (memory == MAP_FAILED) {
+    memory = nullptr;
+    throw exception("Can not map local session memory. {}", strerror(errno));
+  }
+  shm_ring_t to_client((uint8_t *)memory + ring_offset(0), RING_CAPACITY);
+  shm_ring_t to_server((uint8_t *)memory + ring_offset(1), RING_CAPACITY);
+  if (is_server) {
+    to_client.init();
+    to_server.init();
+    rx = to_server;
+    tx = to_client;
+  } else {
+    rx = to_client;
+    tx = to_server;
+  }
+  rx_buffer.resize(shm_ring_t::MAX_MESSAGE);
+  poller.add_fd_in(rx_eventfd, [this](int) { data_ready(); });
+}
+
+void local_session_t::control_ready() {
+  if (closed)
+    return;
+  if (!is_connected()) {
+    recv_handshake();
+    return;
+  }
+  // Nothing is sent after the handshake, so this is the other side closing
+  uint8_t data[64];
+  auto ret = recv(control_socket, data, sizeof(data), MSG_DONTWAIT);
+  if (ret > 0 || (ret < 0 && (errno == EAGAIN || errno == EINTR)))
+    return;
+  close_later();
+}
+
+void local_session_t::recv_handshake() {
+  uint8_t data[8];
+  int fds[3];
+  union {
+    cmsghdr header;
+    uint8_t buffer[CMSG_SPACE(sizeof(fds))];
+  } control = {};
+  iovec iov = {data, sizeof(data)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  auto ret = recvmsg(control_socket, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (ret <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    WARNING("Local session {} refused by the server", name);
+    close_later();
+    return;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  memfd = fds[0];
+  rx_eventfd = fds[1];
+  tx_eventfd = fds[2];
+  try {
+    attach(false);
+  } catch (const exception &e) {
+    ERROR("Local session {}: {}", name, e.what());
+    close_later();
+    return;
+  }
+  DEBUG("Local session {} connected", name);
+  connected_event();
+}
+
+// The poller is running our callback now, so it can not be removed here
+void local_session_t::close_later() {
+  closed = true;
+  poller.call_later([weak = weak_from_this()] {
+    auto self = weak.lock();
+    if (!self)
+      return;
+    poller.remove_fd(self->control_socket);
+    self->control_polled = false;
+    self->disconnect_event();
+  });
+}
+
+void local_session_t::send_midi(const io_bytes_reader &buffer) {
+  if (!is_connected() || closed) {
+    DEBUG("Can not send MIDI data to local session {}, not connected.",
+          name);
+    return;
+  }
+  bool wake = false;
+  if (!tx.push(buffer.start, buffer.size(), &wake)) {
+    dropped++;
+    WARNING_ONCE("Local session {} is not reading. Dropping MIDI data.",
+                 name);
+    return;
+  }
+  if (wake) {
+    uint64_t one = 1;
+    if (write(tx_eventfd, &one, sizeof(one)) < 0)
+      DEBUG("Can not wake up local session {}. {}", name, strerror(errno));
+  }
+}
+
+void local_session_t::data_ready() {
+  uint64_t count;
+  if (read(rx_eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    DEBUG("Error reading local session {} eventfd. {}", name,
+          strerror(errno));
+  if (closed)
+    return;
+  // Drain it all, as the other side only wakes us up when it was empty
+  for (;;) {
+    size_t size;
+    try {
+      size = rx.pop(rx_buffer.data(), rx_buffer.size());
+    } catch (const exception &e) {
+      ERROR("Local session {}: {}. Closing it.", name, e.what());
+      close_later();
+      return;
+    }
+    if (size == 0)
+      break;
+    io_bytes_reader reader(rx_buffer.data(), size);
+    midi_event(reader);
+  }
+}
+
+local_server_t::local_server_t(const std::string &path_) : path(path_) {
+  auto addr = unix_address(path);
+  unlink(path.c_str());
+  listen_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_socket < 0)
+    throw exception("Can not create local socket. {}", strerror(errno));
+  if (bind(listen_socket, (const sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_socket, 20) < 0) {
+    auto error = strerror(errno);
+    close_fd(listen_socket);
+    throw exception("Can not listen for local sessions at {}. {}", path,
+                    error);
+  }
+  poller.add_fd_in(listen_socket, [this](int) { accept_connection(); });
+  INFO("Local sessions at {}", path);
+}
+
+local_server_t::~local_server_t() {
+  for (auto fd : pending) {
+    poller.remove_fd(fd);
+    close(fd);
+  }
+  poller.remove_fd(listen_socket);
+  close_fd(listen_socket);
+  unlink(path.c_str());
+}
+
+void local_server_t::accept_connection() {
+  int fd = accept4(listen_socket, nullptr, nullptr,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    WARNING("Can not accept local session. {}", strerror(errno));
+    return;
+  }
+  pending.insert(fd);
+  poller.add_fd_in(fd, [this](int fd) { recv_name(fd); });
+}
+
+void local_server_t::recv_name(int fd) {
+  char name[MAX_NAME + 1];
+  auto ret = recv(fd, name, sizeof(name), 0);
+  if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  // From now the session takes care of the socket, but the poller is
+  // running our callback, so it is replaced later.
+  pending.erase(fd);
+  std::string session_name;
+  if (ret > 0 && ret <= (ssize_t)MAX_NAME)
+    session_name = std::string(name, ret);
+  poller.call_later([this, fd, session_name] {
+    poller.remove_fd(fd);
+    if (session_name.empty()) {
+      close(fd);
+      return;
+    }
+    start_session(fd, session_name);
+  });
+}
+
+void local_server_t::start_session(int fd, const std::string &name) {
+  int memfd = memfd_create("rtpmidid-local", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  int to_client = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int to_server = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  // Sealed at its size, or the client could truncate it under our map
+  if (memfd < 0 || to_client < 0 || to_server < 0 ||
+      ftruncate(memfd, ring_offset(2)) < 0 ||
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) <
+          0) {
+    ERROR("Can not create local session {}. {}", name, strerror(errno));
+    close_fd(memfd);
+    close_fd(to_client);
+    close_fd(to_server);
+    close(fd);
+    return;
+  }
+
+  std::shared_ptr<local_session_t> session;
+  try {
+    session = std::make_shared<local_session_t>(name, fd, memfd, to_server,
+                                                to_client);
+  } catch (const exception &e) {
+    ERROR("Can not create local session {}. {}", name, e.what());
+    return;
+  }
+
+  int fds[3] = {memfd, to_client, to_server};
+  union {
+    cmsghdr header;
+    uint8_t buffer[CMSG_SPACE(sizeof(fds))];
+  } control = {};
+  uint8_t ok[2] = {'O', 'K'};
+  iovec iov = {ok, sizeof(ok)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+    ERROR("Can not send local session {} to the client. {}", name,
+          strerror(errno));
+    return;
+  }
+
+  INFO("New local session {}", name);
+  session_event(session);
+}
@@ -0,0 +1,155 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/multicast.hpp>
+
+using namespace rtpmidid;
+
+multicast_group_t multicast_group_t::parse(const std::string &address,
+                                           const std::string &port) {
+  struct addrinfo hints;
+  struct addrinfo *res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+  auto err = getaddrinfo(address.c_str(), port.c_str(), &hints, &res);
+  if (err != 0) {
+    throw exception("Invalid multicast group {}:{}. {}", address, port,
+                    gai_strerror(err));
+  }
+  multicast_group_t group;
+  memcpy(&group.addr, res->ai_addr, res->ai_addrlen);
+  group.addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  bool is_multicast =
+      group.family() == AF_INET6
+          ? IN6_IS_ADDR_MULTICAST(&((sockaddr_in6 *)&group.addr)->sin6_addr)
+          : IN_MULTICAST(ntohl(((sockaddr_in *)&group.addr)->sin_addr.s_addr));
+  if (!is_multicast) {
+    throw exception("{} is not a multicast address", address);
+  }
+  return group;
+}
+
+std::string multicast_group_t::encode() const {
+  std::string data;
+  if (family() == AF_INET6) {
+    auto addr6 = (const sockaddr_in6 *)&addr;
+    data.push_back(6);
+    data.append((const char *)&addr6->sin6_addr, 16);
+    data.append((const char *)&addr6->sin6_port, 2);
+  } else {
+    auto addr4 = (const sockaddr_in *)&addr;
+    data.push_back(4);
+    data.append((const char *)&addr4->sin_addr, 4);
+    data.append((const char *)&addr4->sin_port, 2);
+  }
+  return data;
+}
+
+std::optional<multicast_group_t>
+multicast_group_t::decode(const std::string &data) {
+  multicast_group_t group;
+  if (data.size() == 1 + 16 + 2 && data[0] == 6) {
+    auto addr6 = (sockaddr_in6 *)&group.addr;
+    addr6->sin6_family = AF_INET6;
+    memcpy(&addr6->sin6_addr, data.data() + 1, 16);
+    memcpy(&addr6->sin6_port, data.data() + 17, 2);
+    group.addrlen = sizeof(sockaddr_in6);
+  } else if (data.size() == 1 + 4 + 2 && data[0] == 4) {
+    auto addr4 = (sockaddr_in *)&group.addr;
+    addr4->sin_family = AF_INET;
+    memcpy(&addr4->sin_addr, data.data() + 1, 4);
+    memcpy(&addr4->sin_port, data.data() + 5, 2);
+    group.addrlen = sizeof(sockaddr_in);
+  } else {
+    return std::nullopt;
+  }
+  return group;
+}
+
+std::string multicast_group_t::to_string() const {
+  char host[NI_MAXHOST], service[NI_MAXSERV];
+  host[0] = service[0] = 0;
+  getnameinfo((const sockaddr *)&addr, addrlen, host, NI_MAXHOST, service,
+              NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+  return fmt::format("{}:{}", host, service);
+}
+
+int rtpmidid::multicast_sender_socket(const multicast_group_t &group) {
+  int fd = socket(group.family(), SOCK_DGRAM, 0);
+  if (fd < 0) {
+    throw exception("Can not create multicast socket. {}", strerror(errno));
+  }
+  return fd;
+}
+
+int rtpmidid::multicast_join(const multicast_group_t &group) {
+  int fd = socket(group.family(), SOCK_DGRAM, 0);
+  if (fd < 0) {
+    throw exception("Can not create multicast socket. {}", strerror(errno));
+  }
+
+  try {
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+      throw exception("Can not set SO_REUSEADDR. {}", strerror(errno));
+    }
+
+    // Bound to the group address, so other groups at the same port are not
+    // received here.
+    if (bind(fd, (const sockaddr *)&group.addr, group.addrlen) < 0) {
+      throw exception("Can not bind to multicast group {}. {}",
+                      group.to_string(), strerror(errno));
+    }
+
+    int ret;
+    if (group.family() == AF_INET6) {
+      struct ipv6_mreq mreq;
+      memset(&mreq, 0, sizeof(mreq));
+      mreq.ipv6mr_multiaddr = ((const sockaddr_in6 *)&group.addr)->sin6_addr;
+      ret = setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+    } else {
+      struct ip_mreqn mreq;
+      memset(&mreq, 0, sizeof(mreq));
+      mreq.imr_multiaddr = ((const sockaddr_in *)&group.addr)->sin_addr;
+      ret = setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+    if (ret < 0) {
+      throw exception("Can not join multicast group {}. {}", group.to_string(),
+                      strerror(errno));
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  return fd;
+}
@@ -17,46 +17,119 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <poll.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <rtpmidid/exceptions.hpp>
 #include <rtpmidid/logger.hpp>
 #include <rtpmidid/poller.hpp>
+#include <rtpmidid/uring.hpp>
 
 using namespace rtpmidid;
 
+/**
+ * Timers are a 4-ary min heap of deadlines. The callbacks stay at a slot
+ * table, so sifting only moves the small heap entries, and each slot knows
+ * its heap position for O(log n) removal by handle.
+ *
+ * The first deadline is armed at a timerfd in the polled set, so the wait
+ * wakes up at it with nanosecond precission, not the ms of epoll_wait.
+ */
 struct timer_event_t {
   std::chrono::steady_clock::time_point when;
-  int id;
-  std::function<void(void)> callback;
+  uint32_t slot;
+};
+
+struct timer_slot_t {
+  uint64_t id = 0; // 0 if free
+  size_t heap_index;
+  poller_t::callback_t callback;
+};
+
+static const size_t TIMER_HEAP_ARITY = 4;
+
+/**
+ * Handler of an fd, at a table indexed by the fd.
+ *
+ * The epoll data and io_uring user data is the fd and a generation, so events
+ * for a handler removed or replaced during the current batch are skipped.
+ */
+struct fd_handler_t {
+  poller_t::fd_callback_t callback;
+  uint64_t user_data = 0; // 0 if not added
+  // Only for IO_URING. The poll is one shot, and armed again after the
+  // callback, so it is level triggered as epoll.
+  uint32_t events = 0;
+  bool armed = false;
 };
 
+// Completions of POLL_REMOVE are not for any fd
+static const uint64_t URING_REMOVE_DATA = 1ULL << 63;
+
 struct poller_private_data_t {
   int epollfd;
-  std::map<int, std::function<void(int)>> fd_events;
+  int timerfd;
+  // Deadline armed at the timerfd, to only change it when the first timer
+  // changes.
+  std::chrono::steady_clock::time_point timerfd_armed;
+  // A deque, so growing does not move the handlers, as one may be running
+  std::deque<fd_handler_t> fd_handlers;
+  size_t fd_count = 0; // Added with add_fd_*, so without the timerfd
+  uint32_t fd_generation = 0;
+  // Removed during a batch. Kept until it ends, as it may be the running one.
+  std::vector<poller_t::fd_callback_t> removed_fd_callbacks;
   std::vector<timer_event_t> timer_events;
-  std::vector<std::function<void(void)>> later_events;
-  int max_timer_id = 1;
+  std::vector<timer_slot_t> timer_slots;
+  std::vector<uint32_t> free_timer_slots;
+  uint64_t timer_sequence = 0;
+  std::vector<poller_t::callback_t> later_events;
+  // Spare for run_call_later_events, to keep the capacity between runs
+  std::vector<poller_t::callback_t> later_events_spare;
+  std::chrono::microseconds busy_poll{0};
+  poller_t::backend_e backend = poller_t::EPOLL;
+  uint64_t syscalls = 0;
+  std::chrono::steady_clock::time_point event_time;
+
+  // Only for IO_URING
+  std::unique_ptr<uring_t> uring;
 };
 
 poller_t rtpmidid::poller;
 
-static bool poller_initialized = false;
+static void timerfd_read(poller_private_data_t *pd);
+static uint64_t fd_user_data(poller_private_data_t *pd, int fd);
+static void uring_arm(poller_private_data_t *pd, int fd, fd_handler_t &handler);
 
 poller_t::poller_t() {
-  if (poller_initialized) {
-    throw exception("Poller already initialized. Can only use one poller "
-                    "(rtpmidid::poller).");
-  }
-  poller_initialized = true;
-
   poller_private_data_t *pd = new poller_private_data_t;
   pd->epollfd = epoll_create1(0);
   if (pd->epollfd < 0) {
     throw exception("Could not start epoll: {}", strerror(errno));
   }
+  // steady_clock is CLOCK_MONOTONIC, so deadlines are armed as they are
+  pd->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (pd->timerfd < 0) {
+    throw exception("Could not create timerfd: {}", strerror(errno));
+  }
+  pd->fd_handlers.resize(pd->timerfd + 1);
+  auto &handler = pd->fd_handlers[pd->timerfd];
+  handler.callback = [pd](int) { timerfd_read(pd); };
+  handler.user_data = fd_user_data(pd, pd->timerfd);
+  handler.events = POLLIN;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = handler.user_data;
+  if (epoll_ctl(pd->epollfd, EPOLL_CTL_ADD, pd->timerfd, &ev) == -1) {
+    throw exception("Could not add timerfd to epoll: {}", strerror(errno));
+  }
   this->private_data = pd;
 }
 poller_t::~poller_t() {
@@ -65,101 +138,266 @@ poller_t::~poller_t() {
 
   auto pd = static_cast<poller_private_data_t *>(private_data);
   delete pd;
-  poller_initialized = false;
 }
 
 bool poller_t::is_open() {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
+  if (pd->uring)
+    return pd->uring->is_open();
   return pd->epollfd > 0;
 }
 
 void poller_t::close() {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
+  if (pd->uring)
+    pd->uring->close();
   if (pd->epollfd > 0) {
     ::close(pd->epollfd);
     pd->epollfd = -1;
   }
+  if (pd->timerfd > 0) {
+    ::close(pd->timerfd);
+    pd->timerfd = -1;
+  }
 }
 
-void poller_t::add_fd_inout(int fd, std::function<void(int)> f) {
+void poller_t::set_backend(backend_e backend) {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
-  pd->fd_events[fd] = f;
+  if (backend == pd->backend)
+    return;
+  if (pd->fd_count > 0) {
+    throw exception("Can not change the poller backend with fds added");
+  }
+  if (backend == IO_URING) {
+    // Throws if not available
+    pd->uring = std::make_unique<uring_t>();
+    uring_arm(pd, pd->timerfd, pd->fd_handlers[pd->timerfd]);
+  } else {
+    pd->uring.reset();
+    pd->fd_handlers[pd->timerfd].armed = false;
+  }
+  pd->backend = backend;
+}
+
+poller_t::backend_e poller_t::get_backend() {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+
+  return pd->backend;
+}
+
+uint64_t poller_t::syscalls() {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+
+  return pd->syscalls + (pd->uring ? pd->uring->syscalls : 0);
+}
+
+std::chrono::steady_clock::time_point poller_t::event_time() {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+  return pd->event_time;
+}
+
+void poller_t::set_event_time(std::chrono::steady_clock::time_point time) {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+  pd->event_time = time;
+}
+
+/// The handler for the fd, if it is added and is this user data (or any, if
+/// 0), else nullptr.
+static fd_handler_t *fd_handler(poller_private_data_t *pd, int fd,
+                                uint64_t user_data = 0) {
+  if (fd < 0 || size_t(fd) >= pd->fd_handlers.size())
+    return nullptr;
+  auto &handler = pd->fd_handlers[fd];
+  if (handler.user_data == 0 ||
+      (user_data != 0 && handler.user_data != user_data))
+    return nullptr;
+  return &handler;
+}
+
+/// Never 0, and without the URING_REMOVE_DATA bit
+static uint64_t fd_user_data(poller_private_data_t *pd, int fd) {
+  auto generation = ++pd->fd_generation & 0x7FFFFFFF;
+  if (generation == 0)
+    generation = ++pd->fd_generation & 0x7FFFFFFF;
+  return (uint64_t(generation) << 32) | uint32_t(fd);
+}
+
+static void uring_arm(poller_private_data_t *pd, int fd,
+                      fd_handler_t &handler) {
+  pd->uring->poll_add(fd, handler.events, handler.user_data);
+  handler.armed = true;
+}
+
+/// Cancels the current poll. Submitted at once, as io_uring keeps a
+/// reference to the socket until then.
+static void uring_disarm(poller_private_data_t *pd, fd_handler_t &handler) {
+  if (!handler.armed)
+    return;
+  pd->uring->poll_remove(handler.user_data, URING_REMOVE_DATA);
+  pd->uring->submit(0);
+  handler.armed = false;
+}
+
+static void add_fd(poller_private_data_t *pd, int fd,
+                   poller_t::fd_callback_t f, uint32_t events) {
+  if (fd < 0) {
+    throw exception("Can't add fd {} to poller: invalid fd", fd);
+  }
+  if (fd_handler(pd, fd)) {
+    throw exception("Can't add fd {} to poller: already added", fd);
+  }
+  if (size_t(fd) >= pd->fd_handlers.size())
+    pd->fd_handlers.resize(fd + 1);
+  auto &handler = pd->fd_handlers[fd];
+  auto user_data = fd_user_data(pd, fd);
+
+  if (pd->backend == poller_t::IO_URING) {
+    handler.callback = std::move(f);
+    handler.user_data = user_data;
+    handler.events = events;
+    uring_arm(pd, fd, handler);
+    pd->fd_count++;
+    return;
+  }
+
   struct epoll_event ev;
   memset(&ev, 0, sizeof(ev));
 
-  ev.events = EPOLLIN | EPOLLOUT;
-  ev.data.fd = fd;
+  ev.events = events;
+  ev.data.u64 = user_data;
+  pd->syscalls++;
   auto r = epoll_ctl(pd->epollfd, EPOLL_CTL_ADD, fd, &ev);
   if (r == -1) {
     throw exception("Can't add fd {} to poller: {} ({})", fd, strerror(errno),
                     errno);
   }
+  handler.callback = std::move(f);
+  handler.user_data = user_data;
+  handler.events = events;
+  pd->fd_count++;
 }
-void poller_t::add_fd_in(int fd, std::function<void(int)> f) {
+
+void poller_t::add_fd_inout(int fd, fd_callback_t f) {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
-  pd->fd_events[fd] = f;
-  struct epoll_event ev;
-  memset(&ev, 0, sizeof(ev));
+  add_fd(pd, fd, std::move(f), EPOLLIN | EPOLLOUT);
+}
+void poller_t::add_fd_in(int fd, fd_callback_t f) {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
 
-  ev.events = EPOLLIN;
-  ev.data.fd = fd;
-  auto r = epoll_ctl(pd->epollfd, EPOLL_CTL_ADD, fd, &ev);
-  if (r == -1) {
-    throw exception("Can't add fd {} to poller: {} ({}, ep {})", fd,
-                    strerror(errno), errno);
-  }
+  add_fd(pd, fd, std::move(f), EPOLLIN);
 }
-void poller_t::add_fd_out(int fd, std::function<void(int)> f) {
+void poller_t::add_fd_out(int fd, fd_callback_t f) {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
-  pd->fd_events[fd] = f;
-  struct epoll_event ev;
-  memset(&ev, 0, sizeof(ev));
+  add_fd(pd, fd, std::move(f), EPOLLOUT);
+}
 
-  ev.events = EPOLLOUT;
-  ev.data.fd = fd;
-  auto r = epoll_ctl(pd->epollfd, EPOLL_CTL_ADD, fd, &ev);
-  if (r == -1) {
-    throw exception("Can't add fd {} to poller: {} ({})", fd, strerror(errno),
-                    errno);
+static void timer_place(poller_private_data_t *pd, size_t index,
+                        const timer_event_t &event) {
+  pd->timer_events[index] = event;
+  pd->timer_slots[event.slot].heap_index = index;
+}
+
+static void timer_sift_up(poller_private_data_t *pd, size_t index) {
+  auto &heap = pd->timer_events;
+  auto event = heap[index];
+  while (index > 0) {
+    auto parent = (index - 1) / TIMER_HEAP_ARITY;
+    if (heap[parent].when <= event.when)
+      break;
+    timer_place(pd, index, heap[parent]);
+    index = parent;
   }
+  timer_place(pd, index, event);
 }
 
-poller_t::timer_t poller_t::add_timer_event(std::chrono::milliseconds ms,
-                                            std::function<void(void)> f) {
+static void timer_sift_down(poller_private_data_t *pd, size_t index) {
+  auto &heap = pd->timer_events;
+  auto event = heap[index];
+  auto size = heap.size();
+  for (;;) {
+    auto first = index * TIMER_HEAP_ARITY + 1;
+    if (first >= size)
+      break;
+    auto last = std::min(first + TIMER_HEAP_ARITY, size);
+    auto min = first;
+    for (auto child = first + 1; child < last; child++) {
+      if (heap[child].when < heap[min].when)
+        min = child;
+    }
+    if (event.when <= heap[min].when)
+      break;
+    timer_place(pd, index, heap[min]);
+    index = min;
+  }
+  timer_place(pd, index, event);
+}
 
-  using namespace std::chrono_literals;
+/// Removes from the heap and frees the slot. Returns the callback, as it
+/// may be the one running now.
+static poller_t::callback_t timer_remove(poller_private_data_t *pd,
+                                         uint32_t slot) {
+  auto &timer_slot = pd->timer_slots[slot];
+  auto index = timer_slot.heap_index;
+  auto callback = std::move(timer_slot.callback);
+  timer_slot.id = 0;
+  timer_slot.callback = nullptr;
+  pd->free_timer_slots.push_back(slot);
+
+  auto &heap = pd->timer_events;
+  auto last = heap.back();
+  heap.pop_back();
+  if (index < heap.size()) {
+    timer_place(pd, index, last);
+    if (index > 0 && heap[(index - 1) / TIMER_HEAP_ARITY].when > last.when)
+      timer_sift_up(pd, index);
+    else
+      timer_sift_down(pd, index);
+  }
+  return callback;
+}
 
+poller_t::timer_t poller_t::add_timer_event(std::chrono::nanoseconds ns,
+                                            callback_t f) {
   // We can not call directly as it might need to be called out of this call
   // stack
-  if (ms.count() <= 0) {
-    // DEBUG("Not added to timer list, but to call later list. {}ms",
-    // ms.count());
-    call_later(f);
-    return poller_t::timer_t(0);
+  if (ns.count() <= 0) {
+    // DEBUG("Not added to timer list, but to call later list. {}ns",
+    // ns.count());
+    call_later(std::move(f));
+    return poller_t::timer_t();
   }
 
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
-  // This 1ms is because of the precission mismatch later. now() is in
-  // microseconds, and later we need also ms. This way we ensure ms precission.
-  auto timer_id = pd->max_timer_id++;
-  auto when = std::chrono::steady_clock::now() + ms + 1ms;
+  auto when = std::chrono::steady_clock::now() + ns;
+
+  uint32_t slot;
+  if (!pd->free_timer_slots.empty()) {
+    slot = pd->free_timer_slots.back();
+    pd->free_timer_slots.pop_back();
+  } else {
+    slot = pd->timer_slots.size();
+    pd->timer_slots.emplace_back();
+  }
+  auto timer_id = (++pd->timer_sequence << 32) | slot;
+  auto &timer_slot = pd->timer_slots[slot];
+  timer_slot.id = timer_id;
+  timer_slot.callback = std::move(f);
 
-  pd->timer_events.push_back(timer_event_t{when, timer_id, f});
-  std::sort(std::begin(pd->timer_events), std::end(pd->timer_events),
-            [](const auto &a, const auto &b) { return a.when < b.when; });
+  pd->timer_events.push_back(timer_event_t{when, slot});
+  timer_sift_up(pd, pd->timer_events.size() - 1);
 
   // DEBUG("Added timer {}. {} s ({} pending)", timer_id, in_ms,
   // timer_events.size());
-  return poller_t::timer_t(timer_id);
+  return poller_t::timer_t(this, timer_id);
 }
 
-void poller_t::call_later(std::function<void(void)> later_f) {
+void poller_t::call_later(callback_t later_f) {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
   pd->later_events.push_back(std::move(later_f));
@@ -168,8 +406,24 @@ void poller_t::call_later(std::function<void(void)> later_f) {
 void poller_t::remove_fd(int fd) {
   auto pd = static_cast<poller_private_data_t *>(private_data);
 
-  pd->fd_events.erase(fd);
-  if (is_open()) {
+  auto handler = fd_handler(pd, fd);
+  if (!handler) {
+    // After close all is removed anyway
+    if (!is_open())
+      return;
+    throw exception("Can't remove fd {} from poller: not added", fd);
+  }
+
+  if (pd->backend == IO_URING && is_open())
+    uring_disarm(pd, *handler);
+  pd->removed_fd_callbacks.push_back(std::move(handler->callback));
+  handler->callback = nullptr;
+  handler->user_data = 0;
+  handler->armed = false;
+  pd->fd_count--;
+
+  if (pd->backend != IO_URING && is_open()) {
+    pd->syscalls++;
     auto r = epoll_ctl(pd->epollfd, EPOLL_CTL_DEL, fd, NULL);
     if (r == -1) {
       throw exception("Can't remove fd {} from poller: {} ({})", fd,
@@ -178,17 +432,56 @@ void poller_t::remove_fd(int fd) {
   }
 }
 
+void poller_t::set_fd_out(int fd, bool wants_out) {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+
+  auto handler = fd_handler(pd, fd);
+  if (!handler) {
+    throw exception("Can't modify fd {} at poller: not added", fd);
+  }
+
+  if (pd->backend == IO_URING) {
+    uint32_t events = wants_out ? (POLLIN | POLLOUT) : POLLIN;
+    if (events == handler->events)
+      return;
+    uring_disarm(pd, *handler);
+    handler->events = events;
+    // New generation, to ignore a completion of the old poll
+    handler->user_data = fd_user_data(pd, fd);
+    uring_arm(pd, fd, *handler);
+    return;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+
+  ev.events = wants_out ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  ev.data.u64 = handler->user_data;
+  pd->syscalls++;
+  auto r = epoll_ctl(pd->epollfd, EPOLL_CTL_MOD, fd, &ev);
+  if (r == -1) {
+    throw exception("Can't modify fd {} at poller: {} ({})", fd,
+                    strerror(errno), errno);
+  }
+}
+
+void poller_t::set_busy_poll(std::chrono::microseconds budget) {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+
+  pd->busy_poll = budget;
+}
+
 void poller_t::remove_timer(timer_t &tid) {
   // already invalidated
   if (tid.id == 0) {
     return;
   }
   auto pd = static_cast<poller_private_data_t *>(private_data);
-  //  DEBUG("Remove {}. {}? {}", tid.id, b.id, b.id == tid.id);
-  pd->timer_events.erase(
-      std::remove_if(pd->timer_events.begin(), pd->timer_events.end(),
-                     [&tid](const auto &b) { return b.id == tid.id; }),
-      pd->timer_events.end());
+  uint32_t slot = tid.id & 0xFFFFFFFF;
+  // Already called, or removed by clear_timers
+  if (slot < pd->timer_slots.size() && pd->timer_slots[slot].id == tid.id) {
+    timer_remove(pd, slot);
+  }
   // DEBUG("Remove timer {}. {} left", tid.id, pd->timer_events.size());
   // Invalidate
   tid.id = 0;
@@ -197,115 +490,253 @@ void poller_t::remove_timer(timer_t &tid) {
 void poller_t::clear_timers() {
   auto pd = static_cast<poller_private_data_t *>(private_data);
   pd->timer_events.clear();
+  pd->timer_slots.clear();
+  pd->free_timer_slots.clear();
 }
 
 static int chrono_ms_to_int(std::chrono::milliseconds &ms) {
   return std::chrono::duration_cast<std::chrono::milliseconds>(ms).count();
 }
 
-static int ms_to_now(std::chrono::steady_clock::time_point &tp) {
-  return std::chrono::duration_cast<std::chrono::milliseconds>(
-             tp - std::chrono::steady_clock::now())
-      .count();
+/// Arms the timerfd at the first deadline, if changed. When there are no
+/// timers it is left as is; an old deadline only wakes up for nothing.
+static void timerfd_arm(poller_private_data_t *pd) {
+  if (pd->timer_events.empty())
+    return;
+  auto when = pd->timer_events[0].when;
+  if (when == pd->timerfd_armed)
+    return;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                when.time_since_epoch())
+                .count();
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = ns / 1'000'000'000;
+  spec.it_value.tv_nsec = ns % 1'000'000'000;
+  // All zero would disarm it
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    spec.it_value.tv_nsec = 1;
+  pd->syscalls++;
+  if (timerfd_settime(pd->timerfd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+    ERROR("Could not arm timerfd: {}", strerror(errno));
+    return;
+  }
+  pd->timerfd_armed = when;
+}
+
+/// Clears the expiration, as it is level triggered. The timers are run after
+/// the fd events anyway.
+static void timerfd_read(poller_private_data_t *pd) {
+  uint64_t expirations;
+  pd->syscalls++;
+  if (::read(pd->timerfd, &expirations, sizeof(expirations)) > 0)
+    pd->timerfd_armed = {};
 }
 
-static void run_expired_timer_events(std::vector<timer_event_t> &events) {
+static void run_expired_timer_events(poller_private_data_t *pd) {
+  auto &events = pd->timer_events;
   // if (events.size()) {
   //   DEBUG("Next event in {} ms", ms_to_now(events[0].when));
   // }
 
-  while (events.size() > 0 && ms_to_now(events[0].when) <= 0) {
-    // Will ensure remove via RTTI
-    auto firstI = events.begin();
-    poller_t::timer_t id(firstI->id);
-    firstI->callback();
-
-    // There is no need for this erase, as the operator= for the timer_t
-    // ensures removal. This is this way to allow use of RTTI on more
-    // complex items.
-    // pd->timer_events.erase(firstI);
+  // New timers from the callbacks are always later than this
+  auto now = std::chrono::steady_clock::now();
+  while (events.size() > 0 && events[0].when <= now) {
+    auto when = events[0].when;
+    // Out of the heap, as the callback may add or remove timers, even this one
+    auto callback = timer_remove(pd, events[0].slot);
+    pd->event_time = when;
+    // As for the fd callbacks, one failing must not stop the loop
+    try {
+      callback();
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Caught exception at timer: {}", e.what());
+    }
   }
 }
 
 void run_call_later_events(poller_private_data_t *pd) {
+  // Taken, not borrowed, in case a callback waits at the poller
+  std::vector<poller_t::callback_t> call_now;
+  std::swap(call_now, pd->later_events_spare);
   while (!pd->later_events.empty()) {
-    std::vector<std::function<void(void)>> call_now;
     // Clean the later, get the now.
     std::swap(call_now, pd->later_events);
     for (auto &f : call_now) {
       f();
     }
+    call_now.clear();
   }
+  std::swap(call_now, pd->later_events_spare);
 }
 
-void poller_t::wait(std::optional<std::chrono::milliseconds> max_wait_ms) {
-  auto pd = static_cast<poller_private_data_t *>(private_data);
-
+static void epoll_wait_and_run(poller_private_data_t *pd, int wait_ms) {
   const auto MAX_EVENTS = 10;
   struct epoll_event events[MAX_EVENTS];
-  auto wait_ms = 10'000'000; // not forever, but a lot (10'000s)
-
-  // Maybe some default value, set as max wait
-  if (max_wait_ms.has_value()) {
-    auto max_wait_in_ms = chrono_ms_to_int(max_wait_ms.value());
-    wait_ms = max_wait_in_ms;
-  }
-
-  // How long should I wait at max
-  if (!pd->timer_events.empty()) {
-    wait_ms = ms_to_now(pd->timer_events[0].when);
-    wait_ms = std::max(wait_ms, 0); // min wait 0ms.
-  }
-  // DEBUG("Wait {} ms", wait_ms);
-  run_call_later_events(pd);
 
   // wait, get events or timeouts
   auto nfds = 0;
   if (wait_ms != 0) { // Maybe no wait. Some timer event pending.
-    nfds = epoll_wait(pd->epollfd, events, MAX_EVENTS, wait_ms);
+    // Spin some time before going to sleep
+    if (pd->busy_poll.count() > 0) {
+      auto budget =
+          std::min(pd->busy_poll, std::chrono::microseconds(
+                                      std::chrono::milliseconds(wait_ms)));
+      auto until = std::chrono::steady_clock::now() + budget;
+      do {
+        pd->syscalls++;
+        nfds = epoll_wait(pd->epollfd, events, MAX_EVENTS, 0);
+      } while (nfds == 0 && std::chrono::steady_clock::now() < until);
+    }
+    if (nfds == 0) {
+      pd->syscalls++;
+      nfds = epoll_wait(pd->epollfd, events, MAX_EVENTS, wait_ms);
+    }
 
     if (nfds == -1)
       ERROR("epoll_wait failed: {}", strerror(errno));
   }
+  if (nfds > 0)
+    pd->event_time = std::chrono::steady_clock::now();
 
   // Run events
   for (auto n = 0; n < nfds; n++) {
     // DEBUG("IO EVENT");
-    auto fd = events[n].data.fd;
+    auto user_data = events[n].data.u64;
+    int fd = int(user_data & 0xFFFFFFFF);
+    // Removed by a previous callback of this batch
+    auto handler = fd_handler(pd, fd, user_data);
+    if (!handler)
+      continue;
     try {
-      pd->fd_events[fd](fd);
+      handler->callback(fd);
     } catch (const std::exception &e) {
       ERROR_ONCE("Caught exception at poller: {}", e.what());
     }
   }
+}
+
+/**
+ * Same as epoll, but with io_uring polls. Arming the polls again and waiting
+ * is a single io_uring_enter.
+ */
+static void uring_wait(poller_private_data_t *pd, int wait_ms) {
+  auto uring = pd->uring.get();
+  if (wait_ms == 0 || !uring->is_open())
+    return;
+
+  try {
+    // Spin some time before going to sleep. Completions are at shared
+    // memory, so this is only a syscall to send the pending polls.
+    if (pd->busy_poll.count() > 0) {
+      uring->submit(0);
+      auto budget =
+          std::min(pd->busy_poll, std::chrono::microseconds(
+                                      std::chrono::milliseconds(wait_ms)));
+      auto until = std::chrono::steady_clock::now() + budget;
+      while (!uring->has_completions() &&
+             std::chrono::steady_clock::now() < until)
+        ;
+    }
+    uring->submit(wait_ms);
+  } catch (const std::exception &e) {
+    ERROR("io_uring wait failed: {}", e.what());
+    return;
+  }
+
+  pd->event_time = std::chrono::steady_clock::now();
+  uint64_t user_data;
+  int32_t res;
+  while (uring->next_completion(&user_data, &res)) {
+    if (user_data & URING_REMOVE_DATA)
+      continue;
+    int fd = int(user_data & 0xFFFFFFFF);
+    // Removed, or an old poll for this fd
+    auto handler = fd_handler(pd, fd, user_data);
+    if (!handler)
+      continue;
+    handler->armed = false;
+    if (res < 0) {
+      ERROR_ONCE("io_uring poll failed for fd {}: {}", fd, strerror(-res));
+      continue;
+    }
+
+    try {
+      handler->callback(fd);
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Caught exception at poller: {}", e.what());
+    }
+
+    // The callback may have removed or changed it. The handler is still
+    // there, as the table never shrinks.
+    if (handler->user_data == user_data && !handler->armed) {
+      uring_arm(pd, fd, *handler);
+    }
+  }
+}
+
+void poller_t::wait(std::optional<std::chrono::milliseconds> max_wait_ms) {
+  auto pd = static_cast<poller_private_data_t *>(private_data);
+
+  auto wait_ms = 10'000'000; // not forever, but a lot (10'000s)
+
+  // Maybe some default value, set as max wait
+  if (max_wait_ms.has_value()) {
+    auto max_wait_in_ms = chrono_ms_to_int(max_wait_ms.value());
+    wait_ms = max_wait_in_ms;
+  }
+
+  // DEBUG("Wait {} ms", wait_ms);
+  run_call_later_events(pd);
+
+  // The timerfd wakes up at the next timer. If already expired, as a call
+  // later was slow, do not wait.
+  if (!pd->timer_events.empty()) {
+    if (pd->timer_events[0].when <= std::chrono::steady_clock::now())
+      wait_ms = 0;
+    else
+      timerfd_arm(pd);
+  }
+
+  if (pd->backend == IO_URING) {
+    uring_wait(pd, wait_ms);
+  } else {
+    epoll_wait_and_run(pd, wait_ms);
+  }
 
   run_call_later_events(pd);
-  run_expired_timer_events(pd->timer_events);
+  run_expired_timer_events(pd);
   run_call_later_events(pd);
+  pd->removed_fd_callbacks.clear();
 }
 
-poller_t::timer_t::timer_t() : id(0) {}
-poller_t::timer_t::timer_t(int id_) : id(id_) {}
+poller_t::timer_t::timer_t() : id(0), poller(nullptr) {}
+poller_t::timer_t::timer_t(poller_t *poller_, uint64_t id_)
+    : id(id_), poller(poller_) {}
 poller_t::timer_t::timer_t(poller_t::timer_t &&other) {
   id = other.id;
+  poller = other.poller;
   other.id = 0;
 }
 poller_t::timer_t::~timer_t() {
   if (id != 0) {
-    poller.remove_timer(*this);
+    poller->remove_timer(*this);
   }
 }
 poller_t::timer_t &poller_t::timer_t::operator=(poller_t::timer_t &&other) {
   if (id != 0) {
-    poller.remove_timer(*this);
+    poller->remove_timer(*this);
   }
   id = other.id;
+  poller = other.poller;
   other.id = 0;
 
   return *this;
 }
 
 void poller_t::timer_t::disable() {
-  poller.remove_timer(*this);
+  if (id != 0)
+    poller->remove_timer(*this);
   id = 0;
 }
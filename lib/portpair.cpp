@@ -0,0 +1,191 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/portpair.hpp>
+
+using namespace rtpmidid;
+
+port_pair_allocator_t rtpmidid::port_pairs;
+
+port_pair_allocator_t::port_pair_allocator_t(poller_t &poller_)
+    : poller(poller_) {}
+
+/// Returns the socket bound to the port (0 any) or -1 with errno set
+static int bind_socket(int family, uint16_t port) {
+  int fd = socket(family, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_storage addr;
+  socklen_t len;
+  memset(&addr, 0, sizeof(addr));
+  if (family == AF_INET6) {
+    auto addr6 = (sockaddr_in6 *)&addr;
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_addr = in6addr_any;
+    addr6->sin6_port = htons(port);
+    len = sizeof(sockaddr_in6);
+  } else {
+    auto addr4 = (sockaddr_in *)&addr;
+    addr4->sin_family = AF_INET;
+    addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+    addr4->sin_port = htons(port);
+    len = sizeof(sockaddr_in);
+  }
+  if (bind(fd, (const sockaddr *)&addr, len) < 0) {
+    auto err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static uint16_t socket_port(int fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (sockaddr *)&addr, &len);
+  if (addr.ss_family == AF_INET6)
+    return ntohs(((sockaddr_in6 *)&addr)->sin6_port);
+  return ntohs(((sockaddr_in *)&addr)->sin_port);
+}
+
+port_pair_allocator_t::~port_pair_allocator_t() { clear(); }
+
+port_pair_t port_pair_allocator_t::bind_pair(int family) {
+  if (family != AF_INET && family != AF_INET6)
+    throw port_allocation_error("Unsupported address family {}", family);
+
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+    // The kernel gives a free port, and the pair is completed with the
+    // other side, even or odd.
+    int first = bind_socket(family, 0);
+    if (first < 0) {
+      throw port_allocation_error("Can not create socket. {}",
+                                  strerror(errno));
+    }
+    auto port = socket_port(first);
+    bool first_is_control = (port % 2) == 0;
+    uint16_t other_port = first_is_control ? port + 1 : port - 1;
+
+    int other = bind_socket(family, other_port);
+    if (other < 0) {
+      auto err = errno;
+      close(first);
+      if (err != EADDRINUSE && err != EACCES) {
+        throw port_allocation_error("Can not create socket. {}",
+                                    strerror(err));
+      }
+      DEBUG("Port {} is taken, trying another pair", other_port);
+      continue;
+    }
+
+    port_pair_t pair;
+    pair.family = family;
+    pair.control_socket = first_is_control ? first : other;
+    pair.midi_socket = first_is_control ? other : first;
+    pair.control_port = first_is_control ? port : other_port;
+    return pair;
+  }
+  throw port_allocation_error("No free port pair after {} attempts",
+                              MAX_ATTEMPTS);
+}
+
+void port_pair_allocator_t::close_pair(port_pair_t &pair) {
+  if (pair.control_socket >= 0)
+    close(pair.control_socket);
+  if (pair.midi_socket >= 0)
+    close(pair.midi_socket);
+  pair.control_socket = pair.midi_socket = -1;
+}
+
+port_pair_t port_pair_allocator_t::get(int family) {
+  auto &ready = pool[family];
+  port_pair_t pair;
+  if (!ready.empty()) {
+    pair = ready.back();
+    ready.pop_back();
+    from_pool++;
+    // Anything received while waiting is not for this connection
+    char discard[1];
+    for (auto fd : {pair.control_socket, pair.midi_socket}) {
+      while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) >= 0)
+        ;
+    }
+  } else {
+    try {
+      pair = bind_pair(family);
+    } catch (const port_allocation_error &) {
+      failures++;
+      throw;
+    }
+  }
+  allocated++;
+  refill_later();
+  return pair;
+}
+
+void port_pair_allocator_t::fill(int family) {
+  auto &ready = pool[family];
+  while (ready.size() < pool_size) {
+    ready.push_back(bind_pair(family));
+  }
+}
+
+size_t port_pair_allocator_t::pooled(int family) {
+  auto I = pool.find(family);
+  if (I == pool.end())
+    return 0;
+  return I->second.size();
+}
+
+void port_pair_allocator_t::clear() {
+  for (auto &ready : pool) {
+    for (auto &pair : ready.second)
+      close_pair(pair);
+  }
+  pool.clear();
+}
+
+void port_pair_allocator_t::refill_later() {
+  if (refill_pending || pool_size == 0)
+    return;
+  refill_pending = true;
+  poller.call_later([this] {
+    refill_pending = false;
+    try {
+      for (auto &ready : pool)
+        fill(ready.first);
+    } catch (const port_allocation_error &e) {
+      // Next get will try again, and report it
+      WARNING_ONCE("Could not fill the port pair pool: {}", e.what());
+    }
+  });
+}
@@ -0,0 +1,133 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <utility>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/recvbatch.hpp>
+#include <rtpmidid/rtppeer.hpp>
+
+using namespace rtpmidid;
+
+static_assert(recv_batch_t::PACKET_SIZE >=
+                  rtppeer::MAX_PACKET_SIZE + rtppeer::FEC_HEADER_SIZE,
+              "Receive buffers must fit the biggest packet rtppeer sends");
+
+recv_batch_t::recv_batch_t(int size) { resize(size); }
+
+void recv_batch_t::resize(int size) {
+  if (size < 1)
+    size = 1;
+
+  buffers.resize(size * PACKET_SIZE);
+  msgs.resize(size);
+  iovecs.resize(size);
+  addresses.resize(size);
+  controls.resize(size * CONTROL_SIZE);
+
+  // Pointers may have changed, so set all of them again
+  for (auto i = 0; i < size; i++) {
+    iovecs[i].iov_base = &buffers[i * PACKET_SIZE];
+    iovecs[i].iov_len = PACKET_SIZE;
+
+    memset(&msgs[i], 0, sizeof(struct mmsghdr));
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addresses[i];
+    msgs[i].msg_hdr.msg_control = &controls[i * CONTROL_SIZE];
+  }
+}
+
+int recv_batch_t::recv(int fd) {
+  // The kernel overwrites the name and control lengths on each read
+  for (auto &msg : msgs) {
+    msg.msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+    msg.msg_hdr.msg_controllen = CONTROL_SIZE;
+  }
+
+  for (;;) {
+    auto n = recvmmsg(fd, msgs.data(), msgs.size(), MSG_DONTWAIT, nullptr);
+    if (n >= 0)
+      return drop_truncated(n);
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return -1;
+  }
+}
+
+int recv_batch_t::drop_truncated(int n) {
+  // Moves the good ones to the front. Each msg keeps its own buffer,
+  // address and control pointers, so swapping them is enough.
+  int good = 0;
+  for (auto i = 0; i < n; i++) {
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      truncated++;
+      WARNING_ONCE("Dropped datagram bigger than {} bytes", PACKET_SIZE);
+      continue;
+    }
+    if (good != i)
+      std::swap(msgs[good], msgs[i]);
+    good++;
+  }
+  return good;
+}
+
+io_bytes_reader recv_batch_t::packet(int i) {
+  auto data = static_cast<uint8_t *>(msgs[i].msg_hdr.msg_iov->iov_base);
+  return io_bytes_reader(data, msgs[i].msg_len);
+}
+
+struct timespec recv_batch_t::timestamp(int i) {
+  auto hdr = &msgs[i].msg_hdr;
+  for (auto cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return ts;
+    }
+  }
+  return {0, 0};
+}
+
+std::optional<uint32_t> recv_batch_t::drop_counter(int i) {
+  auto hdr = &msgs[i].msg_hdr;
+  for (auto cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t counter;
+      memcpy(&counter, CMSG_DATA(cmsg), sizeof(counter));
+      return counter;
+    }
+  }
+  return std::nullopt;
+}
+
+void recv_batch_t::enable_timestamps(int fd) {
+  int enable = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) <
+      0) {
+    throw exception("Can not enable receive timestamps. {}.",
+                    strerror(errno));
+  }
+}
@@ -0,0 +1,202 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <netdb.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/resolver.hpp>
+
+using namespace rtpmidid;
+
+resolver_t rtpmidid::resolver;
+
+resolver_t::resolver_t(poller_t &poller_)
+    : poller(poller_), lookup(::getaddrinfo) {}
+
+resolver_t::~resolver_t() {
+  if (!shared)
+    return;
+  // Idle threads exit now, busy ones when their lookup ends. The result is
+  // just discarded.
+  {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->stop = true;
+    shared->requests.clear();
+  }
+  shared->cond.notify_all();
+  // The global poller may be already gone at exit. Other pollers must
+  // outlive their resolvers. The eventfd is closed by the last thread.
+  if (&poller != &rtpmidid::poller && poller.is_open())
+    poller.remove_fd(shared->eventfd);
+}
+
+resolver_t::shared_t::~shared_t() {
+  if (eventfd >= 0)
+    ::close(eventfd);
+}
+
+/// Lazy start, so programs that do not resolve do not have the threads.
+void resolver_t::start() {
+  auto eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (eventfd < 0) {
+    throw exception("Can not create resolver eventfd. {}", strerror(errno));
+  }
+  shared = std::make_shared<shared_t>();
+  shared->eventfd = eventfd;
+  poller.add_fd_in(eventfd, [this](int) { this->results_ready(); });
+}
+
+int resolver_t::resolve(const std::string &address, const std::string &port,
+                        callback_t callback) {
+  auto id = max_id++;
+  auto key = address + ":" + port;
+
+  auto cached = cache.find(key);
+  if (cached != cache.end()) {
+    if (cached->second.expires > std::chrono::steady_clock::now()) {
+      DEBUG("Resolved {} from cache", key);
+      cache_hits++;
+      callbacks[id] = std::move(callback);
+      auto addresses = cached->second.addresses;
+      poller.call_later([this, id, addresses] {
+        auto callback = callbacks.find(id);
+        if (callback == callbacks.end())
+          return; // Cancelled
+        auto f = std::move(callback->second);
+        callbacks.erase(callback);
+        f(addresses, 0);
+      });
+      return id;
+    }
+    cache.erase(cached);
+  }
+
+  if (!shared)
+    start();
+
+  callbacks[id] = std::move(callback);
+  bool new_thread = false;
+  {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->requests.push_back(request_t{id, address, port, lookup});
+    // All busy, maybe with a slow lookup. Another one, up to MAX_THREADS.
+    if (shared->idle < static_cast<int>(shared->requests.size()) &&
+        shared->threads < MAX_THREADS) {
+      shared->threads++;
+      new_thread = true;
+    }
+  }
+  if (new_thread)
+    std::thread(thread_loop, shared).detach();
+  else
+    shared->cond.notify_one();
+  return id;
+}
+
+void resolver_t::cancel(int id) { callbacks.erase(id); }
+
+void resolver_t::clear_cache() { cache.clear(); }
+
+void resolver_t::thread_loop(std::shared_ptr<shared_t> shared) {
+  for (;;) {
+    request_t request;
+    {
+      std::unique_lock<std::mutex> lock(shared->mutex);
+      shared->idle++;
+      shared->cond.wait(lock, [&shared] {
+        return shared->stop || !shared->requests.empty();
+      });
+      shared->idle--;
+      if (shared->stop)
+        return;
+      request = std::move(shared->requests.front());
+      shared->requests.pop_front();
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    result_t result;
+    result.id = request.id;
+    result.key = request.address + ":" + request.port;
+    struct addrinfo *list = nullptr;
+    result.error = request.lookup(request.address.c_str(),
+                                  request.port.c_str(), &hints, &list);
+    for (auto ai = list; ai != nullptr; ai = ai->ai_next) {
+      resolved_address_t address;
+      address.family = ai->ai_family;
+      address.socktype = ai->ai_socktype;
+      address.protocol = ai->ai_protocol;
+      address.addrlen = ai->ai_addrlen;
+      memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+      result.addresses.push_back(address);
+    }
+    if (list)
+      freeaddrinfo(list);
+
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      if (shared->stop)
+        return;
+      shared->results.push_back(std::move(result));
+    }
+    uint64_t one = 1;
+    if (::write(shared->eventfd, &one, sizeof(one)) < 0) {
+      ERROR("Could not notify resolver result: {}", strerror(errno));
+    }
+  }
+}
+
+/// At the poller thread. Caches and calls the callbacks.
+void resolver_t::results_ready() {
+  uint64_t count;
+  if (::read(shared->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    ERROR("Error reading resolver eventfd: {}", strerror(errno));
+  }
+
+  std::deque<result_t> ready;
+  {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    std::swap(ready, shared->results);
+  }
+
+  for (auto &result : ready) {
+    if (result.error == 0) {
+      cache[result.key] = cache_entry_t{
+          result.addresses, std::chrono::steady_clock::now() + ttl};
+    } else {
+      DEBUG("Error resolving {}: {}", result.key, gai_strerror(result.error));
+    }
+
+    auto callback = callbacks.find(result.id);
+    if (callback == callbacks.end())
+      continue; // Cancelled
+    auto f = std::move(callback->second);
+    callbacks.erase(callback);
+    f(result.addresses, result.error);
+  }
+}
@@ -17,6 +17,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -32,13 +33,23 @@
 #include <rtpmidid/iobytes.hpp>
 #include <rtpmidid/logger.hpp>
 #include <rtpmidid/poller.hpp>
+#include <rtpmidid/portpair.hpp>
+#include <rtpmidid/resolver.hpp>
 #include <rtpmidid/rtpclient.hpp>
 #include <rtpmidid/utils.hpp>
 
 using namespace std::chrono_literals;
 using namespace rtpmidid;
 
-rtpclient::rtpclient(std::string name) : peer(std::move(name)) {
+rtpclient::rtpclient(std::string name, poller_t &poller_,
+                     resolver_t &resolver_, port_pair_allocator_t &port_pairs_)
+    : poller(poller_), resolver(resolver_), port_pairs(port_pairs_),
+      peer(std::move(name), poller_) {
+  if (&resolver.poller != &poller || &port_pairs.poller != &poller) {
+    throw exception("rtpclient resolver and port pairs must be on the same "
+                    "poller as the client");
+  }
+  send_queue.poller = &poller;
   local_base_port = 0;
   remote_base_port = -1; // Not defined
   control_socket = -1;
@@ -47,12 +58,18 @@ rtpclient::rtpclient(std::string name) : peer(std::move(name)) {
   timerstate = 0;
   midi_socket = -1;
   peer.initiator_id = ::rtpmidid::rand_u32();
+  peer.local_features |= rtppeer::FEATURE_MULTICAST;
+  peer.local_features |= rtppeer::FEATURE_REDUNDANCY;
+  peer.local_features |= rtppeer::FEATURE_FEC;
   peer.send_event.connect([this](const io_bytes &data, rtppeer::port_e port) {
     this->sendto(data, port);
   });
 }
 
 rtpclient::~rtpclient() {
+  if (resolve_id)
+    resolver.cancel(resolve_id);
+
   if (peer.is_connected()) {
     peer.send_goodbye(rtppeer::CONTROL_PORT);
     peer.send_goodbye(rtppeer::MIDI_PORT);
@@ -66,139 +83,149 @@ rtpclient::~rtpclient() {
     poller.remove_fd(midi_socket);
     close(midi_socket);
   }
+  if (multicast_socket >= 0) {
+    poller.remove_fd(multicast_socket);
+    close(multicast_socket);
+  }
 }
 
+/**
+ * Connects to the remote address. Name resolution is done out of the poller
+ * thread, so this returns at once, and the connection starts when resolved.
+ */
 void rtpclient::connect_to(const std::string &address,
                            const std::string &port) {
-  struct addrinfo hints;
-  struct addrinfo *sockaddress_list = nullptr;
+  DEBUG("Try connect to service at {}:{}", address, port);
+
+  if (resolve_id)
+    resolver.cancel(resolve_id);
+  resolve_id = resolver.resolve(
+      address, port,
+      [this, address, port](const std::vector<resolved_address_t> &addresses,
+                            int error) {
+        resolve_id = 0;
+        if (error) {
+          ERROR("Error creating rtp client: Can not resolve address {}:{}. "
+                "{}",
+                address, port, gai_strerror(error));
+          peer.disconnect_event(rtppeer::disconnect_reason_e::CANT_CONNECT);
+          return;
+        }
+        connect_to(addresses, address, port);
+      });
+}
+
+void rtpclient::connect_to(const std::vector<resolved_address_t> &addresses,
+                           const std::string &address,
+                           const std::string &port) {
   char host[NI_MAXHOST], service[NI_MAXSERV];
-  socklen_t peer_addr_len = NI_MAXHOST;
 
   control_socket = midi_socket = -1;
 
-  DEBUG("Try connect to service at {}:{}", address, port);
-
   try {
-    int res;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
-
-    res = getaddrinfo(address.c_str(), port.c_str(), &hints, &sockaddress_list);
-    if (res < 0) {
-      DEBUG("Error resolving address {}:{}", address, port);
-      throw rtpmidid::exception("Can not resolve address {}:{}. {}", address,
-                                port, strerror(errno));
-    }
-    // Get addr info may return several options, try them in order.
-    // we asusme that if the ocntrol success to be created the midi will too.
-    auto serveraddr = sockaddress_list;
-    for (; serveraddr != nullptr; serveraddr = serveraddr->ai_next) {
+    // Resolve may return several options, try them in order.
+    // The local ports come as a pair, control even and MIDI the next one.
+    port_pair_t pair;
+    auto serveraddr = addresses.begin();
+    for (; serveraddr != addresses.end(); ++serveraddr) {
       host[0] = service[0] = 0x00;
-      getnameinfo(serveraddr->ai_addr, peer_addr_len, host, NI_MAXHOST, service,
-		      NI_MAXSERV, NI_NUMERICSERV);
+      getnameinfo((const sockaddr *)&serveraddr->addr, serveraddr->addrlen,
+                  host, NI_MAXHOST, service, NI_MAXSERV, NI_NUMERICSERV);
       DEBUG("Try connect to resolved name: {}:{}", host, service);
-      // remote_base_port = service;
 
-      control_socket = socket(serveraddr->ai_family, serveraddr->ai_socktype,
-                              serveraddr->ai_protocol);
-      if (control_socket < 0) {
-        continue;
-      }
-      if (connect(control_socket, serveraddr->ai_addr,
-                  serveraddr->ai_addrlen) == 0) {
+      pair = port_pairs.get(serveraddr->family);
+      control_socket = pair.control_socket;
+      midi_socket = pair.midi_socket;
+      if (connect(control_socket, (const sockaddr *)&serveraddr->addr,
+                  serveraddr->addrlen) == 0) {
         break;
       }
-      close(control_socket);
+      port_pair_allocator_t::close_pair(pair);
+      control_socket = midi_socket = -1;
     }
-    if (!serveraddr) {
+    if (serveraddr == addresses.end()) {
       DEBUG("Error opening control socket, port {}", port);
-      control_socket = -1;
       throw rtpmidid::exception(
           "Can not open remote rtpmidi control socket. {}", strerror(errno));
     }
     DEBUG("Connected to resolved name: {}:{}", host, service);
-    memcpy(&control_addr, serveraddr->ai_addr, sizeof(control_addr));
-
-    struct sockaddr_in6 servaddr;
-    socklen_t len = sizeof(servaddr);
-    ::getsockname(control_socket, (struct sockaddr *)&servaddr, &len);
-    local_base_port = ntohs(servaddr.sin6_port);
+    memcpy(&control_addr, &serveraddr->addr, sizeof(control_addr));
+    local_base_port = pair.control_port;
 
     DEBUG("Control port, local: {}, remote at {}:{}", local_base_port, host,
           service);
 
+    setup_socket(control_socket);
+    recv_batch_t::enable_timestamps(control_socket);
     poller.add_fd_in(control_socket,
                      [this](int) { this->data_ready(rtppeer::CONTROL_PORT); });
 
-    midi_socket = socket(serveraddr->ai_family, serveraddr->ai_socktype,
-                         serveraddr->ai_protocol);
-    if (midi_socket < 0) {
-      throw rtpmidid::exception("Can not open MIDI socket. Out of sockets?");
-    }
-    // Reuse servaddr, just on next port
-    remote_base_port = ntohs(((sockaddr_in *)serveraddr->ai_addr)->sin_port);
-    ((sockaddr_in *)serveraddr->ai_addr)->sin_port =
-        htons(remote_base_port + 1);
-
-    servaddr.sin6_port = htons(local_base_port + 1);
-    auto ret = bind(midi_socket, (struct sockaddr *)&servaddr, len);
-    if (ret < 0) {
-      throw rtpmidid::exception("Could not bind to local port");
-    }
+    setup_socket(midi_socket);
+    // Same remote address, just on next port
+    struct sockaddr_storage midiaddr = serveraddr->addr;
+    remote_base_port = ntohs(((sockaddr_in *)&midiaddr)->sin_port);
+    ((sockaddr_in *)&midiaddr)->sin_port = htons(remote_base_port + 1);
 
-    if (connect(midi_socket, serveraddr->ai_addr, serveraddr->ai_addrlen) < 0) {
+    if (connect(midi_socket, (const sockaddr *)&midiaddr,
+                serveraddr->addrlen) < 0) {
       DEBUG("Error opening midi socket, port {}", port);
       throw rtpmidid::exception("Can not open remote rtpmidi MIDI socket. {}",
                                 strerror(errno));
     }
-    memcpy(&midi_addr, serveraddr->ai_addr, sizeof(midi_addr));
-    ::getsockname(midi_socket, (struct sockaddr *)&servaddr, &len);
-    auto midi_port = htons(servaddr.sin6_port);
-    DEBUG("MIDI PORT at port {}", midi_port);
+    memcpy(&midi_addr, &midiaddr, sizeof(midi_addr));
+    DEBUG("MIDI PORT at port {}", local_base_port + 1);
 
+    recv_batch_t::enable_timestamps(midi_socket);
     poller.add_fd_in(midi_socket,
                      [this](int) { this->data_ready(rtppeer::MIDI_PORT); });
+  } catch (const port_allocation_error &excp) {
+    ERROR("Error creating rtp client: Can not get local ports: {}",
+          excp.what());
+    close_sockets();
+    peer.disconnect_event(
+        rtppeer::disconnect_reason_e::PORT_ALLOCATION_FAILED);
+    return;
   } catch (const std::exception &excp) {
     ERROR("Error creating rtp client: {}", excp.what());
-    if (control_socket >= 0) {
-      poller.remove_fd(control_socket);
-      ::close(control_socket);
-      control_socket = -1;
-    }
-    if (midi_socket >= 0) {
-      poller.remove_fd(midi_socket);
-      ::close(midi_socket);
-      midi_socket = -1;
-    }
-    if (sockaddress_list) {
-      freeaddrinfo(sockaddress_list);
-    }
+    close_sockets();
     peer.disconnect_event(rtppeer::disconnect_reason_e::CANT_CONNECT);
     return;
   }
-  if (sockaddress_list) {
-    freeaddrinfo(sockaddress_list);
-  }
 
-  DEBUG("Connecting midi port {} to {}:{}", local_base_port + 1, address, remote_base_port + 1);
+  DEBUG("Connecting control and midi ports {}-{} to {}:{}-{}",
+        local_base_port, local_base_port + 1, address, remote_base_port,
+        remote_base_port + 1);
 
-  // If not connected, connect now the MIDI port
+  // Both invitations at once. If the peer wants the control port first, the
+  // MIDI invitation is sent again when the control port connects.
   auto conn_event = peer.connected_event.connect(
-      [this, address, port](const std::string &name, rtppeer::status_e status) {
+      [this](const std::string &name, rtppeer::status_e status) {
         if (status == rtppeer::CONTROL_CONNECTED) {
-          DEBUG("Connected midi port {} to {}:{}", local_base_port + 1,
-                address, remote_base_port + 1);
-          peer.connect_to(rtppeer::MIDI_PORT);
+          if (!peer.early_midi_invite) {
+            invite_midi_in_order();
+            return;
+          }
+          // The MIDI OK should come right after. If not, it was ignored.
+          auto rtt = std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - connect_start);
+          midi_invite_timer = poller.add_timer_event(
+              std::max(2 * rtt, 10ms), [this] { invite_midi_in_order(); });
         } else if (status == rtppeer::CONNECTED) {
+          midi_invite_timer.disable();
+          DEBUG("Connected to {} in {} us", name,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - connect_start)
+                    .count());
+          if (peer.remote_features & rtppeer::FEATURE_MULTICAST)
+            join_multicast();
           connected();
         }
       });
 
+  connect_start = std::chrono::steady_clock::now();
   peer.connect_to(rtppeer::CONTROL_PORT);
+  peer.early_midi_invite = true;
+  peer.connect_to(rtppeer::MIDI_PORT);
 
   connect_timer = poller.add_timer_event(5s, [this, conn_event] {
     peer.connected_event.disconnect(conn_event);
@@ -206,6 +233,20 @@ void rtpclient::connect_to(const std::string &address,
   });
 }
 
+/**
+ * Sequential handshake, for peers that ignore or reject the MIDI invitation
+ * before the control one.
+ */
+void rtpclient::invite_midi_in_order() {
+  midi_invite_timer.disable();
+  if (peer.status & rtppeer::MIDI_CONNECTED)
+    return;
+  DEBUG("Connect midi port {} to {}:{} after control", local_base_port + 1,
+        peer.remote_name, remote_base_port + 1);
+  peer.early_midi_invite = false;
+  peer.connect_to(rtppeer::MIDI_PORT);
+}
+
 /**
  * Send the periodic latency and connection checks
  *
@@ -238,31 +279,121 @@ void rtpclient::send_ck0_with_timeout() {
   });
 }
 
+/**
+ * Sends to the remote peer. If the socket is full, the packet waits at the
+ * send queue until the socket is writable.
+ */
 void rtpclient::sendto(const io_bytes &pb, rtppeer::port_e port) {
-  auto peer_addr = (port == rtppeer::MIDI_PORT) ? midi_addr : control_addr;
-
   auto socket = rtppeer::MIDI_PORT == port ? midi_socket : control_socket;
 
-  for(;;) {
-    ssize_t res =
-      ::sendto(socket, pb.start, pb.size(), MSG_CONFIRM,
-               (const struct sockaddr *)&peer_addr, sizeof(peer_addr));
-
-    if (static_cast<uint32_t>(res) == pb.size())
-      break;
+  try {
+    // Both sockets are connected, no need for address
+    auto res = send_queue.send(socket, io_bytes_reader(pb));
+    if (res == send_queue_t::QUEUED && !write_wanted) {
+      poller.set_fd_out(control_socket, true);
+      poller.set_fd_out(midi_socket, true);
+      write_wanted = true;
+    }
+  } catch (const std::exception &e) {
+    throw exception("Could not send all data to {}:{}. {}", peer.remote_name,
+                    remote_base_port, e.what());
+  }
+}
 
-    if (res == -1) {
-      if (errno == EINTR) {
-        DEBUG("Retry sendto because of EINTR");
-        continue;
-      }
+void rtpclient::flush_send_queue() {
+  if (!send_queue.flush())
+    return;
+  poller.set_fd_out(control_socket, false);
+  poller.set_fd_out(midi_socket, false);
+  write_wanted = false;
+}
 
-      throw exception("Could not send all data to {}:{}. Sent {}. {}",
-                    peer.remote_name, remote_base_port, res, strerror(errno));
+/// Closes the sockets after a failed connect_to
+void rtpclient::close_sockets() {
+  for (auto socket : {&control_socket, &midi_socket}) {
+    if (*socket < 0)
+      continue;
+    try {
+      poller.remove_fd(*socket);
+    } catch (const rtpmidid::exception &e) {
+      DEBUG("Socket was not at the poller yet: {}", e.what());
     }
+    ::close(*socket);
+    *socket = -1;
+  }
+}
 
-    DEBUG("Could not send whole message: only {} of {}", res, pb.size());
-    break;
+/**
+ * The server sends the MIDI data to a multicast group. Join it, and process
+ * it as if it came from the MIDI port.
+ *
+ * If it can not be joined, the server is told to send it by unicast.
+ */
+void rtpclient::join_multicast() {
+  auto ext = peer.remote_extension.find(rtppeer::EXT_MULTICAST_GROUP);
+  if (ext == peer.remote_extension.end()) {
+    WARNING("{} announces multicast but has no group", peer.remote_name);
+    leave_multicast_feature();
+    return;
+  }
+  auto group = multicast_group_t::decode(ext->second);
+  if (!group) {
+    WARNING("{} announces an invalid multicast group", peer.remote_name);
+    leave_multicast_feature();
+    return;
+  }
+
+  if (multicast_socket >= 0) {
+    poller.remove_fd(multicast_socket);
+    close(multicast_socket);
+    multicast_socket = -1;
+  }
+  try {
+    multicast_socket = multicast_join(*group);
+  } catch (const std::exception &e) {
+    WARNING("Could not join the multicast group of {}, MIDI data by unicast: "
+            "{}",
+            peer.remote_name, e.what());
+    leave_multicast_feature();
+    return;
+  }
+  setup_socket(multicast_socket);
+  recv_batch_t::enable_timestamps(multicast_socket);
+  poller.add_fd_in(multicast_socket,
+                   [this](int) { this->multicast_data_ready(); });
+  INFO("Joined multicast group {} for MIDI data from {}", group->to_string(),
+       peer.remote_name);
+}
+
+/// Asks again without FEATURE_MULTICAST, so the server sends by unicast
+void rtpclient::leave_multicast_feature() {
+  peer.local_features &= ~rtppeer::FEATURE_MULTICAST;
+  peer.connect_to(rtppeer::CONTROL_PORT);
+}
+
+void rtpclient::multicast_data_ready() {
+  auto n = recv_batch.recv(multicast_socket);
+  if (n < 0) {
+    throw exception("Error reading from multicast group of {}",
+                    peer.remote_name);
+  }
+  for (auto i = 0; i < n; i++) {
+    // Other sessions may share the group, skip their data quietly
+    auto packet = recv_batch.packet(i);
+    if (packet.size() < 12 || packet.start[0] == 0xFF)
+      continue;
+    packet.seek(8);
+    auto ssrc = packet.read_uint32();
+    packet.seek(0);
+    if (ssrc != peer.remote_ssrc)
+      continue;
+    try {
+      peer.data_ready(std::move(packet), rtppeer::MIDI_PORT,
+                      recv_batch.timestamp(i));
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Error processing packet from {}: {}", peer.remote_name,
+                 e.what());
+    }
   }
 }
 
@@ -272,18 +403,33 @@ void rtpclient::reset() {
 }
 
 void rtpclient::data_ready(rtppeer::port_e port) {
-  uint8_t raw[1500];
-  struct sockaddr_in6 cliaddr;
-  unsigned int len = sizeof(cliaddr);
+  // May be called because a socket is writable again
+  if (write_wanted)
+    flush_send_queue();
+
   auto socket = port == rtppeer::CONTROL_PORT ? control_socket : midi_socket;
-  auto n = recvfrom(socket, raw, 1500, MSG_DONTWAIT,
-                    (struct sockaddr *)&cliaddr, &len);
+  auto n = recv_batch.recv(socket);
   // DEBUG("Got some data from control: {}", n);
   if (n < 0) {
     throw exception("Error reading from rtppeer {}:{}", peer.remote_name,
                     remote_base_port);
   }
+  if (n > 0) {
+    auto counter = recv_batch.drop_counter(n - 1);
+    if (counter) {
+      auto &drops =
+          (port == rtppeer::CONTROL_PORT) ? control_drops : midi_drops;
+      drops.update(socket, *counter);
+    }
+  }
 
-  auto buffer = io_bytes_reader(raw, n);
-  peer.data_ready(std::move(buffer), port);
+  for (auto i = 0; i < n; i++) {
+    // One bad packet should not discard the rest of the batch
+    try {
+      peer.data_ready(recv_batch.packet(i), port, recv_batch.timestamp(i));
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Error processing packet from {}: {}", peer.remote_name,
+                 e.what());
+    }
+  }
 }
@@ -17,6 +17,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <algorithm>
 #include <iterator>
 #include <rtpmidid/exceptions.hpp>
 #include <rtpmidid/iobytes.hpp>
@@ -31,11 +32,10 @@ using namespace rtpmidid;
  *
  * A generic peer can be a client or a server. In any case it has a control
  * and midi ports. The port can be random for clients, or fixed for server.
- *
- * BUGS: It needs two consecutive ports for client, but just ask a random and
- *       expects next to be free. It almost always is, but can fail.
+ * Clients get both consecutive ports from the port_pairs allocator.
  */
-rtppeer::rtppeer(std::string _name) : local_name(std::move(_name)) {
+rtppeer::rtppeer(std::string _name, poller_t &poller_)
+    : poller(poller_), local_name(std::move(_name)) {
   status = NOT_CONNECTED;
   remote_ssrc = 0;
   local_ssrc = ::rtpmidid::rand_u32() & 0x0FFFF;
@@ -46,6 +46,7 @@ rtppeer::rtppeer(std::string _name) : local_name(std::move(_name)) {
   timestamp_start = get_timestamp();
   initiator_id = 0;
   latency = 0;
+  rx_timestamp = 0;
   waiting_ck = false;
 }
 
@@ -58,9 +59,31 @@ void rtppeer::reset() {
   remote_name = "";
   remote_ssrc = 0;
   initiator_id = 0;
+  early_midi_invite = false;
+  pending_copies.clear();
+  copies_timer.disable();
+  seq_window_valid = false;
+  fec_count = 0;
+  fec_timer.disable();
+  for (auto &slot : fec_received)
+    slot.valid = false;
+  reorder_valid = false;
+  reorder_held.clear();
+  reorder_timer.disable();
 }
 
 void rtppeer::data_ready(io_bytes_reader &&buffer, port_e port) {
+  data_ready(std::move(buffer), port, {0, 0});
+}
+
+void rtppeer::data_ready(io_bytes_reader &&buffer, port_e port,
+                         const struct timespec &rx_time) {
+  bool has_rx_time = rx_time.tv_sec != 0 || rx_time.tv_nsec != 0;
+  if (has_rx_time)
+    rx_timestamp = to_timestamp(rx_time);
+  else
+    rx_timestamp = get_timestamp();
+
   if (port == CONTROL_PORT) {
     if (is_command(buffer)) {
       parse_command(buffer, port);
@@ -72,10 +95,24 @@ void rtppeer::data_ready(io_bytes_reader &&buffer, port_e port) {
   } else {
     if (is_command(buffer)) {
       parse_command(buffer, port);
+    } else if (is_fec(buffer)) {
+      parse_fec(buffer);
     } else {
       parse_midi(buffer);
     }
   }
+
+  if (has_rx_time) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t us = (now.tv_sec - rx_time.tv_sec) * 1000000 +
+                 (now.tv_nsec - rx_time.tv_nsec) / 1000;
+    if (us >= 0) {
+      internal_latency.count++;
+      internal_latency.total_us += us;
+      internal_latency.max_us = std::max(internal_latency.max_us, uint64_t(us));
+    }
+  }
 }
 
 bool rtppeer::is_command(io_bytes_reader &pb) {
@@ -90,6 +127,11 @@ bool rtppeer::is_feedback(io_bytes_reader &pb) {
           pb.start[2] == 0x52 && pb.start[3] == 0x53);
 }
 
+bool rtppeer::is_fec(io_bytes_reader &pb) {
+  return (pb.size() >= 15 && (pb.start[0] & 0xC0) == 0x80 &&
+          (pb.start[1] & 0x7F) == FEC_PAYLOAD_TYPE);
+}
+
 void rtppeer::parse_command(io_bytes_reader &buffer, port_e port) {
   if (buffer.size() < 16) {
     // This should never be reachable, but should help to smart compilers for
@@ -130,14 +172,15 @@ void rtppeer::parse_command(io_bytes_reader &buffer, port_e port) {
  */
 void rtppeer::parse_command_ok(io_bytes_reader &buffer, port_e port) {
   if (status == CONNECTED) {
-    WARNING(
-        "This peer is already connected. Need to disconnect to connect again.");
+    // Answer to a renegotiation, see parse_command_in
+    DEBUG("Already connected to {}. Nothing to do with this OK.", remote_name);
     return;
   }
   auto protocol = buffer.read_uint32();
   auto initiator_id = buffer.read_uint32();
   remote_ssrc = buffer.read_uint32();
   remote_name = buffer.read_str0();
+  parse_extension(buffer);
   if (protocol != 2) {
     throw exception(
         "rtpmidid only understands RTP MIDI protocol 2. Fill an issue at "
@@ -157,6 +200,7 @@ void rtppeer::parse_command_ok(io_bytes_reader &buffer, port_e port) {
                             : port == MIDI_PORT ? "MIDI" : "Unknown");
   if (port == MIDI_PORT) {
     status = status_e(int(status) | int(MIDI_CONNECTED));
+    early_midi_invite = false;
   } else if (port == CONTROL_PORT) {
     status = status_e(int(status) | int(CONTROL_CONNECTED));
   } else {
@@ -174,15 +218,32 @@ void rtppeer::parse_command_ok(io_bytes_reader &buffer, port_e port) {
  * connected to me.
  */
 void rtppeer::parse_command_in(io_bytes_reader &buffer, port_e port) {
+  // The same client may send it again to change its features, as when it
+  // could not join the multicast group. Anyone else has to disconnect first.
+  bool renegotiate = false;
   if (status == CONNECTED) {
-    WARNING(
-        "This peer is already connected. Need to disconnect to connect again.");
-    return;
+    io_bytes_reader ids(buffer);
+    ids.skip(4);
+    renegotiate = ids.read_uint32() == initiator_id &&
+                  ids.read_uint32() == remote_ssrc;
+    if (!renegotiate) {
+      WARNING("This peer is already connected. Need to disconnect to connect "
+              "again.");
+      return;
+    }
   }
   auto protocol = buffer.read_uint32();
   initiator_id = buffer.read_uint32();
   remote_ssrc = buffer.read_uint32();
   remote_name = buffer.read_str0();
+  parse_extension(buffer);
+  auto asked = remote_extension.find(EXT_SESSION);
+  if (asked != remote_extension.end() && sessions.count(asked->second))
+    session = asked->second;
+  else if (sessions.count(default_session))
+    session = default_session;
+  if (!session.empty())
+    local_name = session;
 
   if (protocol != 2) {
     throw exception(
@@ -196,16 +257,23 @@ void rtppeer::parse_command_in(io_bytes_reader &buffer, port_e port) {
        remote_name, initiator_id, this->initiator_id == initiator_id,
        remote_ssrc, remote_name, port == CONTROL_PORT);
 
-  io_bytes_writer_static<128> response;
+  io_bytes_writer_static<512> response;
   response.write_uint16(0xFFFF);
   response.write_uint16(OK);
   response.write_uint32(2);
   response.write_uint32(initiator_id);
   response.write_uint32(local_ssrc);
   response.write_str0(local_name);
+  // Only to peers that know about it
+  if (remote_has_extension)
+    write_extension(response);
 
   send_event(response, port);
 
+  if (renegotiate) {
+    INFO("{} renegotiated its features: {:X}", remote_name, remote_features);
+    return;
+  }
   if (port == MIDI_PORT)
     status = status_e(int(status) | int(MIDI_CONNECTED));
   if (port == CONTROL_PORT)
@@ -214,6 +282,55 @@ void rtppeer::parse_command_in(io_bytes_reader &buffer, port_e port) {
   connected_event(remote_name, status);
 }
 
+/**
+ * Reads the rtpmidid extension after the name, if any.
+ *
+ * Unknown types are kept, but not used.
+ */
+void rtppeer::parse_extension(io_bytes_reader &buffer) {
+  remote_has_extension = false;
+  remote_features = 0;
+  remote_extension.clear();
+
+  if (buffer.position + 4 > buffer.end)
+    return;
+  if (buffer.read_uint32() != EXTENSION_MAGIC)
+    return;
+
+  remote_has_extension = true;
+  while (buffer.position + 2 <= buffer.end) {
+    auto type = buffer.read_uint8();
+    auto length = buffer.read_uint8();
+    buffer.check_enough(length);
+    std::string value((const char *)buffer.position, length);
+    buffer.skip(length);
+
+    if (type == EXT_FEATURES && length == 4) {
+      io_bytes_reader features((uint8_t *)value.data(), 4);
+      remote_features = features.read_uint32();
+    } else {
+      remote_extension[type] = std::move(value);
+    }
+  }
+  DEBUG("{} has rtpmidid extension. Features {:X}", remote_name,
+        remote_features);
+}
+
+void rtppeer::write_extension(io_bytes_writer &buffer) {
+  buffer.write_uint32(EXTENSION_MAGIC);
+  buffer.write_uint8(EXT_FEATURES);
+  buffer.write_uint8(4);
+  buffer.write_uint32(local_features);
+  for (auto &ext : local_extension) {
+    if (ext.second.size() > 255) {
+      throw exception("rtpmidid extension {} too long", ext.first);
+    }
+    buffer.write_uint8(ext.first);
+    buffer.write_uint8(ext.second.size());
+    buffer.copy_from((uint8_t *)ext.second.data(), ext.second.size());
+  }
+}
+
 void rtppeer::parse_command_by(io_bytes_reader &buffer, port_e port) {
   auto protocol = buffer.read_uint32();
   initiator_id = buffer.read_uint32();
@@ -254,6 +371,18 @@ void rtppeer::parse_command_no(io_bytes_reader &buffer, port_e port) {
         protocol);
   }
 
+  if (port == MIDI_PORT && early_midi_invite) {
+    // Some peers want the control port first. Tell the client, it will
+    // try again in order.
+    early_midi_invite = false;
+    INFO("{} rejected the MIDI invitation before the control one. Will "
+         "retry in order.",
+         remote_name);
+    if (status & CONTROL_CONNECTED)
+      connected_event(remote_name, status);
+    return;
+  }
+
   status = (status_e)(
       ((int)status) &
       ~((int)(port == MIDI_PORT ? MIDI_CONNECTED : CONTROL_CONNECTED)));
@@ -279,13 +408,13 @@ void rtppeer::parse_command_ck(io_bytes_reader &buffer, port_e port) {
   switch (count) {
   case 0: {
     // Send my timestamp. I will use it later when I receive 2.
-    ck2 = get_timestamp();
+    ck2 = rx_timestamp;
     count = 1;
   } break;
   case 1: {
     // Send my timestamp. I will use it when get answer with 3.
     ck2 = buffer.read_uint64();
-    ck3 = get_timestamp();
+    ck3 = rx_timestamp;
     count = 2;
     latency = ck3 - ck1;
     waiting_ck = false;
@@ -296,7 +425,7 @@ void rtppeer::parse_command_ck(io_bytes_reader &buffer, port_e port) {
     // Receive the other side CK, I can calculate latency
     ck2 = buffer.read_uint64();
     // ck3 = buffer.read_uint64();
-    latency = get_timestamp() - ck2;
+    latency = rx_timestamp - ck2;
     INFO("Latency {}: {:.2f} ms (server / 3)", remote_name, latency / 10.0);
     // No need to send message
     ck_event(latency / 10.0);
@@ -433,7 +562,7 @@ void rtppeer::parse_midi(io_bytes_reader &buffer) {
             rtpmidi_id);
     return;
   }
-  remote_seq_nr = buffer.read_uint16(); // Ignore RTP sequence no.
+  auto seq_nr = buffer.read_uint16();
   // TODO In the future we may use a journal.
   // auto _remote_timestamp =
   buffer.read_uint32();                    // Ignore timestamp
@@ -444,7 +573,33 @@ void rtppeer::parse_midi(io_bytes_reader &buffer) {
             remote_ssrc, this->remote_ssrc);
     return;
   }
+  // Duplicates are dropped only if the remote promises unique sequence
+  // numbers, or the user enabled the reorder window. Others may just repeat
+  // them.
+  bool duplicate = is_duplicate(seq_nr);
+  if (duplicate && ((remote_features & (FEATURE_REDUNDANCY | FEATURE_FEC)) ||
+                    reorder_window.count() > 0)) {
+    duplicates++;
+    return;
+  }
+  remote_seq_nr = seq_nr;
+  if ((local_features & FEATURE_FEC) && (remote_features & FEATURE_FEC)) {
+    auto &slot = fec_received[seq_nr % FEC_MAX_GROUP];
+    slot.valid = true;
+    slot.seq_nr = seq_nr;
+    slot.data.assign(buffer.start, buffer.end);
+  }
+
+  if (reorder_window.count() > 0 || !reorder_held.empty())
+    reorder_midi(seq_nr, buffer);
+  else
+    parse_midi_commands(buffer);
+}
 
+/**
+ * Parses the RTP MIDI commands section, after the RTP header
+ */
+void rtppeer::parse_midi_commands(io_bytes_reader &buffer) {
   // RFC 6295 RTP-MIDI _header
   // The Flags are:
   // B = has long header
@@ -516,6 +671,72 @@ void rtppeer::parse_midi(io_bytes_reader &buffer) {
   }
 }
 
+/**
+ * Delivers the MIDI packets in sequence order.
+ *
+ * If there is a gap the next packets wait until the missing ones arrive, or
+ * for the reorder_window. Then the gap is skipped. Packets from before the
+ * gap that arrive even later are delivered at once.
+ */
+void rtppeer::reorder_midi(uint16_t seq_nr, io_bytes_reader &buffer) {
+  if (!reorder_valid) {
+    reorder_valid = true;
+    reorder_next_seq_nr = seq_nr;
+  }
+  int16_t diff = seq_nr - reorder_next_seq_nr;
+  if (diff < 0) {
+    parse_midi_commands(buffer);
+    return;
+  }
+  if (diff > 0) {
+    auto pos = reorder_held.begin();
+    while (pos != reorder_held.end() && int16_t(seq_nr - pos->seq_nr) > 0)
+      ++pos;
+    reorder_held.insert(
+        pos, held_packet_t{seq_nr, std::chrono::steady_clock::now(),
+                           std::vector<uint8_t>(buffer.position, buffer.end)});
+    release_reordered();
+    return;
+  }
+
+  reorder_next_seq_nr++;
+  parse_midi_commands(buffer);
+  release_reordered();
+}
+
+/**
+ * Delivers the held packets that are next in order, or that waited too long.
+ */
+void rtppeer::release_reordered() {
+  auto now = std::chrono::steady_clock::now();
+  while (!reorder_held.empty()) {
+    auto oldest = reorder_held.front().arrival;
+    for (auto &held : reorder_held)
+      oldest = std::min(oldest, held.arrival);
+    auto &first = reorder_held.front();
+    bool waiting = int16_t(first.seq_nr - reorder_next_seq_nr) > 0;
+    if (waiting && now - oldest < reorder_window &&
+        reorder_held.size() <= REORDER_MAX_HELD) {
+      reorder_timer = poller.add_timer_event(oldest + reorder_window - now,
+                                             [this] { release_reordered(); });
+      return;
+    }
+
+    auto held = std::move(reorder_held.front());
+    reorder_held.pop_front();
+    reorder_next_seq_nr = held.seq_nr + 1;
+    io_bytes_reader packet(held.data.data(), held.data.size());
+    // A bad one must not keep the rest held, and this may be the timer
+    try {
+      parse_midi_commands(packet);
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Error processing held packet from {}: {}", remote_name,
+                 e.what());
+    }
+  }
+  reorder_timer.disable();
+}
+
 void rtppeer::parse_sysex(io_bytes_reader &buffer, int16_t length) {
   // buffer.print_hex();
   auto last_byte = *(buffer.position + length - 1);
@@ -583,6 +804,14 @@ uint64_t rtppeer::get_timestamp() {
   struct timespec spec;
 
   clock_gettime(CLOCK_REALTIME, &spec);
+  return to_timestamp(spec);
+}
+
+/**
+ * Converts a CLOCK_REALTIME time, as the kernel receive timestamps, to the
+ * same units as get_timestamp().
+ */
+uint64_t rtppeer::to_timestamp(const struct timespec &spec) {
   // ns is 1e-9s. I need 1e-4s, so / 1e5
   uint64_t now = spec.tv_sec * 10000 + spec.tv_nsec / 1.0e5;
   // DEBUG("{}s {}ns", spec.tv_sec, spec.tv_nsec);
@@ -597,8 +826,370 @@ void rtppeer::send_midi(const io_bytes_reader &events) {
     return;
   }
 
-  io_bytes_writer_static<4096 + 12> buffer;
+  // RTP header and long commands header
+  if (12 + 2 + events.size() > max_packet_size()) {
+    send_midi_split(events);
+    return;
+  }
+  send_midi_packet(events);
+}
+
+void rtppeer::send_midi_packet(const io_bytes_reader &commands) {
+  io_bytes_writer_static<MAX_PACKET_SIZE> buffer;
+
+  write_midi_header(buffer);
+  write_midi_commands(buffer, commands);
 
+  // commands.print_hex();
+  // buffer.print_hex();
+
+  send_event(buffer, MIDI_PORT);
+  send_protection(buffer);
+}
+
+/**
+ * Max size of the MIDI packets to this peer, as UDP payload.
+ *
+ * The FEC parity packets are a bit bigger than the biggest packet of the
+ * group, so if used this leaves space for them.
+ */
+size_t rtppeer::max_packet_size() const {
+  size_t size = std::clamp(mtu, size_t(MIN_MTU), size_t(MAX_PACKET_SIZE));
+  if (fec_group > 0 && (remote_features & FEATURE_FEC))
+    size -= 3;
+  return size;
+}
+
+/**
+ * Length of a MIDI message with this status, with the status byte. SysEx
+ * have no fixed length, 1 is returned.
+ */
+static size_t midi_status_length(uint8_t status) {
+  switch (status & 0xF0) {
+  case 0x80:
+  case 0x90:
+  case 0xA0:
+  case 0xB0:
+  case 0xE0:
+    return 3;
+  case 0xC0:
+  case 0xD0:
+    return 2;
+  }
+  if (status == 0xF1 || status == 0xF3)
+    return 2;
+  if (status == 0xF2)
+    return 3;
+  return 1;
+}
+
+/**
+ * Length of the MIDI message at data, up to end.
+ *
+ * If it starts with a data byte, it uses the running status, and the length
+ * does not include it. Without running status, it is up to the next status.
+ */
+static size_t midi_message_length(const uint8_t *data, const uint8_t *end,
+                                  uint8_t running_status) {
+  size_t length = 1;
+  auto status = *data;
+  if (status < 0x80 && running_status != 0)
+    length = midi_status_length(running_status) - 1;
+  else if (status < 0x80 || status == 0xF0) {
+    // SysEx up to the F7
+    while (data + length < end && data[length] < 0x80)
+      length++;
+    if (status == 0xF0 && data + length < end && data[length] == 0xF7)
+      length++;
+  } else
+    length = midi_status_length(status);
+  return std::min(length, size_t(end - data));
+}
+
+/**
+ * Sends MIDI data that does not fit in one packet.
+ *
+ * Full MIDI commands go in as few packets as possible, with a 0 delta time
+ * between them, and each packet starts with a status byte. SysEx that do
+ * not fit in a packet are sent in RFC 6295 segments: F0 ... F0, F7 ... F0 and
+ * F7 ... F7, one per packet.
+ */
+void rtppeer::send_midi_split(const io_bytes_reader &events) {
+  size_t max_commands = max_packet_size() - 12 - 2;
+  std::vector<uint8_t> commands;
+  commands.reserve(max_commands);
+  auto flush = [this, &commands] {
+    if (commands.empty())
+      return;
+    send_midi_packet(io_bytes_reader(commands.data(), commands.size()));
+    commands.clear();
+  };
+
+  uint8_t running_status = 0;
+  auto data = events.start;
+  while (data < events.end) {
+    auto length = midi_message_length(data, events.end, running_status);
+    if (*data == 0xF0 && length > max_commands) {
+      flush();
+      send_sysex_segments(data, length, max_commands);
+      data += length;
+      continue;
+    }
+
+    bool add_status = *data < 0x80;
+    if (add_status && running_status == 0) {
+      WARNING("MIDI data without status for {}. Ignoring.", remote_name);
+      data += length;
+      continue;
+    }
+    if (*data >= 0x80 && *data < 0xF0)
+      running_status = *data;
+
+    auto size = length + (add_status ? 1 : 0);
+    if (commands.size() + 1 + size > max_commands)
+      flush();
+    if (!commands.empty())
+      commands.push_back(0x00); // Delta time
+    if (add_status)
+      commands.push_back(running_status);
+    commands.insert(commands.end(), data, data + length);
+    data += length;
+  }
+  flush();
+}
+
+void rtppeer::send_sysex_segments(const uint8_t *sysex, size_t length,
+                                  size_t max_commands) {
+  // Without the F0 and F7, the segments add them
+  auto data = sysex + 1;
+  auto end = sysex + length;
+  bool complete = *(end - 1) == 0xF7;
+  if (complete)
+    end--;
+
+  auto max_data = max_commands - 2;
+  std::vector<uint8_t> segment;
+  segment.reserve(max_commands);
+  bool first = true;
+  while (first || data < end) {
+    auto size = std::min(max_data, size_t(end - data));
+    bool last = data + size == end;
+    segment.clear();
+    segment.push_back(first ? 0xF0 : 0xF7);
+    segment.insert(segment.end(), data, data + size);
+    segment.push_back(last && complete ? 0xF7 : 0xF0);
+    send_midi_packet(io_bytes_reader(segment.data(), segment.size()));
+    data += size;
+    first = false;
+  }
+}
+
+void rtppeer::send_protection(const io_bytes_reader &packet) {
+  send_copies(packet);
+  add_fec(packet);
+}
+
+/**
+ * Sends the redundant copies of a MIDI packet, at once if there is no gap or
+ * later with the poller.
+ *
+ * The copies keep the sequence number, so the other end only uses the first
+ * that arrives. Only for peers that drop the duplicates.
+ */
+void rtppeer::send_copies(const io_bytes_reader &packet) {
+  if (redundancy.copies <= 1 || !(remote_features & FEATURE_REDUNDANCY))
+    return;
+
+  if (redundancy.gap.count() <= 0) {
+    for (int i = 1; i < redundancy.copies; i++)
+      send_event(packet, MIDI_PORT);
+    return;
+  }
+
+  auto when = std::chrono::steady_clock::now() + redundancy.gap;
+  pending_copies.push_back(
+      pending_copy_t{std::vector<uint8_t>(packet.start, packet.end),
+                     redundancy.copies - 1, when});
+  if (pending_copies.size() == 1) {
+    copies_timer = poller.add_timer_event(redundancy.gap,
+                                          [this] { send_pending_copies(); });
+  }
+}
+
+void rtppeer::send_pending_copies() {
+  auto now = std::chrono::steady_clock::now();
+  // Always ordered by time, as the resent ones go to the end with the
+  // latest time.
+  while (!pending_copies.empty() && pending_copies.front().when <= now) {
+    auto copy = std::move(pending_copies.front());
+    pending_copies.pop_front();
+    io_bytes_reader data(copy.data.data(), copy.data.size());
+    send_event(data, MIDI_PORT);
+    copy.remaining--;
+    if (copy.remaining > 0) {
+      copy.when = now + redundancy.gap;
+      pending_copies.push_back(std::move(copy));
+    }
+  }
+  if (!pending_copies.empty()) {
+    copies_timer = poller.add_timer_event(pending_copies.front().when - now,
+                                          [this] { send_pending_copies(); });
+  }
+}
+
+/**
+ * Checks and marks the sequence number at the window of recently seen ones.
+ *
+ * Too old ones, out of the window, are not duplicates. Also keeps the loss
+ * stats: the gaps count as lost until the missing packets arrive.
+ */
+bool rtppeer::is_duplicate(uint16_t seq_nr) {
+  if (!seq_window_valid) {
+    seq_window_valid = true;
+    seq_window_last = seq_nr;
+    seq_window = 1;
+    return false;
+  }
+  int16_t diff = seq_nr - seq_window_last;
+  if (diff > 0) {
+    lost_packets += diff - 1;
+    seq_window = diff >= DEDUPE_WINDOW ? 1 : (seq_window << diff) | 1;
+    seq_window_last = seq_nr;
+    return false;
+  }
+  if (-diff >= DEDUPE_WINDOW)
+    return false;
+  uint64_t bit = uint64_t(1) << -diff;
+  if (seq_window & bit)
+    return true;
+  seq_window |= bit;
+  // Was counted as lost
+  if (lost_packets > 0)
+    lost_packets--;
+  reordered_packets++;
+  return false;
+}
+
+/**
+ * Adds a sent MIDI packet to the current FEC group, and sends the parity
+ * when the group is complete.
+ *
+ * The parity is the XOR of the packets, padded with zeros to the longest, so
+ * the other end can rebuild any one packet if it has all the others.
+ */
+void rtppeer::add_fec(const io_bytes_reader &packet) {
+  if (fec_group <= 0 || !(remote_features & FEATURE_FEC))
+    return;
+
+  auto size = packet.size();
+  if (fec_count == 0) {
+    fec_parity.assign(packet.start, packet.end);
+    fec_parity_length = size;
+    fec_base_seq_nr = (uint16_t(packet.start[2]) << 8) | packet.start[3];
+    fec_timer =
+        poller.add_timer_event(FEC_FLUSH, [this] { send_fec_parity(); });
+  } else {
+    if (fec_parity.size() < size)
+      fec_parity.resize(size, 0);
+    for (size_t i = 0; i < size; i++)
+      fec_parity[i] ^= packet.start[i];
+    fec_parity_length ^= size;
+  }
+  fec_count++;
+
+  if (fec_count >= std::min(fec_group, int(FEC_MAX_GROUP)))
+    send_fec_parity();
+}
+
+void rtppeer::send_fec_parity() {
+  fec_timer.disable();
+  if (fec_count == 0)
+    return;
+
+  io_bytes_writer_static<MAX_PACKET_SIZE + FEC_HEADER_SIZE> buffer;
+  buffer.write_uint8(0x80);
+  buffer.write_uint8(FEC_PAYLOAD_TYPE);
+  buffer.write_uint16(fec_base_seq_nr);
+  buffer.write_uint32(0); // No timestamp
+  buffer.write_uint32(local_ssrc);
+  buffer.write_uint8(fec_count);
+  buffer.write_uint16(fec_parity_length);
+  buffer.copy_from(fec_parity.data(), fec_parity.size());
+  fec_count = 0;
+
+  send_event(buffer, MIDI_PORT);
+}
+
+/**
+ * Rebuilds the lost packet of the parity group, if only one is lost.
+ *
+ * As the parity comes after the group, the rebuilt packet comes late and out
+ * of order.
+ */
+void rtppeer::parse_fec(io_bytes_reader &buffer) {
+  if (!(local_features & FEATURE_FEC))
+    return;
+  buffer.read_uint8();
+  buffer.read_uint8();
+  uint16_t base_seq_nr = buffer.read_uint16();
+  buffer.read_uint32();
+  auto ssrc = buffer.read_uint32();
+  if (ssrc != remote_ssrc)
+    return;
+  auto count = buffer.read_uint8();
+  uint16_t length = buffer.read_uint16();
+  if (count > FEC_MAX_GROUP)
+    return;
+
+  int missing = -1;
+  for (int i = 0; i < count; i++) {
+    uint16_t seq_nr = base_seq_nr + i;
+    auto &slot = fec_received[seq_nr % FEC_MAX_GROUP];
+    if (slot.valid && slot.seq_nr == seq_nr)
+      continue;
+    if (missing >= 0) {
+      DEBUG("Lost several packets from {}. Can not rebuild them.",
+            remote_name);
+      fec_unrecoverable += 2; // At least
+      return;
+    }
+    missing = i;
+  }
+  if (missing < 0)
+    return;
+
+  std::vector<uint8_t> data(buffer.position, buffer.end);
+  for (int i = 0; i < count; i++) {
+    if (i == missing)
+      continue;
+    auto &slot = fec_received[uint16_t(base_seq_nr + i) % FEC_MAX_GROUP];
+    if (slot.data.size() > data.size()) {
+      fec_unrecoverable++;
+      return;
+    }
+    for (size_t j = 0; j < slot.data.size(); j++)
+      data[j] ^= slot.data[j];
+    length ^= slot.data.size();
+  }
+  if (length < 12 || length > data.size()) {
+    WARNING("Invalid FEC packet from {}", remote_name);
+    fec_unrecoverable++;
+    return;
+  }
+
+  DEBUG("Rebuilt lost MIDI packet {} from {}",
+        uint16_t(base_seq_nr + missing), remote_name);
+  fec_recovered++;
+  io_bytes_reader packet(data.data(), length);
+  parse_midi(packet);
+}
+
+/**
+ * Writes the 12 bytes RTP header for the next MIDI packet to this peer
+ *
+ * Each call is a new packet, so it increases the sequence number.
+ */
+void rtppeer::write_midi_header(io_bytes_writer &buffer) {
   uint32_t timestamp = get_timestamp();
   seq_nr++;
 
@@ -611,8 +1202,16 @@ void rtppeer::send_midi(const io_bytes_reader &events) {
   buffer.write_uint16(seq_nr);
   buffer.write_uint32(timestamp);
   buffer.write_uint32(local_ssrc);
+}
 
-  // Now midi
+/**
+ * Writes the MIDI command section: length header and the events.
+ *
+ * It does not depend on the peer, so it can be shared by several packets
+ * (see rtpserver::send_midi_to_all_peers).
+ */
+void rtppeer::write_midi_commands(io_bytes_writer &buffer,
+                                  const io_bytes_reader &events) {
   if (events.size() < 16) {
     // Short header, 1 octet
     buffer.write_uint8(events.size());
@@ -623,11 +1222,6 @@ void rtppeer::send_midi(const io_bytes_reader &events) {
   }
 
   buffer.copy_from(events);
-
-  // events.print_hex();
-  // buffer.print_hex();
-
-  send_event(buffer, MIDI_PORT);
 }
 
 void rtppeer::send_goodbye(port_e to_port) {
@@ -679,6 +1273,8 @@ void rtppeer::connect_to(port_e rtp_port) {
   buffer.write_uint32(initiator_id);
   buffer.write_uint32(sender);
   buffer.write_str0(local_name);
+  if (local_features || !local_extension.empty())
+    write_extension(buffer);
 
   // DEBUG("Send packet:");
   // buffer.print_hex();
@@ -31,8 +31,18 @@
 
 using namespace rtpmidid;
 
-rtpserver::rtpserver(std::string _name, const std::string &port)
-    : name(std::move(_name)) {
+static void set_reuseport(int socket) {
+  int enable = 1;
+  if (setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) <
+      0) {
+    throw rtpmidid::exception("Can not set SO_REUSEPORT. {}.",
+                              strerror(errno));
+  }
+}
+
+rtpserver::rtpserver(std::string _name, const std::string &port,
+                     bool peer_sockets_, poller_t &poller_)
+    : poller(poller_), name(std::move(_name)), peer_sockets(peer_sockets_) {
   control_socket = midi_socket = -1;
   control_port = 0;
   midi_port = 0;
@@ -71,6 +81,9 @@ rtpserver::rtpserver(std::string _name, const std::string &port)
       if (control_socket < 0) {
         continue; // Bad socket. Try next.
       }
+      setup_socket(control_socket);
+      if (peer_sockets)
+        set_reuseport(control_socket);
       if (bind(control_socket, listenaddr->ai_addr, listenaddr->ai_addrlen) ==
           0) {
         break;
@@ -94,6 +107,7 @@ rtpserver::rtpserver(std::string _name, const std::string &port)
     DEBUG("Control port at {}:{}", host, control_port);
     midi_port = control_port + 1;
 
+    recv_batch_t::enable_timestamps(control_socket);
     poller.add_fd_in(control_socket,
                      [this](int) { this->data_ready(rtppeer::CONTROL_PORT); });
 
@@ -102,12 +116,16 @@ rtpserver::rtpserver(std::string _name, const std::string &port)
     if (midi_socket < 0) {
       throw rtpmidid::exception("Can not open MIDI socket. Out of sockets?");
     }
+    setup_socket(midi_socket);
+    if (peer_sockets)
+      set_reuseport(midi_socket);
     // Reuse listenaddr, just on next port
     ((sockaddr_in *)listenaddr->ai_addr)->sin_port = htons(midi_port);
     if (bind(midi_socket, listenaddr->ai_addr, listenaddr->ai_addrlen) < 0) {
       throw rtpmidid::exception("Can not open MIDI socket. {}.",
                                 strerror(errno));
     }
+    recv_batch_t::enable_timestamps(midi_socket);
     poller.add_fd_in(midi_socket,
                      [this](int) { this->data_ready(rtppeer::MIDI_PORT); });
   } catch (const std::exception &e) {
@@ -136,6 +154,9 @@ rtpserver::rtpserver(std::string _name, const std::string &port)
 }
 
 rtpserver::~rtpserver() {
+  for (auto &sconn : ssrc_to_conn) {
+    close_peer_sockets(poller, sconn.second.get());
+  }
   if (control_socket >= 0) {
     try {
       poller.remove_fd(control_socket);
@@ -152,6 +173,31 @@ rtpserver::~rtpserver() {
     }
     close(midi_socket);
   }
+  if (multicast_socket >= 0)
+    close(multicast_socket);
+}
+
+void rtpserver::enable_multicast(const multicast_group_t &group) {
+  if (!sessions.empty())
+    throw exception("Can not use multicast at a shared port");
+  if (multicast_socket >= 0)
+    close(multicast_socket);
+  multicast_socket = multicast_sender_socket(group);
+  setup_socket(multicast_socket);
+  multicast_group = group;
+  multicast_session = std::make_unique<rtppeer>(name, poller);
+  // Only the split data comes this way, see send_midi_fanout
+  multicast_session->send_event.connect(
+      [this](const io_bytes_reader &packet, rtppeer::port_e) {
+        send_multicast_packet(packet);
+      });
+  INFO("MIDI data of {} to multicast group {}, for the peers that can join",
+       name, group.to_string());
+}
+
+bool rtpserver::is_multicast_peer(const rtppeer *peer) const {
+  return multicast_session &&
+         (peer->remote_features & rtppeer::FEATURE_MULTICAST);
 }
 
 std::shared_ptr<rtppeer> rtpserver::get_peer_by_packet(io_bytes_reader &buffer,
@@ -180,7 +226,13 @@ std::shared_ptr<rtppeer> rtpserver::get_peer_by_packet(io_bytes_reader &buffer,
     buffer.position = buffer.start + 4;
     auto ssrc = buffer.read_uint32();
     buffer.position = buffer.start;
-    return ssrc_to_peer[ssrc];
+
+    // Not with [], that would add an empty peer for any unknown SSRC
+    auto peer = ssrc_to_peer.find(ssrc);
+    if (peer == ssrc_to_peer.end()) {
+      return nullptr;
+    }
+    return peer->second;
   }
   default:
     if (port == rtppeer::MIDI_PORT && (buffer.start[1] & 0x7F) == 0x61) {
@@ -193,8 +245,7 @@ std::shared_ptr<rtppeer> rtpserver::get_peer_by_packet(io_bytes_reader &buffer,
       if (peer == ssrc_to_peer.end()) {
         return nullptr;
       }
-      return ssrc_to_peer[ssrc];
-      ;
+      return peer->second;
     }
     DEBUG("Unknown COMMAND id {:X} / {:X}", int(command), buffer.start[1]);
     return nullptr;
@@ -221,33 +272,54 @@ std::shared_ptr<rtppeer> rtpserver::get_peer_by_packet(io_bytes_reader &buffer,
 // }
 
 void rtpserver::data_ready(rtppeer::port_e port) {
-  uint8_t raw[1500];
-  struct sockaddr_in6 cliaddr;
-  unsigned int len = sizeof(cliaddr);
+  // May be called because a socket is writable again
+  if (!write_wanted.empty())
+    flush_send_queues();
+
   auto socket = (port == rtppeer::CONTROL_PORT) ? control_socket : midi_socket;
-  auto n = recvfrom(socket, raw, 1500, MSG_DONTWAIT,
-                    (struct sockaddr *)&cliaddr, &len);
+  auto n = recv_batch.recv(socket);
   // DEBUG("Got some data from control: {}", n);
   if (n < 0) {
     auto netport = (port == rtppeer::CONTROL_PORT) ? control_port : midi_port;
     throw exception("Error reading from server 0.0.0.0:{}", netport);
   }
+  if (n > 0) {
+    auto counter = recv_batch.drop_counter(n - 1);
+    if (counter) {
+      auto &drops =
+          (port == rtppeer::CONTROL_PORT) ? control_drops : midi_drops;
+      drops.update(socket, *counter);
+    }
+  }
 
-  auto buffer = io_bytes_reader(raw, n);
+  for (auto i = 0; i < n; i++) {
+    // One bad packet should not discard the rest of the batch
+    try {
+      packet_ready(recv_batch.packet(i), recv_batch.address(i),
+                   recv_batch.address_len(i), recv_batch.timestamp(i), port);
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Error processing packet at server {}: {}", name, e.what());
+    }
+  }
+}
 
+void rtpserver::packet_ready(io_bytes_reader &&buffer,
+                             struct sockaddr_in6 *cliaddr, socklen_t len,
+                             const struct timespec &rx_time,
+                             rtppeer::port_e port) {
   auto peer = get_peer_by_packet(buffer, port);
   if (peer) {
-    peer->data_ready(std::move(buffer), port);
+    peer->data_ready(std::move(buffer), port, rx_time);
   } else {
     // If I dont know the other peer I'm only interested in IN, ignore others
     // If it is not a CONTROL PORT the messages come in the wrong order. The
     // first IN should create the peer.
     if (rtppeer::is_command(buffer) && buffer.start[2] == 'I' &&
         buffer.start[3] == 'N') {
-      create_peer_from(std::move(buffer), &cliaddr, port);
+      create_peer_from(std::move(buffer), cliaddr, rx_time, port);
     } else {
       char host[NI_MAXHOST] { 0 }, service[NI_MAXSERV] { 0 };
-      getnameinfo((const struct sockaddr *)&cliaddr, len, host, NI_MAXHOST,
+      getnameinfo((const struct sockaddr *)cliaddr, len, host, NI_MAXHOST,
 		      service, NI_MAXSERV, NI_NUMERICSERV);
 
       DEBUG("Unknown peer ({}/{}), and not connect on control. Ignoring {} port.",
@@ -258,79 +330,241 @@ void rtpserver::data_ready(rtppeer::port_e port) {
   }
 }
 
+/**
+ * Sends to the peer, via its own socket if any.
+ *
+ * If the socket is full, the packet waits at the peer send queue until the
+ * socket is writable.
+ */
 void rtpserver::sendto(const io_bytes_reader &pb, rtppeer::port_e port,
-                       struct sockaddr_in6 *address, int remote_base_port) {
-  if (port == rtppeer::MIDI_PORT)
-    address->sin6_port = htons(remote_base_port + 1);
-  else
-    address->sin6_port = htons(remote_base_port);
-
-  auto socket = rtppeer::MIDI_PORT == port ? midi_socket : control_socket;
+                       peer_conn_t *conn) {
+  auto socket =
+      (port == rtppeer::MIDI_PORT) ? conn->midi_socket : conn->control_socket;
+  struct sockaddr_in6 *address = nullptr;
+  if (socket < 0) {
+    socket = (port == rtppeer::MIDI_PORT) ? midi_socket : control_socket;
+    address = &conn->address;
+    auto remote_port = conn->remote_base_port;
+    if (port == rtppeer::MIDI_PORT)
+      remote_port++;
+    address->sin6_port = htons(remote_port);
+  }
 
   // DEBUG("Send to {}, {}, family {} {}. {} {}", port, socket, AF_INET6,
   // address->sin6_family, inet_ntoa(address->sin6_addr),
   // htons(address->sin6_port));
 
-  for(;;) {
-    ssize_t res =
-      ::sendto(socket, pb.start, pb.size(), MSG_CONFIRM,
-               (const struct sockaddr *)address, sizeof(struct sockaddr_in6));
+  try {
+    auto res = conn->send_queue.send(socket, pb, address);
+    if (res == send_queue_t::QUEUED)
+      want_write(socket);
+  } catch (const std::exception &e) {
+    throw exception("Could not send data to {}: {}", conn->peer->remote_name,
+                    e.what());
+  }
+}
 
-    if (static_cast<uint32_t>(res) == pb.size())
-      break;
+void rtpserver::want_write(int socket) {
+  if (write_wanted.count(socket))
+    return;
+  poller.set_fd_out(socket, true);
+  write_wanted.insert(socket);
+}
+
+/**
+ * Some socket is writable again. Flush all queues, and stop waiting for write
+ * on the sockets with nothing left.
+ */
+void rtpserver::flush_send_queues() {
+  for (auto &sconn : ssrc_to_conn) {
+    sconn.second->send_queue.flush();
+  }
 
-    char addr_buffer[INET6_ADDRSTRLEN] { 0 };
-    inet_ntop(AF_INET6, address, addr_buffer, sizeof(struct sockaddr_in6));
+  for (auto it = write_wanted.begin(); it != write_wanted.end();) {
+    auto socket = *it;
+    bool pending = false;
+    for (auto &sconn : ssrc_to_conn) {
+      if (sconn.second->send_queue.pending(socket)) {
+        pending = true;
+        break;
+      }
+    }
+    if (pending) {
+      ++it;
+      continue;
+    }
+    try {
+      poller.set_fd_out(socket, false);
+    } catch (const std::exception &e) {
+      // May be already closed peer socket
+      DEBUG("Could not stop waiting for write at {}: {}", socket, e.what());
+    }
+    it = write_wanted.erase(it);
+  }
+}
 
-    if (res == -1) {
-      if (errno == EINTR) {
-        DEBUG("Retry sendto because of EINTR");
-        continue;
+/**
+ * Opens a connected socket per port for this peer.
+ *
+ * They are bound to the same port as the server sockets (SO_REUSEPORT), and
+ * connected to the peer, so the kernel sends here all the packets from it. If
+ * it fails, the peer keeps using the shared server sockets.
+ */
+void rtpserver::open_peer_sockets(std::shared_ptr<peer_conn_t> conn,
+                                  std::weak_ptr<rtppeer> wpeer) {
+  if (conn->control_socket >= 0)
+    return; // Already open
+
+  auto open_socket = [conn](int listen_socket, uint16_t remote_port) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    if (::getsockname(listen_socket, (sockaddr *)&local, &len) < 0) {
+      throw exception("Can not get server socket address. {}.",
+                      strerror(errno));
+    }
+    auto socket = ::socket(local.ss_family, SOCK_DGRAM, 0);
+    if (socket < 0) {
+      throw exception("Can not open peer socket. {}.", strerror(errno));
+    }
+    try {
+      set_reuseport(socket);
+      if (bind(socket, (sockaddr *)&local, len) < 0) {
+        throw exception("Can not bind peer socket. {}.", strerror(errno));
+      }
+      recv_batch_t::enable_timestamps(socket);
+      setup_socket(socket);
+      struct sockaddr_in6 remote = conn->address;
+      remote.sin6_port = htons(remote_port);
+      if (::connect(socket, (sockaddr *)&remote, sizeof(remote)) < 0) {
+        throw exception("Can not connect peer socket. {}.", strerror(errno));
       }
+    } catch (...) {
+      ::close(socket);
+      throw;
+    }
+    return socket;
+  };
 
-      throw exception("Could not send all data to {}: {}", addr_buffer,
-		      strerror(errno));
+  try {
+    conn->control_socket =
+        open_socket(control_socket, conn->remote_base_port);
+    poller.add_fd_in(conn->control_socket, [this, wpeer, conn](int fd) {
+      this->peer_data_ready(wpeer, fd, &conn->control_drops,
+                            rtppeer::CONTROL_PORT);
+    });
+    conn->midi_socket = open_socket(midi_socket, conn->remote_base_port + 1);
+    poller.add_fd_in(conn->midi_socket, [this, wpeer, conn](int fd) {
+      this->peer_data_ready(wpeer, fd, &conn->midi_drops, rtppeer::MIDI_PORT);
+    });
+  } catch (const std::exception &e) {
+    WARNING("Could not open peer sockets for {}, using server sockets: {}",
+            conn->peer->remote_name, e.what());
+    close_peer_sockets(poller, conn.get());
+  }
+}
+
+void rtpserver::close_peer_sockets(poller_t &poller, peer_conn_t *conn) {
+  for (auto socket : {&conn->control_socket, &conn->midi_socket}) {
+    if (*socket < 0)
+      continue;
+    try {
+      poller.remove_fd(*socket);
+    } catch (rtpmidid::exception &e) {
+      ERROR("Error removing peer socket: {}", e.what());
     }
+    ::close(*socket);
+    *socket = -1;
+  }
+}
+
+void rtpserver::peer_data_ready(std::weak_ptr<rtppeer> wpeer, int socket,
+                                socket_drops_t *drops, rtppeer::port_e port) {
+  if (!write_wanted.empty())
+    flush_send_queues();
+
+  auto n = recv_batch.recv(socket);
+  if (n < 0) {
+    throw exception("Error reading from peer socket {}: {}", socket,
+                    strerror(errno));
+  }
+  if (n > 0) {
+    auto counter = recv_batch.drop_counter(n - 1);
+    if (counter)
+      drops->update(socket, *counter);
+  }
 
-    DEBUG("Could not send whole message to {}: only {} of {}", addr_buffer,
-		    res, pb.size());
-    break;
+  // The kernel already did the demultiplexing, all is for this peer
+  for (auto i = 0; i < n; i++) {
+    auto peer = wpeer.lock();
+    if (!peer)
+      return;
+    try {
+      peer->data_ready(recv_batch.packet(i), port, recv_batch.timestamp(i));
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Error processing packet at server {}: {}", name, e.what());
+    }
   }
 }
 
 void rtpserver::create_peer_from(io_bytes_reader &&buffer,
                                  struct sockaddr_in6 *cliaddr,
+                                 const struct timespec &rx_time,
                                  rtppeer::port_e port) {
 
-  auto peer = std::make_shared<rtppeer>(name);
-  auto address = std::make_shared<struct sockaddr_in6>();
-  ::memcpy(address.get(), cliaddr, sizeof(struct sockaddr_in6));
-  auto remote_base_port = htons(cliaddr->sin6_port);
+  auto peer = std::make_shared<rtppeer>(name, poller);
+  auto conn = std::make_shared<peer_conn_t>();
+  conn->peer = peer.get();
+  conn->send_queue.max_packets = send_queue_max;
+  conn->send_queue.drop_policy = send_drop_policy;
+  conn->send_queue.poller = &poller;
+  ::memcpy(&conn->address, cliaddr, sizeof(struct sockaddr_in6));
+  conn->remote_base_port = htons(cliaddr->sin6_port);
+  // Clients may send both invitations at once, and the MIDI one can be first
+  if (port == rtppeer::MIDI_PORT)
+    conn->remote_base_port--;
+  peer->local_features |= rtppeer::FEATURE_REDUNDANCY;
+  peer->local_features |= rtppeer::FEATURE_FEC;
+  peer->redundancy = redundancy;
+  peer->fec_group = fec_group;
+  peer->reorder_window = reorder_window;
+  peer->mtu = mtu;
+  peer->sessions = sessions;
+  peer->default_session = default_session;
+  if (multicast_session) {
+    // Same SSRC as the group data, so the peer accepts it. Told at OK.
+    peer->local_ssrc = multicast_session->local_ssrc;
+    peer->local_features |= rtppeer::FEATURE_MULTICAST;
+    peer->local_extension[rtppeer::EXT_MULTICAST_GROUP] =
+        multicast_group.encode();
+  }
   // DEBUG("Address family {} {}. From {}", cliaddr.sin6_family,
   // address->sin6_family, socket);
 
   // This is the send to the proper ports
   peer->send_event.connect(
-      [this, address, remote_base_port](const io_bytes_reader &buff,
-                                        rtppeer::port_e port) {
-        this->sendto(buff, port, address.get(), remote_base_port);
+      [this, conn](const io_bytes_reader &buff, rtppeer::port_e port) {
+        this->sendto(buff, port, conn.get());
       });
 
-  peer->data_ready(std::move(buffer), port);
+  peer->data_ready(std::move(buffer), port, rx_time);
 
   // After read the first packet I know the initiator_id and ssrc
   initiator_to_peer[peer->initiator_id] = peer;
   ssrc_to_peer[peer->remote_ssrc] = peer;
+  ssrc_to_conn[peer->remote_ssrc] = conn;
+  update_ssrc_filter();
 
   // Setup some callbacks
   auto wpeer = std::weak_ptr(peer);
   peer->connected_event.connect(
-      [this, wpeer](const std::string &name, rtppeer::status_e st) {
+      [this, wpeer, conn](const std::string &name, rtppeer::status_e st) {
         if (st != rtppeer::CONNECTED)
           return;
         if (wpeer.expired())
           return;
         auto peer = wpeer.lock();
+        if (peer_sockets)
+          open_peer_sockets(conn, wpeer);
         connected_event(peer);
       });
 
@@ -347,11 +581,304 @@ void rtpserver::create_peer_from(io_bytes_reader &&buffer,
 
         this->initiator_to_peer.erase(peer->initiator_id);
         this->ssrc_to_peer.erase(peer->remote_ssrc);
+        auto conn = this->ssrc_to_conn.find(peer->remote_ssrc);
+        if (conn != this->ssrc_to_conn.end()) {
+          this->write_wanted.erase(conn->second->control_socket);
+          this->write_wanted.erase(conn->second->midi_socket);
+          // May be inside the peer socket callback, so close them later
+          poller.call_later([poller = &poller, conn = conn->second] {
+            close_peer_sockets(*poller, conn.get());
+          });
+          this->ssrc_to_conn.erase(conn);
+        }
+        update_ssrc_filter();
       });
 }
 
+uint64_t rtpserver::kernel_drops() {
+  auto drops = control_drops.drops + midi_drops.drops;
+  for (auto &sconn : ssrc_to_conn) {
+    drops += sconn.second->control_drops.drops + sconn.second->midi_drops.drops;
+  }
+  return drops;
+}
+
+uint64_t rtpserver::filtered_packets() {
+  auto filtered = control_drops.filtered + midi_drops.filtered;
+  for (auto &sconn : ssrc_to_conn) {
+    filtered += sconn.second->control_drops.filtered;
+    filtered += sconn.second->midi_drops.filtered;
+  }
+  return filtered;
+}
+
+void rtpserver::update_ssrc_filter() {
+  if (!socket_options.filter || !socket_options.filter_ssrc)
+    return;
+  std::vector<uint32_t> ssrcs;
+  ssrcs.reserve(ssrc_to_peer.size());
+  for (auto &speer : ssrc_to_peer) {
+    if (speer.second)
+      ssrcs.push_back(speer.first);
+  }
+  try {
+    attach_rtpmidi_filter(midi_socket, ssrcs);
+  } catch (const std::exception &e) {
+    // Still the plain RTP MIDI filter
+    WARNING_ONCE("{}", e.what());
+  }
+}
+
+/**
+ * Sends the same MIDI data to all connected peers. With a session, only to
+ * the peers of that session. At shared ports all peers have one, see
+ * rtppeer::default_session.
+ *
+ * The MIDI command section is encoded only once. Each peer only adds its own
+ * RTP header (sequence number, timestamp and SSRC), and all the packets are
+ * sent with a single sendmmsg.
+ *
+ * Peers with packets already waiting at their send queue, or when the socket
+ * is full, get it queued. A failing peer does not stop the rest. Peers with
+ * their own socket (peer_sockets) get it by that socket, one by one.
+ */
 void rtpserver::send_midi_to_all_peers(const io_bytes_reader &buffer) {
-  for (auto &speers : ssrc_to_peer) {
-    speers.second->send_midi(buffer);
+  send_midi_fanout(buffer, nullptr);
+}
+
+void rtpserver::send_midi_to_session(const std::string &session,
+                                     const io_bytes_reader &buffer) {
+  send_midi_fanout(buffer, &session);
+}
+
+void rtpserver::send_midi_fanout(const io_bytes_reader &buffer,
+                                 const std::string *session) {
+  // Too long for any single packet, so all the peers split it and there is
+  // nothing to encode here
+  bool oversize = 12 + 2 + buffer.size() > rtppeer::MAX_PACKET_SIZE;
+  uint8_t commands_data[4096 + 2];
+  io_bytes_writer commands(commands_data, sizeof(commands_data));
+  if (!oversize)
+    rtppeer::write_midi_commands(commands, buffer);
+
+  auto npeers = ssrc_to_conn.size();
+  if (fanout_msgs.size() < npeers) {
+    fanout_msgs.resize(npeers);
+    fanout_iovecs.resize(npeers * 2);
+    fanout_headers.resize(npeers);
+    fanout_conns.resize(npeers);
+  }
+
+  unsigned int count = 0;
+  bool multicast_peers = false;
+  // Same transmit time for all
+  txtime_cmsg_t txtime(poller);
+  for (auto &sconn : ssrc_to_conn) {
+    auto conn = sconn.second.get();
+    auto peer = conn->peer;
+    if (session && !peer->session.empty() && peer->session != *session)
+      continue;
+    if (!peer->is_connected()) {
+      DEBUG("Can not send MIDI data to {} yet, not connected ({:X}).",
+            peer->remote_name, (int)peer->status);
+      continue;
+    }
+    // Never by itself, that would be another sequence under the group SSRC
+    if (is_multicast_peer(peer)) {
+      multicast_peers = true;
+      continue;
+    }
+    // Too long for one packet, the peer splits it
+    if (oversize || 12 + 2 + buffer.size() > peer->max_packet_size()) {
+      peer->send_midi(buffer);
+      continue;
+    }
+
+    auto &header_data = fanout_headers[count];
+    io_bytes_writer header(header_data.data(), header_data.size());
+    peer->write_midi_header(header);
+
+    auto iov = &fanout_iovecs[count * 2];
+    iov[0].iov_base = header_data.data();
+    iov[0].iov_len = header_data.size();
+    iov[1].iov_base = commands.start;
+    iov[1].iov_len = commands.pos();
+
+    conn->address.sin6_port = htons(conn->remote_base_port + 1);
+    auto &msg = fanout_msgs[count];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = &conn->address;
+    msg.msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+    msg.msg_hdr.msg_iov = iov;
+    msg.msg_hdr.msg_iovlen = 2;
+    txtime.attach(msg.msg_hdr);
+
+    // Its own connected socket (peer_sockets) can not join the sendmmsg on
+    // the shared one
+    if (conn->midi_socket >= 0) {
+      send_fanout_peer_socket(conn, msg);
+      continue;
+    }
+
+    // Keep the order with the already waiting packets
+    if (!conn->send_queue.empty()) {
+      queue_fanout_msg(conn, msg);
+      send_fanout_protection(peer, msg);
+      continue;
+    }
+
+    fanout_conns[count] = conn;
+    count++;
+  }
+
+  if (multicast_peers) {
+    multicast_session->mtu = mtu;
+    auto max_size = multicast_session->max_packet_size();
+    if (oversize || 12 + 2 + buffer.size() > max_size)
+      multicast_session->send_midi_split(buffer);
+    else
+      send_midi_to_multicast(commands);
   }
+
+  unsigned int sent = 0;
+  while (sent < count) {
+    auto res = ::sendmmsg(midi_socket, &fanout_msgs[sent], count - sent,
+                          MSG_CONFIRM | MSG_DONTWAIT);
+    if (res >= 0) {
+      sent += res;
+      continue;
+    }
+    if (errno == EINTR) {
+      DEBUG("Retry sendmmsg because of EINTR");
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // Socket full. The rest wait for it to be writable.
+      for (; sent < count; sent++) {
+        queue_fanout_msg(fanout_conns[sent], fanout_msgs[sent]);
+      }
+      break;
+    }
+    // Skip the failing peer, but still send to the rest. Also on ENOBUFS,
+    // waiting for the socket to be writable would not help.
+    ERROR("Could not send MIDI data to {}: {}",
+          fanout_conns[sent]->peer->remote_name, strerror(errno));
+    fanout_conns[sent]->send_queue.drops++;
+    sent++;
+  }
+
+  // Only after the originals, or the other end would recover packets that
+  // were not lost yet
+  for (unsigned int i = 0; i < count; i++)
+    send_fanout_protection(fanout_conns[i]->peer, fanout_msgs[i]);
+}
+
+/// Sends a fan-out message by the peer's own socket, in order with its queue
+void rtpserver::send_fanout_peer_socket(peer_conn_t *conn,
+                                        const struct mmsghdr &msg) {
+  uint8_t data[12 + 4096 + 2];
+  io_bytes_writer packet(data, sizeof(data));
+  msg_to_packet(msg, packet);
+  sendto(io_bytes_reader(data, packet.pos()), rtppeer::MIDI_PORT, conn);
+  send_fanout_protection(conn->peer, msg);
+}
+
+/// Redundant copies and FEC of a fan-out message, as rtppeer::send_midi does
+void rtpserver::send_fanout_protection(rtppeer *peer,
+                                       const struct mmsghdr &msg) {
+  if (peer->redundancy.copies <= 1 && peer->fec_group <= 0)
+    return;
+  uint8_t data[12 + 4096 + 2];
+  io_bytes_writer packet(data, sizeof(data));
+  msg_to_packet(msg, packet);
+  peer->send_protection(packet);
+}
+
+void rtpserver::add_session(const std::string &session) {
+  if (multicast_session)
+    throw exception("Can not use multicast at a shared port");
+  sessions.insert(session);
+  if (default_session.empty())
+    default_session = session;
+  INFO("Session {} at shared port {}", session, control_port);
+}
+
+void rtpserver::remove_session(const std::string &session) {
+  sessions.erase(session);
+  if (default_session == session)
+    default_session = sessions.empty() ? "" : *sessions.begin();
+  std::vector<std::shared_ptr<rtppeer>> peers;
+  for (auto &speer : ssrc_to_peer) {
+    if (speer.second && speer.second->session == session)
+      peers.push_back(speer.second);
+  }
+  // The goodbye removes them from the maps
+  for (auto &peer : peers) {
+    if (peer->status & rtppeer::MIDI_CONNECTED)
+      peer->send_goodbye(rtppeer::MIDI_PORT);
+    if (peer->status & rtppeer::CONTROL_CONNECTED)
+      peer->send_goodbye(rtppeer::CONTROL_PORT);
+  }
+}
+
+/**
+ * Sends the MIDI data once to the multicast group.
+ *
+ * There is no send queue for the group; if the socket is full the packet is
+ * dropped, and counted.
+ */
+void rtpserver::send_midi_to_multicast(const io_bytes_writer &commands) {
+  uint8_t header_data[12];
+  io_bytes_writer header(header_data, sizeof(header_data));
+  multicast_session->write_midi_header(header);
+
+  struct iovec iov[2];
+  iov[0].iov_base = header_data;
+  iov[0].iov_len = sizeof(header_data);
+  iov[1].iov_base = commands.start;
+  iov[1].iov_len = commands.pos();
+  send_multicast_iov(iov, 2);
+}
+
+/// A whole packet from the multicast session, as when it splits the data
+void rtpserver::send_multicast_packet(const io_bytes_reader &packet) {
+  struct iovec iov;
+  iov.iov_base = packet.start;
+  iov.iov_len = packet.size();
+  send_multicast_iov(&iov, 1);
+}
+
+void rtpserver::send_multicast_iov(struct iovec *iov, size_t iovlen) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &multicast_group.addr;
+  msg.msg_namelen = multicast_group.addrlen;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovlen;
+  txtime_cmsg_t txtime(poller);
+  txtime.attach(msg);
+
+  if (::sendmsg(multicast_socket, &msg, MSG_DONTWAIT) < 0) {
+    multicast_drops++;
+    WARNING_ONCE("Could not send MIDI data to multicast group {}: {}",
+                 multicast_group.to_string(), strerror(errno));
+  }
+}
+
+void rtpserver::msg_to_packet(const struct mmsghdr &msg,
+                              io_bytes_writer &packet) {
+  for (size_t i = 0; i < msg.msg_hdr.msg_iovlen; i++) {
+    auto &iov = msg.msg_hdr.msg_iov[i];
+    packet.copy_from((uint8_t *)iov.iov_base, iov.iov_len);
+  }
+}
+
+void rtpserver::queue_fanout_msg(peer_conn_t *conn,
+                                 const struct mmsghdr &msg) {
+  uint8_t data[12 + 4096 + 2];
+  io_bytes_writer packet(data, sizeof(data));
+  msg_to_packet(msg, packet);
+  conn->send_queue.push(midi_socket, io_bytes_reader(data, packet.pos()),
+                        &conn->address);
+  want_write(midi_socket);
 }
@@ -0,0 +1,175 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/sendqueue.hpp>
+#include <rtpmidid/sockopts.hpp>
+
+using namespace rtpmidid;
+
+send_queue_t::send_queue_t(size_t max_packets_, drop_policy_e drop_policy_)
+    : max_packets(max_packets_), drop_policy(drop_policy_) {}
+
+// Not ENOBUFS: the socket stays writable, so waiting for it would spin. That
+// packet is dropped as any other error.
+static bool is_full_error(int err) {
+  return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+// Returns true if sent, false if socket full. Throws on other errors.
+static bool send_one(int fd, const uint8_t *data, size_t size,
+                     const struct sockaddr_in6 *address,
+                     txtime_cmsg_t *txtime = nullptr) {
+  struct iovec iov = {(void *)data, size};
+  struct msghdr msg = {};
+  msg.msg_name = (void *)address;
+  msg.msg_namelen = address ? sizeof(struct sockaddr_in6) : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (txtime)
+    txtime->attach(msg);
+  for (;;) {
+    auto res = ::sendmsg(fd, &msg, MSG_CONFIRM | MSG_DONTWAIT);
+    if (res >= 0) {
+      if (static_cast<size_t>(res) != size)
+        DEBUG("Could not send whole message: only {} of {}", res, size);
+      return true;
+    }
+    if (errno == EINTR) {
+      DEBUG("Retry sendmsg because of EINTR");
+      continue;
+    }
+    if (is_full_error(errno))
+      return false;
+    throw exception("Could not send data: {}", strerror(errno));
+  }
+}
+
+send_queue_t::result_e send_queue_t::send(int fd, const io_bytes_reader &data,
+                                          const struct sockaddr_in6 *address) {
+  // Keep the order, if there is something waiting, this waits too. Only
+  // MIDI packets sent now get a transmit time; late ones just go.
+  if (packets.empty()) {
+    txtime_cmsg_t txtime(*poller);
+    bool timed =
+        socket_options.txtime_offset_us > 0 && packet_kind(data) != COMMAND;
+    try {
+      if (send_one(fd, data.start, data.size(), address,
+                   timed ? &txtime : nullptr))
+        return SENT;
+    } catch (const std::exception &e) {
+      // As at flush, the caller may be sending to many peers
+      ERROR_ONCE("Dropping packet: {}", e.what());
+      drops++;
+      return DROPPED;
+    }
+  }
+  return push(fd, data, address);
+}
+
+send_queue_t::result_e send_queue_t::push(int fd, const io_bytes_reader &data,
+                                          const struct sockaddr_in6 *address) {
+  auto kind = packet_kind(data);
+  if (packets.size() >= max_packets && !make_room(kind)) {
+    drops++;
+    return DROPPED;
+  }
+
+  packet_t packet;
+  packet.fd = fd;
+  packet.kind = kind;
+  packet.has_address = address != nullptr;
+  if (address)
+    packet.address = *address;
+  packet.data.assign(data.start, data.end);
+  packets.push_back(std::move(packet));
+  return QUEUED;
+}
+
+/**
+ * Drops one of the queued packets to make space for a new one of the given
+ * kind. Returns false if the new one is the one to drop.
+ */
+bool send_queue_t::make_room(packet_kind_e incoming) {
+  switch (drop_policy) {
+  case DROP_NEWEST:
+    return false;
+  case DROP_OLDEST:
+    break;
+  case DROP_OLDEST_NON_REALTIME: {
+    for (auto it = packets.begin(); it != packets.end(); ++it) {
+      if (it->kind == NORMAL) {
+        packets.erase(it);
+        drops++;
+        return true;
+      }
+    }
+    // All queued are clock or commands. Only if the new one is too, the oldest
+    // of them has to go; the queue must stay bounded.
+    if (incoming == NORMAL)
+      return false;
+  } break;
+  }
+  packets.pop_front();
+  drops++;
+  return true;
+}
+
+bool send_queue_t::flush() {
+  while (!packets.empty()) {
+    auto &packet = packets.front();
+    try {
+      if (!send_one(packet.fd, packet.data.data(), packet.data.size(),
+                    packet.has_address ? &packet.address : nullptr))
+        return false;
+    } catch (const std::exception &e) {
+      ERROR_ONCE("Dropping queued packet: {}", e.what());
+      drops++;
+    }
+    packets.pop_front();
+  }
+  return true;
+}
+
+bool send_queue_t::pending(int fd) const {
+  for (auto &packet : packets) {
+    if (packet.fd == fd)
+      return true;
+  }
+  return false;
+}
+
+send_queue_t::packet_kind_e
+send_queue_t::packet_kind(const io_bytes_reader &data) {
+  auto size = data.size();
+  if (size >= 2 && data.start[0] == 0xFF && data.start[1] == 0xFF)
+    return COMMAND;
+  // RTP MIDI. The command section has a 1 or 2 bytes length header.
+  if (size > 13 && (data.start[1] & 0x7F) == 0x61) {
+    size_t first = (data.start[12] & 0x80) ? 14 : 13;
+    if (size > first && data.start[first] >= 0xF8)
+      return REALTIME;
+  }
+  return NORMAL;
+}
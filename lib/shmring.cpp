@@ -0,0 +1,114 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <algorithm>
+#include <string.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/shmring.hpp>
+
+using namespace rtpmidid;
+
+shm_ring_t::shm_ring_t(void *memory, uint32_t capacity)
+    : header((header_t *)memory), data((uint8_t *)memory + sizeof(header_t)),
+      ring_capacity(capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    throw exception("Ring capacity must be a power of 2, not {}", capacity);
+}
+
+size_t shm_ring_t::memory_size(uint32_t capacity) {
+  return sizeof(header_t) + capacity;
+}
+
+void shm_ring_t::init() {
+  header->head.store(0);
+  header->tail.store(0);
+}
+
+// Positions grow forever and wrap at 2^32, which is a multiple of the
+// capacity, so the offset is just the low bits.
+void shm_ring_t::write_at(uint32_t pos, const uint8_t *src, size_t size) {
+  uint32_t offset = pos & (ring_capacity - 1);
+  size_t first = std::min<size_t>(size, ring_capacity - offset);
+  memcpy(data + offset, src, first);
+  memcpy(data, src + first, size - first);
+}
+
+void shm_ring_t::read_at(uint32_t pos, uint8_t *dst, size_t size) const {
+  uint32_t offset = pos & (ring_capacity - 1);
+  size_t first = std::min<size_t>(size, ring_capacity - offset);
+  memcpy(dst, data + offset, first);
+  memcpy(dst + first, data, size - first);
+}
+
+bool shm_ring_t::push(const uint8_t *src, size_t size, bool *wake) {
+  if (size == 0 || size > MAX_MESSAGE)
+    return false;
+  uint32_t head = header->head.load(std::memory_order_relaxed);
+  uint32_t tail = header->tail.load(std::memory_order_acquire);
+  size_t need = 2 + size;
+  // A bad tail from the other side would give a huge free space
+  uint32_t used = head - tail;
+  if (used > ring_capacity || ring_capacity - used < need)
+    return false;
+
+  uint8_t length[2] = {uint8_t(size >> 8), uint8_t(size & 0xFF)};
+  write_at(head, length, 2);
+  write_at(head + 2, src, size);
+  header->head.store(head + need, std::memory_order_seq_cst);
+
+  // Read tail again after publishing. If the consumer had taken everything
+  // before this message it may be going to sleep, and needs a wake up. The
+  // head store here, and the tail store and head load at pop, are seq_cst,
+  // so at least one sees the other.
+  if (wake)
+    *wake = header->tail.load(std::memory_order_seq_cst) == head;
+  return true;
+}
+
+size_t shm_ring_t::pop(uint8_t *dst, size_t max) {
+  uint32_t tail = header->tail.load(std::memory_order_relaxed);
+  uint32_t head = header->head.load(std::memory_order_seq_cst);
+  if (head == tail)
+    return 0;
+
+  // The other side may write anything. Never move the tail past the head.
+  uint32_t used = head - tail;
+  if (used < 2 || used > ring_capacity)
+    throw exception("Corrupt ring, {} bytes used", used);
+  uint8_t length[2];
+  read_at(tail, length, 2);
+  size_t size = (length[0] << 8) | length[1];
+  if (size == 0 || 2 + size > used)
+    throw exception("Corrupt ring, message of {} bytes with {} used", size,
+                    used);
+  read_at(tail + 2, dst, std::min(size, max));
+  header->tail.store(tail + 2 + size, std::memory_order_seq_cst);
+  return std::min(size, max);
+}
+
+bool shm_ring_t::empty() const {
+  return header->head.load(std::memory_order_seq_cst) ==
+         header->tail.load(std::memory_order_seq_cst);
+}
+
+size_t shm_ring_t::used() const {
+  return header->head.load(std::memory_order_acquire) -
+         header->tail.load(std::memory_order_acquire);
+}
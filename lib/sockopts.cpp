@@ -0,0 +1,206 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/sock_diag.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/sockopts.hpp>
+
+using namespace rtpmidid;
+
+socket_options_t rtpmidid::socket_options;
+
+static void set_option(int fd, int option, int value, const char *name) {
+  if (setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value)) < 0) {
+    throw exception("Can not set {}. {}.", name, strerror(errno));
+  }
+}
+
+void rtpmidid::setup_socket(int fd) {
+  if (socket_options.rcvbuf > 0)
+    set_option(fd, SO_RCVBUF, socket_options.rcvbuf, "SO_RCVBUF");
+  if (socket_options.sndbuf > 0)
+    set_option(fd, SO_SNDBUF, socket_options.sndbuf, "SO_SNDBUF");
+  set_option(fd, SO_RXQ_OVFL, 1, "SO_RXQ_OVFL");
+
+  if (socket_options.busy_poll_us > 0) {
+    // Over net.core.busy_read needs CAP_NET_ADMIN. Still works, as the
+    // poller spins anyway.
+    try {
+      set_option(fd, SO_BUSY_POLL, socket_options.busy_poll_us,
+                 "SO_BUSY_POLL");
+#ifdef SO_PREFER_BUSY_POLL
+      set_option(fd, SO_PREFER_BUSY_POLL, 1, "SO_PREFER_BUSY_POLL");
+#endif
+    } catch (const std::exception &e) {
+      WARNING_ONCE("{}", e.what());
+    }
+  }
+
+  if (socket_options.filter) {
+    try {
+      attach_rtpmidi_filter(fd);
+    } catch (const std::exception &e) {
+      WARNING_ONCE("{}", e.what());
+    }
+  }
+
+  if (socket_options.txtime_offset_us > 0) {
+    struct sock_txtime txtime = {};
+    txtime.clockid = CLOCK_MONOTONIC;
+    if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) {
+      // Packets with SCM_TXTIME would fail at this socket
+      WARNING("Can not set SO_TXTIME, sending MIDI packets at once. {}.",
+              strerror(errno));
+      socket_options.txtime_offset_us = 0;
+    }
+  }
+}
+
+/**
+ * Builds and attaches the classic BPF program.
+ *
+ * At UDP sockets the program sees the UDP header, so the payload is at 8.
+ * AppleMIDI commands start with 0xFFFF and a known command; RTP has version
+ * 2 and payload type 0x61 (MIDI) or 0x62 (FEC), and the SSRC at 8.
+ */
+void rtpmidid::attach_rtpmidi_filter(int fd,
+                                     const std::vector<uint32_t> &ssrcs) {
+  const uint32_t PAYLOAD = 8;
+  const uint32_t ACCEPT = 0xFFFFFFFF;
+  // Labels. Jumps are relative to the next instruction.
+  const size_t COMMAND = 11, DROP = 18, RTP_OK = 20;
+  std::vector<struct sock_filter> program;
+  auto add = [&program](uint16_t code, uint32_t k, size_t jt = 0,
+                        size_t jf = 0) {
+    auto next = program.size() + 1;
+    program.push_back({code, uint8_t(jt ? jt - next : 0),
+                       uint8_t(jf ? jf - next : 0), k});
+  };
+
+  // 0: Shortest valid one is 12 bytes
+  add(BPF_LD | BPF_W | BPF_LEN, 0);
+  add(BPF_JMP | BPF_JGE | BPF_K, PAYLOAD + 12, 0, DROP);
+  add(BPF_LD | BPF_H | BPF_ABS, PAYLOAD);
+  add(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFF, COMMAND, 0);
+  // 4: RTP
+  add(BPF_LD | BPF_B | BPF_ABS, PAYLOAD);
+  add(BPF_ALU | BPF_AND | BPF_K, 0xC0);
+  add(BPF_JMP | BPF_JEQ | BPF_K, 0x80, 0, DROP);
+  add(BPF_LD | BPF_B | BPF_ABS, PAYLOAD + 1);
+  add(BPF_ALU | BPF_AND | BPF_K, 0x7F);
+  add(BPF_JMP | BPF_JEQ | BPF_K, 0x61, RTP_OK, 0);
+  add(BPF_JMP | BPF_JEQ | BPF_K, 0x62, RTP_OK, DROP);
+  // 11: COMMAND. Its name is after the signature.
+  add(BPF_LD | BPF_H | BPF_ABS, PAYLOAD + 2);
+  for (uint32_t command : {0x494e, 0x4f4b, 0x4e4f, 0x4259, 0x434b, 0x5253})
+    add(BPF_JMP | BPF_JEQ | BPF_K, command, DROP + 1, 0);
+  // 18: DROP, and accept
+  add(BPF_RET | BPF_K, 0);
+  add(BPF_RET | BPF_K, ACCEPT);
+  // 20: RTP_OK, check the SSRC. The jumps are short, so each match
+  // returns just after.
+  if (!ssrcs.empty()) {
+    add(BPF_LD | BPF_W | BPF_ABS, PAYLOAD + 8);
+    for (auto ssrc : ssrcs) {
+      program.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, ssrc});
+      add(BPF_RET | BPF_K, ACCEPT);
+    }
+    add(BPF_RET | BPF_K, 0);
+  } else {
+    add(BPF_RET | BPF_K, ACCEPT);
+  }
+
+  if (program.size() > BPF_MAXINSNS)
+    throw exception("Too many SSRCs for the socket filter: {}",
+                    ssrcs.size());
+  struct sock_fprog fprog = {(unsigned short)program.size(), program.data()};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) <
+      0) {
+    throw exception("Can not attach socket filter. {}.", strerror(errno));
+  }
+}
+
+void txtime_cmsg_t::attach(struct msghdr &msg) {
+  if (socket_options.txtime_offset_us <= 0)
+    return;
+  // steady_clock is CLOCK_MONOTONIC
+  auto when = poller.event_time() +
+              std::chrono::microseconds(socket_options.txtime_offset_us);
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    when.time_since_epoch())
+                    .count();
+
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(ns));
+  memcpy(CMSG_DATA(cmsg), &ns, sizeof(ns));
+}
+
+uint32_t socket_drops_t::update(int fd, uint32_t counter) {
+  // Wraps around, but unsigned arithmetic is still right
+  uint32_t new_drops = counter - last_counter;
+  last_counter = counter;
+  if (new_drops == 0)
+    return 0;
+
+  if (socket_options.filter) {
+    uint32_t meminfo[SK_MEMINFO_VARS] = {};
+    socklen_t meminfo_len = sizeof(meminfo);
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &meminfo_len) == 0 &&
+        meminfo[SK_MEMINFO_RMEM_ALLOC] < meminfo[SK_MEMINFO_RCVBUF] / 2) {
+      filtered += new_drops;
+      return 0;
+    }
+  }
+  drops += new_drops;
+
+  // Linux doubles the value on set, and returns the doubled one on get
+  int rcvbuf = 0;
+  socklen_t len = sizeof(rcvbuf);
+  getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+  if (rcvbuf >= socket_options.max_rcvbuf) {
+    WARNING("Kernel dropped {} packets at socket {} (total {}). Receive "
+            "buffer already at {} bytes.",
+            new_drops, fd, drops, rcvbuf);
+    return new_drops;
+  }
+  auto new_rcvbuf = std::min(rcvbuf * 2, socket_options.max_rcvbuf);
+  WARNING("Kernel dropped {} packets at socket {} (total {}). Growing "
+          "receive buffer from {} to {} bytes.",
+          new_drops, fd, drops, rcvbuf, new_rcvbuf);
+  try {
+    set_option(fd, SO_RCVBUF, new_rcvbuf / 2, "SO_RCVBUF");
+  } catch (const std::exception &e) {
+    ERROR("{}", e.what());
+  }
+  return new_drops;
+}
@@ -0,0 +1,248 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <algorithm>
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/uring.hpp>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+using namespace rtpmidid;
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags, void *arg,
+                              size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg,
+                 argsz);
+}
+
+static unsigned load_acquire(unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+uring_t::uring_t(unsigned entries_) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  fd = sys_io_uring_setup(entries_, &params);
+  if (fd < 0) {
+    throw exception("io_uring not available: {}", strerror(errno));
+  }
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    ::close(fd);
+    fd = -1;
+    throw exception("io_uring too old, needs Linux 5.11");
+  }
+  entries = params.sq_entries;
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq_ring = single_mmap ? sq_ring
+                        : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd,
+                               IORING_OFF_CQ_RING);
+  auto sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes_ptr == MAP_FAILED) {
+    auto err = errno;
+    if (sq_ring != MAP_FAILED)
+      munmap(sq_ring, sq_ring_size);
+    if (!single_mmap && cq_ring != MAP_FAILED)
+      munmap(cq_ring, cq_ring_size);
+    if (sqes_ptr != MAP_FAILED)
+      munmap(sqes_ptr, sqes_size);
+    ::close(fd);
+    fd = -1;
+    throw exception("Can not map io_uring rings: {}", strerror(err));
+  }
+  if (single_mmap)
+    cq_ring_size = 0; // Unmapped with the sq ring
+  sqes = (struct io_uring_sqe *)sqes_ptr;
+
+  auto sq = (uint8_t *)sq_ring;
+  sq_head = (unsigned *)(sq + params.sq_off.head);
+  sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + params.sq_off.array);
+  sqe_tail = *sq_tail;
+
+  auto cq = (uint8_t *)cq_ring;
+  cq_head = (unsigned *)(cq + params.cq_off.head);
+  cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+uring_t::~uring_t() {
+  close();
+  if (sqes)
+    munmap(sqes, sqes_size);
+  if (cq_ring_size)
+    munmap(cq_ring, cq_ring_size);
+  if (sq_ring)
+    munmap(sq_ring, sq_ring_size);
+}
+
+void uring_t::close() {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+struct io_uring_sqe *uring_t::get_sqe() {
+  if (sqe_tail - load_acquire(sq_head) >= entries) {
+    // Full. Give them to the kernel to make room.
+    submit(0);
+    if (sqe_tail - load_acquire(sq_head) >= entries)
+      throw exception("io_uring submission queue full");
+  }
+  auto index = sqe_tail & *sq_mask;
+  auto sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sqe_tail++;
+  return sqe;
+}
+
+/// Makes the queued requests visible to the kernel. Returns how many.
+unsigned uring_t::flush() {
+  auto tail = *sq_tail;
+  if (tail == sqe_tail)
+    return 0;
+  store_release(sq_tail, sqe_tail);
+  return sqe_tail - tail;
+}
+
+void uring_t::poll_add(int pollfd, uint32_t events, uint64_t user_data) {
+  auto sqe = get_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = pollfd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  // The kernel reads it as two halfwords, swapped
+  events = (events << 16) | (events >> 16);
+#endif
+  sqe->poll32_events = events;
+  sqe->user_data = user_data;
+}
+
+void uring_t::poll_remove(uint64_t target_user_data, uint64_t user_data) {
+  auto sqe = get_sqe();
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = target_user_data;
+  sqe->user_data = user_data;
+}
+
+void uring_t::submit(int wait_ms) {
+  if (fd < 0)
+    return;
+  auto to_submit = flush();
+  // Already something to process, no need to wait
+  if (has_completions())
+    wait_ms = 0;
+  if (to_submit == 0 && wait_ms == 0)
+    return;
+
+  unsigned flags = 0;
+  unsigned min_complete = 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (wait_ms != 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    min_complete = 1;
+    if (wait_ms > 0) {
+      ts.tv_sec = wait_ms / 1000;
+      ts.tv_nsec = (wait_ms % 1000) * 1'000'000L;
+      arg.ts = (uint64_t)&ts;
+    }
+  }
+
+  syscalls++;
+  auto ret =
+      sys_io_uring_enter(fd, to_submit, min_complete, flags,
+                         (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                         (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+  // ETIME is the timeout, EINTR a signal. Both fine.
+  if (ret < 0 && errno != ETIME && errno != EINTR) {
+    throw exception("io_uring_enter failed: {}", strerror(errno));
+  }
+}
+
+bool uring_t::has_completions() {
+  return *cq_head != load_acquire(cq_tail);
+}
+
+bool uring_t::next_completion(uint64_t *user_data, int32_t *res) {
+  auto head = *cq_head;
+  if (head == load_acquire(cq_tail))
+    return false;
+  auto cqe = &cqes[head & *cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  store_release(cq_head, head + 1);
+  return true;
+}
+
+#else // No io_uring at build time
+
+uring_t::uring_t(unsigned entries_) {
+  throw exception("io_uring not available at this build");
+}
+uring_t::~uring_t() {}
+void uring_t::close() {}
+void uring_t::poll_add(int, uint32_t, uint64_t) {}
+void uring_t::poll_remove(uint64_t, uint64_t) {}
+void uring_t::submit(int) {}
+bool uring_t::has_completions() { return false; }
+bool uring_t::next_completion(uint64_t *, int32_t *) { return false; }
+
+#endif
@@ -20,9 +20,10 @@
 #include <random>
 
 namespace rtpmidid {
-std::random_device random_device;
-std::mt19937 generator_mt19937(random_device());
-std::uniform_int_distribution<uint32_t> distrib32;
+// Per thread, as peers may be created at the threads of other pollers
+static thread_local std::random_device random_device;
+static thread_local std::mt19937 generator_mt19937(random_device());
+static thread_local std::uniform_int_distribution<uint32_t> distrib32;
 
 int32_t rand_u32(void) { return distrib32(generator_mt19937); }
 } // namespace rtpmidid
\ No newline at end of file
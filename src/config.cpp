@@ -15,6 +15,8 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include <algorithm>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "./config.hpp"
@@ -49,10 +51,35 @@ const char *CMDLINE_HELP =
     "guessed but may be attached to another ip.\n"
     "  --port <port>       Opens local port as server. Default 5004. Can set "
     "several.\n"
+    "  --busy-poll <us>    Low latency mode. Spin up to this time waiting for "
+    "packets before sleeping. Uses more CPU\n"
+    "  --io-uring          Use io_uring instead of epoll to wait for events\n"
     "  --connect <address> Connects the given address. This is default, no "
     "need for --connect\n"
     "  --control <path>    Creates a control socket. Check CONTROL.md. Default "
     "`/var/run/rtpmidid/control.sock`\n"
+    "  --multicast <address:port> Exported ALSA ports send the MIDI data once "
+    "to this multicast group, for the rtpmidid peers that can join it\n"
+    "  --redundancy <copies>[:<gap_us>] Send each MIDI packet several times, "
+    "for lossy networks as WiFi. Only to rtpmidid peers, that drop the "
+    "copies\n"
+    "  --fec <packets>     Send a parity packet each this many MIDI packets, "
+    "to rebuild a lost one. Only to rtpmidid peers. Max 16\n"
+    "  --mtu <bytes>       Max size of the MIDI packets. Longer MIDI data and "
+    "SysEx are split in several packets. Default 1400\n"
+    "  --export-port <port> All exported ALSA ports share this UDP port pair, "
+    "each one announced with its own name\n"
+    "  --local <path>      Co-located programs connect here and exchange MIDI "
+    "with the rtpmidi peer of the same name through shared memory\n"
+    "  --peer-sockets      Servers open a connected UDP socket per peer, "
+    "sharing the server port\n"
+    "  --rcvbuf <bytes>    Socket receive buffer size. Grows automatically "
+    "if the kernel drops packets\n"
+    "  --sndbuf <bytes>    Socket send buffer size\n"
+    "  --filter <rtp|ssrc> Kernel filter for other traffic at the sockets. "
+    "ssrc also drops RTP from unknown peers at the servers\n"
+    "  --txtime <us>       MIDI packets leave this time after the event, "
+    "at exact instants. Needs the fq qdisc\n"
     "  address for connect:\n"
     "  hostname            Connects to hostname:5004 port using rtpmidi\n"
     "  hostname:port       Connects to a hostname on a given port\n"
@@ -65,8 +92,19 @@ typedef enum {
   ARG_NAME,
   ARG_HOST,
   ARG_PORT,
+  ARG_BUSY_POLL,
   ARG_CONNECT,
   ARG_CONTROL,
+  ARG_MULTICAST,
+  ARG_REDUNDANCY,
+  ARG_FEC,
+  ARG_MTU,
+  ARG_EXPORT_PORT,
+  ARG_LOCAL,
+  ARG_RCVBUF,
+  ARG_SNDBUF,
+  ARG_TXTIME,
+  ARG_FILTER,
 } optnames_e;
 
 config_t rtpmidid::parse_cmd_args(int argc, const char **argv) {
@@ -97,10 +135,36 @@ config_t rtpmidid::parse_cmd_args(int argc, const char **argv) {
         prevopt = ARG_HOST;
       } else if (argname == "--port") {
         prevopt = ARG_PORT;
+      } else if (argname == "--busy-poll") {
+        prevopt = ARG_BUSY_POLL;
+      } else if (argname == "--io-uring") {
+        opts.io_uring = true;
       } else if (argname == "--connect") {
         prevopt = ARG_CONNECT;
       } else if (argname == "--control") {
         prevopt = ARG_CONTROL;
+      } else if (argname == "--multicast") {
+        prevopt = ARG_MULTICAST;
+      } else if (argname == "--redundancy") {
+        prevopt = ARG_REDUNDANCY;
+      } else if (argname == "--fec") {
+        prevopt = ARG_FEC;
+      } else if (argname == "--mtu") {
+        prevopt = ARG_MTU;
+      } else if (argname == "--export-port") {
+        prevopt = ARG_EXPORT_PORT;
+      } else if (argname == "--local") {
+        prevopt = ARG_LOCAL;
+      } else if (argname == "--peer-sockets") {
+        opts.peer_sockets = true;
+      } else if (argname == "--rcvbuf") {
+        prevopt = ARG_RCVBUF;
+      } else if (argname == "--sndbuf") {
+        prevopt = ARG_SNDBUF;
+      } else if (argname == "--txtime") {
+        prevopt = ARG_TXTIME;
+      } else if (argname == "--filter") {
+        prevopt = ARG_FILTER;
       } else if (startswith(argname, "--")) {
         ERROR("Unknown option. Check options with --help.");
       } else {
@@ -125,9 +189,56 @@ config_t rtpmidid::parse_cmd_args(int argc, const char **argv) {
       case ARG_PORT:
         opts.ports.push_back(argv[i]);
         break;
+      case ARG_BUSY_POLL:
+        opts.busy_poll_us = atoi(argv[i]);
+        INFO("Busy poll for {} us", opts.busy_poll_us);
+        break;
       case ARG_CONTROL:
         opts.control = argv[i];
         break;
+      case ARG_MULTICAST:
+        opts.multicast = argv[i];
+        INFO("Multicast MIDI data of exported ports to {}", opts.multicast);
+        break;
+      case ARG_REDUNDANCY: {
+        std::string arg = argv[i];
+        auto colon = arg.find(':');
+        opts.redundancy = std::max(1, atoi(arg.substr(0, colon).c_str()));
+        if (colon != std::string::npos)
+          opts.redundancy_gap_us = atoi(arg.substr(colon + 1).c_str());
+        INFO("Send MIDI packets {} times, {} us apart", opts.redundancy,
+             opts.redundancy_gap_us);
+      } break;
+      case ARG_FEC:
+        opts.fec = atoi(argv[i]);
+        INFO("FEC parity packet each {} MIDI packets", opts.fec);
+        break;
+      case ARG_MTU:
+        opts.mtu = atoi(argv[i]);
+        break;
+      case ARG_EXPORT_PORT:
+        opts.export_port = argv[i];
+        break;
+      case ARG_LOCAL:
+        opts.local = argv[i];
+        break;
+      case ARG_RCVBUF:
+        opts.rcvbuf = atoi(argv[i]);
+        break;
+      case ARG_SNDBUF:
+        opts.sndbuf = atoi(argv[i]);
+        break;
+      case ARG_FILTER:
+        opts.filter = argv[i];
+        if (opts.filter != "rtp" && opts.filter != "ssrc") {
+          ERROR("Unknown filter {}. Use rtp or ssrc.", opts.filter);
+          opts.filter = "";
+        }
+        break;
+      case ARG_TXTIME:
+        opts.txtime_us = atoi(argv[i]);
+        INFO("MIDI packets leave {} us after the event", opts.txtime_us);
+        break;
       }
       prevopt = ARG_NONE;
     }
@@ -35,8 +35,35 @@ struct config_t {
   std::vector<std::string> connect_to;
   // Create clients at this ports to start with. Later will see.
   std::vector<std::string> ports;
+  // Busy poll time in us, for low latency. 0 disabled.
+  int busy_poll_us = 0;
+  // Poller backend
+  bool io_uring = false;
   std::string host;
   std::string control;
+  // Connected UDP socket per peer at servers
+  bool peer_sockets = false;
+  // UDP socket buffer sizes. 0 is system default.
+  int rcvbuf = 0;
+  int sndbuf = 0;
+  // Socket filter: "rtp" for only RTP MIDI, "ssrc" also only from the
+  // connected peers. Empty disabled.
+  std::string filter;
+  // SO_TXTIME offset of the MIDI packets, in us. 0 disabled.
+  int txtime_us = 0;
+  // address:port of the multicast group for exported ports. Empty disabled.
+  std::string multicast;
+  // Send each MIDI packet this many times, redundancy_gap_us apart
+  int redundancy = 1;
+  int redundancy_gap_us = 0;
+  // Max UDP payload of the MIDI packets
+  int mtu = 1400;
+  // Send a FEC parity packet each this many MIDI packets. 0 disabled.
+  int fec = 0;
+  // All exported ALSA ports share a server at this port. Empty, one each.
+  std::string export_port;
+  // UNIX socket for the shared memory local sessions. Empty disabled.
+  std::string local;
 };
 config_t parse_cmd_args(int argc, const char **argv);
 } // namespace rtpmidid
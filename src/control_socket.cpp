@@ -148,6 +148,25 @@ void rtpmidid::control_socket_t::data_ready(int fd) {
 
 namespace rtpmidid {
 namespace commands {
+static json send_queue_status(const rtpmidid::send_queue_t &queue) {
+  return {{"depth", queue.size()}, {"drops", queue.drops}};
+}
+
+static json internal_latency_status(const rtpmidid::rtppeer &peer) {
+  auto &stats = peer.internal_latency;
+  return {{"packets", stats.count},
+          {"avg_ms", stats.average_ms()},
+          {"max_ms", stats.max_us / 1000.0}};
+}
+
+static json sequence_status(const rtpmidid::rtppeer &peer) {
+  return {{"lost", peer.lost_packets},
+          {"reordered", peer.reordered_packets},
+          {"duplicates", peer.duplicates},
+          {"fec_recovered", peer.fec_recovered},
+          {"reorder_window_us", peer.reorder_window.count()}};
+}
+
 // Commands
 static json status(rtpmidid::rtpmidid_t &rtpmidid, time_t start_time) {
   auto js =
@@ -170,6 +189,13 @@ static json status(rtpmidid::rtpmidid_t &rtpmidid, time_t start_time) {
       cl["sequence_number"] = peer->peer.seq_nr;
       cl["sequence_number_ack"] = peer->peer.seq_nr_ack;
       cl["sequence_remote"] = peer->peer.remote_seq_nr;
+      cl["send_queue"] = send_queue_status(peer->send_queue);
+      cl["internal_latency"] = internal_latency_status(peer->peer);
+      cl["sequence"] = sequence_status(peer->peer);
+      cl["kernel_drops"] = peer->control_drops.drops + peer->midi_drops.drops;
+      cl["filtered"] =
+          peer->control_drops.filtered + peer->midi_drops.filtered;
+      cl["truncated"] = peer->recv_batch.truncated;
     }
     clients.push_back(cl);
   }
@@ -185,14 +211,38 @@ static json status(rtpmidid::rtpmidid_t &rtpmidid, time_t start_time) {
   }
   js["connections"] = connections;
 
+  std::vector<std::shared_ptr<rtpmidid::rtpserver>> all_servers =
+      rtpmidid.servers;
+  if (rtpmidid.export_server)
+    all_servers.push_back(rtpmidid.export_server);
   std::vector<json> servers;
-  for (auto server : rtpmidid.servers) {
+  for (auto server : all_servers) {
+    size_t queued = 0;
+    uint64_t drops = 0;
+    std::vector<json> peers;
+    for (auto &conn : server->ssrc_to_conn) {
+      queued += conn.second->send_queue.size();
+      drops += conn.second->send_queue.drops;
+      auto peer = conn.second->peer;
+      json pl = {{"name", peer->remote_name}};
+      pl["send_queue"] = send_queue_status(conn.second->send_queue);
+      pl["internal_latency"] = internal_latency_status(*peer);
+      pl["sequence"] = sequence_status(*peer);
+      peers.push_back(pl);
+    }
     json data = {
         {"name", server->name},
         {"port", server->midi_port},
         {"connect_listeners", server->connected_event.count()},
         {"midi_listeners", server->midi_event.count()},
+        {"send_queue", {{"depth", queued}, {"drops", drops}}},
+        {"kernel_drops", server->kernel_drops()},
+        {"filtered", server->filtered_packets()},
+        {"truncated", server->recv_batch.truncated},
+        {"peers", peers},
     };
+    if (!server->sessions.empty())
+      data["sessions"] = server->sessions;
     servers.push_back(data);
   }
   js["servers"] = servers;
@@ -216,6 +266,63 @@ static json connect(rtpmidid::rtpmidid_t &rtpmidid, const std::string &name,
     return {{"detail", "Could not connect. Check logs."}};
   }
 }
+
+// Sets the reorder window of the sessions with that name, or of all the
+// sessions and the new ones.
+static json reorder(rtpmidid::rtpmidid_t &rtpmidid, const std::string &name,
+                    const std::string &us) {
+  auto window = std::chrono::microseconds(std::stoi(us));
+  if (window.count() < 0)
+    return nullptr;
+
+  bool all = name.empty();
+  if (all) {
+    rtpmidid.reorder_window = window;
+    for (auto &server : rtpmidid.servers)
+      server->reorder_window = window;
+    for (auto &conn : rtpmidid.alsa_to_server)
+      conn.second->reorder_window = window;
+    if (rtpmidid.export_server)
+      rtpmidid.export_server->reorder_window = window;
+  }
+  std::vector<std::string> sessions;
+  for (auto &port_client : rtpmidid.known_clients) {
+    auto &client = port_client.second;
+    if (client.peer && (all || client.name == name)) {
+      client.peer->peer.reorder_window = window;
+      sessions.push_back(client.name);
+    }
+  }
+  for (auto &port_conn : rtpmidid.known_servers_connections) {
+    auto &conn = port_conn.second;
+    if (conn.peer && (all || conn.name == name)) {
+      conn.peer->reorder_window = window;
+      sessions.push_back(conn.name);
+    }
+  }
+  // The peers already connected to the exported ports. At the shared port,
+  // by the session they chose.
+  std::vector<std::shared_ptr<rtpmidid::rtpserver>> export_servers;
+  for (auto &conn : rtpmidid.alsa_to_server)
+    export_servers.push_back(conn.second);
+  if (rtpmidid.export_server)
+    export_servers.push_back(rtpmidid.export_server);
+  for (auto &server : export_servers) {
+    if (!all && server->name == name)
+      server->reorder_window = window;
+    for (auto &sconn : server->ssrc_to_conn) {
+      auto peer = sconn.second->peer;
+      auto session = peer->session.empty() ? server->name : peer->session;
+      if (all || session == name) {
+        peer->reorder_window = window;
+        sessions.push_back(session);
+      }
+    }
+  }
+  if (!all && sessions.empty())
+    return nullptr;
+  return {{"reorder_window_us", window.count()}, {"sessions", sessions}};
+}
 } // namespace commands
 } // namespace rtpmidid
 
@@ -272,12 +379,30 @@ rtpmidid::control_socket_t::parse_command(const std::string &command) {
       error = {{"detail", "Invalid params"}, {"code", 3}};
     }
   }
+  if (msg.method == "reorder") {
+    try {
+      switch (msg.params.size()) {
+      case 1:
+        ret = rtpmidid::commands::reorder(rtpmidid, "", msg.params[0]);
+        break;
+      case 2:
+        ret = rtpmidid::commands::reorder(rtpmidid, msg.params[0],
+                                          msg.params[1]);
+        break;
+      }
+    } catch (const std::exception &e) {
+      ret = nullptr;
+    }
+    if (ret.is_null())
+      error = {{"detail", "Invalid params"}, {"code", 3}};
+  }
   if (msg.method == "update-mdns") {
     rtpmidid.mdns_rtpmidi.setup_mdns_browser();
     ret = {{"detail", "mDNS update requested"}};
   }
   if (msg.method == "help") {
-    ret = json{{"commands", {"help", "exit", "connect", "status"}}};
+    ret = json{
+        {"commands", {"help", "exit", "connect", "status", "reorder"}}};
   }
 
   json retdata = {{"id", msg.id}};
@@ -57,6 +57,16 @@ int main(int argc, char **argv) {
 
   auto options = rtpmidid::parse_cmd_args(argc - 1, (const char **)argv + 1);
 
+  // Before anything is added to the poller
+  if (options.io_uring) {
+    try {
+      rtpmidid::poller.set_backend(rtpmidid::poller_t::IO_URING);
+      INFO("Using io_uring poller");
+    } catch (const std::exception &e) {
+      WARNING("Can not use io_uring, using epoll: {}", e.what());
+    }
+  }
+
   try {
     auto rtpmidid = rtpmidid::rtpmidid_t(options);
     auto control = rtpmidid::control_socket_t(rtpmidid, options.control);
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <alsa/seq_event.h>
+#include <algorithm>
 #include <stdlib.h>
 #include <string>
 
@@ -25,16 +26,50 @@
 #include "./stringpp.hpp"
 #include <rtpmidid/iobytes.hpp>
 #include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
 #include <rtpmidid/rtpclient.hpp>
 #include <rtpmidid/rtpserver.hpp>
+#include <rtpmidid/sockopts.hpp>
 
 using namespace rtpmidid;
 using namespace std::chrono_literals;
 
 rtpmidid_t::rtpmidid_t(const config_t &config)
-    : name(config.name), seq(fmt::format("rtpmidi {}", name)) {
+    : name(config.name), seq(fmt::format("rtpmidi {}", name)),
+      peer_sockets(config.peer_sockets) {
+  socket_options.rcvbuf = config.rcvbuf;
+  socket_options.sndbuf = config.sndbuf;
+  socket_options.max_rcvbuf =
+      std::max(socket_options.max_rcvbuf, config.rcvbuf);
+  socket_options.busy_poll_us = config.busy_poll_us;
+  socket_options.txtime_offset_us = config.txtime_us;
+  socket_options.filter = !config.filter.empty();
+  socket_options.filter_ssrc = config.filter == "ssrc";
+  poller.set_busy_poll(std::chrono::microseconds(config.busy_poll_us));
+  redundancy.copies = config.redundancy;
+  redundancy.gap = std::chrono::microseconds(config.redundancy_gap_us);
+  fec_group = config.fec;
+  mtu = std::max(config.mtu, int(rtppeer::MIN_MTU));
+  export_port = config.export_port;
+
+  if (!config.multicast.empty()) {
+    // address:port, or [ipv6]:port
+    auto colon = config.multicast.rfind(':');
+    if (colon == std::string::npos) {
+      throw rtpmidid::exception("Invalid multicast group {}. Use address:port",
+                                config.multicast);
+    }
+    auto address = config.multicast.substr(0, colon);
+    if (address.size() > 2 && address.front() == '[' && address.back() == ']')
+      address = address.substr(1, address.size() - 2);
+    multicast_group =
+        multicast_group_t::parse(address, config.multicast.substr(colon + 1));
+  }
+
   setup_mdns();
   setup_alsa_seq();
+  if (!config.local.empty())
+    setup_local_sessions(config.local);
 
   for (auto &port : config.ports) {
     auto server = add_rtpmidid_import_server(config.name, port);
@@ -101,7 +136,12 @@ void rtpmidid_t::unannounce_rtpmidid_server(const std::string &name,
 std::shared_ptr<rtpserver>
 rtpmidid_t::add_rtpmidid_import_server(const std::string &name,
                                        const std::string &port) {
-  auto rtpserver = std::make_shared<::rtpmidid::rtpserver>(name, port);
+  auto rtpserver = std::make_shared<::rtpmidid::rtpserver>(name, port,
+                                                          peer_sockets);
+  rtpserver->redundancy = redundancy;
+  rtpserver->fec_group = fec_group;
+  rtpserver->reorder_window = reorder_window;
+  rtpserver->mtu = mtu;
 
   announce_rtpmidid_server(name, rtpserver->control_port);
 
@@ -136,6 +176,7 @@ rtpmidid_t::add_rtpmidid_import_server(const std::string &name,
         peer->disconnect_event.connect([this, aseq_port](auto reason) {
           DEBUG("Remove aseq port {}", aseq_port);
           seq.remove_port(aseq_port);
+          local_sessions.erase(aseq_port);
           known_servers_connections.erase(aseq_port);
         });
 
@@ -154,6 +195,8 @@ rtpmidid_t::add_rtpmidid_import_server(const std::string &name,
 std::shared_ptr<rtpserver>
 rtpmidid_t::add_rtpmidid_export_server(const std::string &name,
                                        uint8_t alsaport, aseq::port_t &from) {
+  if (!export_port.empty())
+    return add_export_session(name, alsaport, from);
 
   for (auto &alsa_server : alsa_to_server) {
     auto server = alsa_server.second;
@@ -165,7 +208,18 @@ rtpmidid_t::add_rtpmidid_export_server(const std::string &name,
     }
   }
 
-  auto server = std::make_shared<rtpserver>(name, "");
+  auto server = std::make_shared<rtpserver>(name, "", peer_sockets);
+  server->redundancy = redundancy;
+  server->fec_group = fec_group;
+  server->reorder_window = reorder_window;
+  server->mtu = mtu;
+  if (multicast_group) {
+    try {
+      server->enable_multicast(*multicast_group);
+    } catch (const std::exception &e) {
+      ERROR("Can not use multicast for {}, all unicast: {}", name, e.what());
+    }
+  }
 
   announce_rtpmidid_server(name, server->control_port);
 
@@ -192,6 +246,64 @@ rtpmidid_t::add_rtpmidid_export_server(const std::string &name,
   return server;
 }
 
+/**
+ * Adds the exported ALSA port as a session of the shared export server.
+ *
+ * The server is created with the first one. The MIDI data is sent to the
+ * session of the source port, so to the peers that chose it. Peers that can
+ * not choose, as the ones that are not rtpmidid, are bound to the first
+ * session, so they do not get the data of the others.
+ */
+std::shared_ptr<rtpserver>
+rtpmidid_t::add_export_session(const std::string &name, uint8_t alsaport,
+                               aseq::port_t &from) {
+  if (!export_server) {
+    export_server =
+        std::make_shared<rtpserver>(this->name, export_port, peer_sockets);
+    export_server->redundancy = redundancy;
+    export_server->fec_group = fec_group;
+    export_server->reorder_window = reorder_window;
+    export_server->mtu = mtu;
+    if (multicast_group)
+      WARNING("Multicast is not used at the shared export port");
+
+    seq.midi_event[alsaport].connect([this](snd_seq_event_t *ev) {
+      io_bytes_writer_static<4096> buffer;
+      alsamidi_to_midiprotocol(ev, buffer);
+      auto session =
+          export_sessions.find(ev->source.client << 8 | ev->source.port);
+      if (session == export_sessions.end())
+        export_server->send_midi_to_all_peers(buffer);
+      else
+        export_server->send_midi_to_session(session->second, buffer);
+    });
+    seq.unsubscribe_event[alsaport].connect([this](aseq::port_t from) {
+      auto session = export_sessions.find(from.client << 8 | from.port);
+      if (session == export_sessions.end())
+        return;
+      auto name = session->second;
+      export_sessions.erase(session);
+      for (auto &other : export_sessions) {
+        if (other.second == name)
+          return; // Still exported from another ALSA port
+      }
+      unannounce_rtpmidid_server(name, export_server->control_port);
+      export_server->remove_session(name);
+    });
+    export_server->midi_event.connect(
+        [this, alsaport](io_bytes_reader buffer) {
+          this->recv_rtpmidi_event(alsaport, buffer);
+        });
+  }
+
+  if (!export_server->sessions.count(name)) {
+    export_server->add_session(name);
+    announce_rtpmidid_server(name, export_server->control_port);
+  }
+  export_sessions[from.client << 8 | from.port] = name;
+  return export_server;
+}
+
 void rtpmidid_t::setup_alsa_seq() {
   // Export only one, but all data that is connected to it.
   // add_export_port();
@@ -309,6 +421,13 @@ void rtpmidid_t::connect_client(const std::string &name, int aseq_port) {
   } else {
     auto &address = peer_info->addresses[peer_info->addr_idx];
     peer_info->peer = std::make_shared<rtpclient>(name);
+    peer_info->peer->peer.redundancy = redundancy;
+    peer_info->peer->peer.fec_group = fec_group;
+    peer_info->peer->peer.reorder_window = reorder_window;
+    peer_info->peer->peer.mtu = mtu;
+    // In case it is a shared port, the session we want
+    peer_info->peer->peer.local_extension[rtppeer::EXT_SESSION] =
+        peer_info->name;
     peer_info->peer->peer.midi_event.connect(
         [this, aseq_port](io_bytes_reader pb) {
           this->recv_rtpmidi_event(aseq_port, pb);
@@ -332,7 +451,8 @@ void rtpmidid_t::disconnect_client(int aseq_port, int reasoni) {
                                              "connection refused",
                                              "disconnect",
                                              "connection timeout",
-                                             "CK timeout"};
+                                             "CK timeout",
+                                             "can't allocate local ports"};
 
   auto peer_info = &known_clients[aseq_port];
   auto reason = static_cast<rtppeer::disconnect_reason_e>(reasoni);
@@ -342,6 +462,11 @@ void rtpmidid_t::disconnect_client(int aseq_port, int reasoni) {
   // If cant connec t(network problem) or rejected, try again in next
   // address.
   switch (reason) {
+  case rtppeer::disconnect_reason_e::PORT_ALLOCATION_FAILED:
+    WARNING("Could not allocate local ports for {}. Out of ports or "
+            "sockets? Will retry.",
+            peer_info->name);
+    [[fallthrough]];
   case rtppeer::disconnect_reason_e::CANT_CONNECT:
   case rtppeer::disconnect_reason_e::CONNECTION_REJECTED:
     if (peer_info->connect_attempts >= (3 * peer_info->addresses.size())) {
@@ -403,6 +528,10 @@ void rtpmidid_t::disconnect_client(int aseq_port, int reasoni) {
 }
 
 void rtpmidid_t::recv_rtpmidi_event(int port, io_bytes_reader &midi_data) {
+  auto sessions = local_sessions.equal_range(port);
+  for (auto I = sessions.first; I != sessions.second; ++I)
+    I->second->send_midi(midi_data);
+
   uint8_t current_command = 0;
   snd_seq_event_t ev;
 
@@ -649,8 +778,81 @@ void rtpmidid_t::remove_client(uint8_t port) {
     seq.subscribe_event[port].disconnect_all();
     seq.unsubscribe_event[port].disconnect_all();
     seq.midi_event[port].disconnect_all();
+    local_sessions.erase(port);
 
     // Last as may be used in the shutdown of the client.
     known_clients.erase(port);
   });
 }
+
+void rtpmidid_t::setup_local_sessions(const std::string &path) {
+  local_server = std::make_unique<local_server_t>(path);
+  local_server->session_event.connect(
+      [this](const std::shared_ptr<local_session_t> &session) {
+        add_local_session(session);
+      });
+}
+
+void rtpmidid_t::add_local_session(
+    const std::shared_ptr<local_session_t> &session) {
+  std::optional<uint8_t> aseq_port;
+  bool is_client = false;
+  for (auto &known : known_clients) {
+    if (known.second.name == session->name) {
+      aseq_port = known.first;
+      is_client = true;
+    }
+  }
+  for (auto &known : known_servers_connections) {
+    if (!aseq_port && known.second.name == session->name)
+      aseq_port = known.first;
+  }
+  if (!aseq_port) {
+    WARNING("No rtpmidi peer named {} for the local session. Closing it.",
+            session->name);
+    return;
+  }
+  auto port = *aseq_port;
+  // Same as an ALSA subscription, it keeps the connection while in use
+  if (is_client)
+    connect_client(fmt::format("{}/{}", name, session->name), port);
+
+  session->midi_event.connect([this, port](const io_bytes_reader &data) {
+    recv_local_event(port, data);
+  });
+  std::weak_ptr<local_session_t> wsession = session;
+  session->disconnect_event.connect([this, port, wsession, is_client] {
+    auto sessions = local_sessions.equal_range(port);
+    for (auto I = sessions.first; I != sessions.second; ++I) {
+      if (I->second == wsession.lock()) {
+        local_sessions.erase(I);
+        break;
+      }
+    }
+    auto client = known_clients.find(port);
+    if (!is_client || client == known_clients.end())
+      return;
+    auto peer_info = &client->second;
+    if (peer_info->use_count > 0)
+      peer_info->use_count--;
+    DEBUG("Local session closed at peer {} (users {})", peer_info->name,
+          peer_info->use_count);
+    if (peer_info->use_count == 0)
+      peer_info->peer = nullptr;
+  });
+
+  INFO("Local session {} bridged to aseq port {}", session->name, port);
+  local_sessions.emplace(port, session);
+}
+
+void rtpmidid_t::recv_local_event(int port, const io_bytes_reader &midi_data) {
+  auto client = known_clients.find(port);
+  if (client != known_clients.end()) {
+    if (client->second.peer)
+      client->second.peer->peer.send_midi(midi_data);
+    return;
+  }
+  auto conn = known_servers_connections.find(port);
+  if (conn != known_servers_connections.end() && conn->second.peer)
+    conn->second.peer->send_midi(midi_data);
+}
@@ -21,8 +21,11 @@
 #include "./aseq.hpp"
 #include <memory>
 #include <optional>
+#include <rtpmidid/localsession.hpp>
 #include <rtpmidid/mdns_rtpmidi.hpp>
+#include <rtpmidid/multicast.hpp>
 #include <rtpmidid/poller.hpp>
+#include <rtpmidid/rtppeer.hpp>
 #include <set>
 #include <string>
 #include <optional>
@@ -66,7 +69,26 @@ public:
   std::map<uint8_t, server_conn_info> known_servers_connections;
   std::vector<std::shared_ptr<::rtpmidid::rtpserver>> servers;
   std::map<aseq::port_t, std::shared_ptr<::rtpmidid::rtpserver>> alsa_to_server;
+  // With export_port, all the exported ALSA ports are sessions of this
+  // server. Session names by ALSA client << 8 | port.
+  std::string export_port;
+  std::shared_ptr<::rtpmidid::rtpserver> export_server;
+  std::map<uint16_t, std::string> export_sessions;
   std::set<std::string> known_mdns_peers;
+  // Servers use a connected socket per peer
+  bool peer_sockets;
+  // Exported ports send the MIDI data here, if set
+  std::optional<multicast_group_t> multicast_group;
+  // For all the peers
+  rtppeer::redundancy_t redundancy;
+  int fec_group;
+  size_t mtu;
+  // Default for new peers. Set from the control socket.
+  std::chrono::microseconds reorder_window{0};
+  // Shared memory sessions with local programs, by the aseq port of the
+  // rtpmidi peer they are bridged to
+  std::unique_ptr<local_server_t> local_server;
+  std::multimap<uint8_t, std::shared_ptr<local_session_t>> local_sessions;
 
   rtpmidid_t(const config_t &config);
 
@@ -101,7 +123,14 @@ public:
   std::shared_ptr<rtpserver> add_rtpmidid_export_server(const std::string &name,
                                                         uint8_t alsaport,
                                                         aseq::port_t &from);
+  std::shared_ptr<rtpserver> add_export_session(const std::string &name,
+                                                uint8_t alsaport,
+                                                aseq::port_t &from);
 
   void remove_client(uint8_t alsa_port);
+
+  void setup_local_sessions(const std::string &path);
+  void add_local_session(const std::shared_ptr<local_session_t> &session);
+  void recv_local_event(int port, const io_bytes_reader &midi_data);
 };
 } // namespace rtpmidid
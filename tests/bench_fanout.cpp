@@ -0,0 +1,96 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measures the cost per peer of sending the same MIDI data to all the peers
+ * connected to a server, one sendto per peer vs the sendmmsg fan out.
+ */
+
+#include "../tests/test_utils.hpp"
+#include <chrono>
+#include <memory>
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/rtpserver.hpp>
+#include <unistd.h>
+#include <vector>
+
+static const int ITERATIONS = 2000;
+
+static auto connect_msg(int i) {
+  return hex_to_bin(fmt::format("FF FF 'IN'"
+                                "0000 0002"
+                                "{:08X}"
+                                "{:08X}"
+                                "'bench' 00",
+                                0x10000 + i, 0x20000 + i));
+}
+
+template <typename F> static double time_ns(F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; i++)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static void bench(int npeers) {
+  rtpmidid::rtpserver server("bench", "0");
+
+  std::vector<std::unique_ptr<test_client_t>> clients;
+  for (int i = 0; i < npeers; i++) {
+    std::unique_ptr<test_client_t> control, midi;
+    // Random port + 1 may be in use, just try again
+    while (!midi) {
+      control = std::make_unique<test_client_t>(0, server.control_port);
+      try {
+        midi = std::make_unique<test_client_t>(control->local_port + 1,
+                                               server.midi_port);
+      } catch (const rtpmidid::exception &) {
+        ::close(control->sockfd);
+      }
+    }
+    control->send(connect_msg(i));
+    midi->send(connect_msg(i));
+    clients.push_back(std::move(control));
+    clients.push_back(std::move(midi));
+  }
+
+  auto midi = hex_to_bin("90 60 7f");
+
+  auto loop_ns = time_ns([&] {
+    for (auto &peer : server.ssrc_to_peer)
+      peer.second->send_midi(midi);
+  });
+  auto fanout_ns = time_ns([&] { server.send_midi_to_all_peers(midi); });
+
+  auto div = double(ITERATIONS) * npeers;
+  INFO("{:>4} peers: send_midi loop {:>8.1f} ns/peer, fan out {:>8.1f} "
+       "ns/peer",
+       npeers, loop_ns / div, fanout_ns / div);
+
+  for (auto &client : clients)
+    ::close(client->sockfd);
+}
+
+int main(void) {
+  for (auto npeers : {1, 10, 100}) {
+    bench(npeers);
+  }
+  return 0;
+}
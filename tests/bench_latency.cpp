@@ -0,0 +1,101 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measures the time from a UDP packet is sent until the poller calls the
+ * callback, with the normal blocking poller and with busy poll.
+ *
+ * A thread sends a packet each 500us with the send time inside.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/sockopts.hpp>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+static const int SAMPLES = 4000;
+
+static void bench(const char *mode, std::chrono::microseconds busy_poll) {
+  rtpmidid::socket_options.busy_poll_us = busy_poll.count();
+  rtpmidid::poller.set_busy_poll(busy_poll);
+
+  auto receiver = socket(AF_INET, SOCK_DGRAM, 0);
+  rtpmidid::setup_socket(receiver);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_aton("127.0.0.1", &addr.sin_addr);
+  bind(receiver, (struct sockaddr *)&addr, sizeof(addr));
+  socklen_t len = sizeof(addr);
+  getsockname(receiver, (struct sockaddr *)&addr, &len);
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(SAMPLES);
+  rtpmidid::poller.add_fd_in(receiver, [&latencies](int fd) {
+    clock_type::rep sent;
+    ::recv(fd, &sent, sizeof(sent), 0);
+    auto now = clock_type::now().time_since_epoch().count();
+    latencies.push_back((now - sent) / 1000); // steady_clock is in ns
+  });
+
+  auto sender = socket(AF_INET, SOCK_DGRAM, 0);
+  std::atomic<bool> done{false};
+  std::thread sender_thread([&] {
+    for (int i = 0; i < SAMPLES; i++) {
+      std::this_thread::sleep_for(500us);
+      auto now = clock_type::now().time_since_epoch().count();
+      ::sendto(sender, &now, sizeof(now), 0, (struct sockaddr *)&addr,
+               sizeof(addr));
+    }
+    done = true;
+  });
+
+  while (!done || latencies.size() < SAMPLES) {
+    rtpmidid::poller.wait(10ms);
+    if (done && latencies.size() < SAMPLES)
+      break; // Some packet lost
+  }
+  sender_thread.join();
+
+  rtpmidid::poller.remove_fd(receiver);
+  close(receiver);
+  close(sender);
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](int p) {
+    return latencies[latencies.size() * p / 100];
+  };
+  INFO("{:>10}: {} samples, p50 {} us, p99 {} us, max {} us", mode,
+       latencies.size(), percentile(50), percentile(99), latencies.back());
+}
+
+int main(void) {
+  bench("blocking", 0us);
+  bench("busy poll", 1000us);
+  return 0;
+}
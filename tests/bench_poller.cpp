@@ -0,0 +1,157 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares the epoll and io_uring poller backends forwarding MIDI packets.
+ *
+ * A thread sends a packet each 200us with the send time inside. The poller
+ * callback reads it and forwards it to another socket, as rtpmidid does
+ * between peers, and another thread gets it and measures the latency.
+ *
+ * Shows the syscalls done by the poller, and the CPU time of the poller
+ * thread, per forwarded packet.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+static const int SAMPLES = 10000;
+
+static int bound_socket(struct sockaddr_in *addr) {
+  auto fd = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  inet_aton("127.0.0.1", &addr->sin_addr);
+  bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+  socklen_t len = sizeof(*addr);
+  getsockname(fd, (struct sockaddr *)addr, &len);
+  return fd;
+}
+
+static int64_t thread_cpu_us() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1'000'000 +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void bench(const char *mode, rtpmidid::poller_t::backend_e backend) {
+  try {
+    rtpmidid::poller.set_backend(backend);
+  } catch (const std::exception &e) {
+    WARNING("{}: not available. {}", mode, e.what());
+    return;
+  }
+
+  struct sockaddr_in in_addr, out_addr;
+  auto forward_in = bound_socket(&in_addr);
+  auto receiver = bound_socket(&out_addr);
+  auto forward_out = socket(AF_INET, SOCK_DGRAM, 0);
+  connect(forward_out, (struct sockaddr *)&out_addr, sizeof(out_addr));
+
+  int forwarded = 0;
+  rtpmidid::poller.add_fd_in(forward_in, [&](int fd) {
+    uint8_t data[64];
+    auto n = ::recv(fd, data, sizeof(data), MSG_DONTWAIT);
+    if (n > 0) {
+      ::send(forward_out, data, n, MSG_DONTWAIT);
+      forwarded++;
+    }
+  });
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(SAMPLES);
+  std::thread receiver_thread([&] {
+    struct timeval timeout = {1, 0};
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < SAMPLES; i++) {
+      clock_type::rep sent;
+      if (::recv(receiver, &sent, sizeof(sent), 0) != sizeof(sent))
+        break; // Some packet lost
+      auto now = clock_type::now().time_since_epoch().count();
+      latencies.push_back((now - sent) / 1000); // steady_clock is in ns
+    }
+  });
+
+  auto sender = socket(AF_INET, SOCK_DGRAM, 0);
+  std::atomic<bool> done{false};
+  std::thread sender_thread([&] {
+    for (int i = 0; i < SAMPLES; i++) {
+      std::this_thread::sleep_for(200us);
+      auto now = clock_type::now().time_since_epoch().count();
+      ::sendto(sender, &now, sizeof(now), 0, (struct sockaddr *)&in_addr,
+               sizeof(in_addr));
+    }
+    done = true;
+  });
+
+  auto syscalls_start = rtpmidid::poller.syscalls();
+  auto cpu_start = thread_cpu_us();
+  while (!done || forwarded < SAMPLES) {
+    rtpmidid::poller.wait(10ms);
+    if (done && forwarded < SAMPLES) {
+      rtpmidid::poller.wait(100ms);
+      break; // Some packet lost
+    }
+  }
+  auto cpu = thread_cpu_us() - cpu_start;
+  auto syscalls = rtpmidid::poller.syscalls() - syscalls_start;
+  sender_thread.join();
+  receiver_thread.join();
+
+  rtpmidid::poller.remove_fd(forward_in);
+  close(forward_in);
+  close(forward_out);
+  close(receiver);
+  close(sender);
+
+  if (latencies.empty() || forwarded == 0) {
+    ERROR("{}: nothing forwarded", mode);
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](int p) {
+    return latencies[latencies.size() * p / 100];
+  };
+  // Poller syscalls, plus the recv and send at the callback
+  INFO("{:>9}: {} packets, {:.2f} syscalls/packet ({:.2f} poller), "
+       "{:.2f} us CPU/packet, latency p50 {} us, p99 {} us, max {} us",
+       mode, forwarded, double(syscalls + 2 * forwarded) / forwarded,
+       double(syscalls) / forwarded, double(cpu) / forwarded, percentile(50),
+       percentile(99), latencies.back());
+}
+
+int main(void) {
+  bench("epoll", rtpmidid::poller_t::EPOLL);
+  bench("io_uring", rtpmidid::poller_t::IO_URING);
+  bench("epoll", rtpmidid::poller_t::EPOLL);
+  bench("io_uring", rtpmidid::poller_t::IO_URING);
+  return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Timer management cost with many live timers, as with hundreds of
+ * rtpclients re-arming their CK and connect timers.
+ *
+ * Keeps TIMERS timers pending, and measures re-arming them (assign a new
+ * timer to the handle, which removes the old one), removing them, and
+ * calling them when they expire, each one arming the next.
+ */
+
+#include <chrono>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <vector>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+static const int TIMERS = 10000;
+static const int ROUNDS = 10;
+
+static double ns_per(clock_type::duration d, int count) {
+  return double(std::chrono::duration_cast<std::chrono::nanoseconds>(d)
+                    .count()) /
+         count;
+}
+
+// Deadlines spread over 1 to 10 seconds, so none expires while measuring
+static std::chrono::milliseconds spread(int i) {
+  return std::chrono::milliseconds(1000 + (i * 7919) % 9000);
+}
+
+static void bench_rearm() {
+  std::vector<rtpmidid::poller_t::timer_t> timers(TIMERS);
+  for (int i = 0; i < TIMERS; i++) {
+    timers[i] = rtpmidid::poller.add_timer_event(spread(i), [] {});
+  }
+
+  auto start = clock_type::now();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < TIMERS; i++) {
+      timers[i] = rtpmidid::poller.add_timer_event(spread(i + round), [] {});
+    }
+  }
+  auto rearm = clock_type::now() - start;
+
+  start = clock_type::now();
+  for (auto &timer : timers) {
+    timer.disable();
+  }
+  auto remove = clock_type::now() - start;
+
+  INFO("{} live timers: re-arm {:.0f} ns, remove {:.0f} ns", TIMERS,
+       ns_per(rearm, TIMERS * ROUNDS), ns_per(remove, TIMERS));
+}
+
+static void bench_expire() {
+  std::vector<rtpmidid::poller_t::timer_t> timers(TIMERS);
+  int called = 0;
+  // Each one arms again, as the CK timers
+  std::function<void(int)> arm = [&](int i) {
+    timers[i] = rtpmidid::poller.add_timer_event(
+        std::chrono::milliseconds(1 + i % 50), [&, i] {
+          called++;
+          arm(i);
+        });
+  };
+  for (int i = 0; i < TIMERS; i++) {
+    arm(i);
+  }
+
+  auto until = clock_type::now() + 1s;
+  auto start = clock_type::now();
+  while (clock_type::now() < until) {
+    rtpmidid::poller.wait(100ms);
+  }
+  auto elapsed = clock_type::now() - start;
+  rtpmidid::poller.clear_timers();
+
+  INFO("{} live timers: {} called in {} ms, {:.0f} ns each (with the re-arm)",
+       TIMERS, called,
+       std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(),
+       ns_per(elapsed, called));
+}
+
+int main(void) {
+  bench_rearm();
+  bench_expire();
+  bench_rearm();
+  bench_expire();
+  return 0;
+}
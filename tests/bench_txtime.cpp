@@ -0,0 +1,150 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measures the spacing of MIDI clock packets, sent with a busy event loop,
+ * with and without SO_TXTIME.
+ *
+ * A clock packet is due each 2 ms, but before sending it the loop is busy a
+ * random time, up to 800 us. With SO_TXTIME the packets carry the due time
+ * plus 1 ms, and the kernel releases them then. The spacing is measured with
+ * the kernel receive timestamps.
+ *
+ * At loopback the transmit time is only used with the fq qdisc:
+ *   tc qdisc replace dev lo root fq
+ * Without it both modes should give the same numbers.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <netinet/in.h>
+#include <random>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/sendqueue.hpp>
+#include <rtpmidid/sockopts.hpp>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+static const int SAMPLES = 2000;
+static const auto PERIOD = 2000us;
+static const auto MAX_BUSY = 800us;
+
+// Kernel receive times, in ns
+static std::vector<int64_t> receive(int fd, int count) {
+  std::vector<int64_t> times;
+  times.reserve(count);
+  while ((int)times.size() < count) {
+    uint8_t data[64];
+    uint8_t control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {data, sizeof(data)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, 0) < 0)
+      break;
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+      continue;
+    struct timespec ts;
+    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+    times.push_back(int64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec);
+  }
+  return times;
+}
+
+static void bench(const char *mode, std::chrono::microseconds offset) {
+  rtpmidid::socket_options.txtime_offset_us = offset.count();
+
+  auto receiver = socket(AF_INET6, SOCK_DGRAM, 0);
+  int on = 1;
+  setsockopt(receiver, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+  struct timeval timeout = {1, 0};
+  setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in6 addr = {};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_loopback;
+  socklen_t len = sizeof(addr);
+  bind(receiver, (struct sockaddr *)&addr, len);
+  getsockname(receiver, (struct sockaddr *)&addr, &len);
+
+  auto sender = socket(AF_INET6, SOCK_DGRAM, 0);
+  rtpmidid::setup_socket(sender);
+  if (offset.count() > 0 && rtpmidid::socket_options.txtime_offset_us == 0) {
+    ERROR("No SO_TXTIME at this kernel");
+    close(sender);
+    close(receiver);
+    return;
+  }
+
+  std::vector<int64_t> times;
+  std::thread receiver_thread([&] { times = receive(receiver, SAMPLES); });
+
+  // RTP MIDI packet with a clock
+  uint8_t clock_packet[] = {0x80, 0x61, 0, 0, 0, 0, 0, 0,
+                            0,    0xBE, 0xEF, 0, 0x01, 0xF8};
+  rtpmidid::io_bytes_reader packet(clock_packet, sizeof(clock_packet));
+  rtpmidid::send_queue_t queue;
+  std::mt19937 random(1234);
+  std::uniform_int_distribution<int> busy_us(0, MAX_BUSY.count());
+
+  auto start = clock_type::now() + 10ms;
+  for (int i = 0; i < SAMPLES; i++) {
+    auto due = start + i * PERIOD;
+    std::this_thread::sleep_until(due);
+    // The loop was doing something else
+    auto busy_until =
+        clock_type::now() + std::chrono::microseconds(busy_us(random));
+    while (clock_type::now() < busy_until)
+      ;
+    rtpmidid::poller.set_event_time(due);
+    queue.send(sender, packet, &addr);
+  }
+  receiver_thread.join();
+  close(sender);
+  close(receiver);
+
+  // Deviation of each spacing from the period
+  double sum = 0, sum2 = 0, max = 0;
+  for (size_t i = 1; i < times.size(); i++) {
+    double deviation =
+        (times[i] - times[i - 1]) / 1000.0 - PERIOD.count();
+    sum += deviation;
+    sum2 += deviation * deviation;
+    max = std::max(max, std::abs(deviation));
+  }
+  auto n = std::max<size_t>(times.size(), 2) - 1;
+  auto mean = sum / n;
+  INFO("{:>8}: {} packets, spacing deviation mean {:.1f} us, stddev {:.1f} "
+       "us, max {:.1f} us",
+       mode, times.size(), mean, std::sqrt(sum2 / n - mean * mean), max);
+}
+
+int main(void) {
+  bench("asap", 0us);
+  bench("txtime", 1000us);
+  return 0;
+}
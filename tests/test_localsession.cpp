@@ -0,0 +1,290 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "./test_case.hpp"
+#include <chrono>
+#include <memory>
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/localsession.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/shmring.hpp>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+template <typename F> static bool wait_until(F f) {
+  auto until = std::chrono::steady_clock::now() + 5s;
+  while (!f() && std::chrono::steady_clock::now() < until) {
+    rtpmidid::poller.wait(100ms);
+  }
+  return f();
+}
+
+static std::string socket_path() {
+  return fmt::format("/tmp/rtpmidid-test-local-{}.sock", getpid());
+}
+
+void test_ring_wrap() {
+  const uint32_t capacity = 64;
+  std::vector<uint64_t> memory(rtpmidid::shm_ring_t::memory_size(capacity) /
+                               sizeof(uint64_t));
+  rtpmidid::shm_ring_t ring(memory.data(), capacity);
+  ring.init();
+
+  uint8_t data[32];
+  uint8_t out[32];
+  bool wake = false;
+  ASSERT_TRUE(ring.empty());
+  // Goes around the ring several times, with sizes that do not divide it
+  for (int i = 0; i < 100; i++) {
+    size_t size = 1 + i % 13;
+    for (size_t j = 0; j < size; j++)
+      data[j] = i + j;
+    ASSERT_TRUE(ring.push(data, size, &wake));
+    ASSERT_TRUE(wake);
+    ASSERT_TRUE(ring.push(data, size, &wake));
+    ASSERT_FALSE(wake);
+    for (int copy = 0; copy < 2; copy++) {
+      ASSERT_EQUAL(ring.pop(out, sizeof(out)), size);
+      for (size_t j = 0; j < size; j++)
+        ASSERT_EQUAL(out[j], uint8_t(i + j));
+    }
+    ASSERT_TRUE(ring.empty());
+  }
+
+  // Full, and nothing written
+  int pushed = 0;
+  while (ring.push(data, 14))
+    pushed++;
+  ASSERT_EQUAL(pushed, 4);
+  ASSERT_EQUAL(ring.used(), 64);
+  ASSERT_FALSE(ring.push(data, 1));
+  ASSERT_EQUAL(ring.pop(out, sizeof(out)), 14);
+  ASSERT_TRUE(ring.push(data, 14));
+  ASSERT_FALSE(ring.push(data, 0));
+}
+
+void test_ring_corrupt() {
+  const uint32_t capacity = 64;
+  std::vector<uint64_t> memory(rtpmidid::shm_ring_t::memory_size(capacity) /
+                               sizeof(uint64_t));
+  rtpmidid::shm_ring_t ring(memory.data(), capacity);
+  ring.init();
+  auto data = (uint8_t *)memory.data() +
+              rtpmidid::shm_ring_t::memory_size(capacity) - capacity;
+
+  uint8_t msg[4] = {1, 2, 3, 4};
+  uint8_t out[32];
+  ASSERT_TRUE(ring.push(msg, sizeof(msg)));
+
+  // A length over what the other side wrote, and a zero length. The tail
+  // must not go past the head.
+  for (auto length : {0x0100, 0x0005, 0x0000}) {
+    data[0] = length >> 8;
+    data[1] = length & 0xFF;
+    bool thrown = false;
+    try {
+      ring.pop(out, sizeof(out));
+    } catch (const rtpmidid::exception &e) {
+      DEBUG("Got expected exception: {}", e.what());
+      thrown = true;
+    }
+    ASSERT_TRUE(thrown);
+    ASSERT_EQUAL(ring.used(), 6);
+  }
+  data[0] = 0;
+  data[1] = 4;
+  ASSERT_EQUAL(ring.pop(out, sizeof(out)), 4);
+  ASSERT_TRUE(ring.empty());
+}
+
+void test_ring_threads() {
+  const uint32_t capacity = 1024;
+  const uint32_t count = 100000;
+  std::vector<uint64_t> memory(rtpmidid::shm_ring_t::memory_size(capacity) /
+                               sizeof(uint64_t));
+  rtpmidid::shm_ring_t ring(memory.data(), capacity);
+  ring.init();
+
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < count;) {
+      if (ring.push((const uint8_t *)&i, sizeof(i)))
+        i++;
+    }
+  });
+  uint32_t next = 0;
+  bool in_order = true;
+  while (next < count) {
+    uint32_t value;
+    if (ring.pop((uint8_t *)&value, sizeof(value)) == 0)
+      continue;
+    if (value != next)
+      in_order = false;
+    next++;
+  }
+  producer.join();
+  ASSERT_TRUE(in_order);
+  ASSERT_TRUE(ring.empty());
+}
+
+void test_session_round_trip() {
+  rtpmidid::local_server_t server(socket_path());
+  std::shared_ptr<rtpmidid::local_session_t> server_side;
+  server.session_event.connect(
+      [&](const std::shared_ptr<rtpmidid::local_session_t> &session) {
+        server_side = session;
+      });
+
+  auto client = rtpmidid::local_session_t::connect(socket_path(), "synth");
+  bool connected = false;
+  client->connected_event.connect([&] { connected = true; });
+  ASSERT_TRUE(wait_until([&] { return connected && server_side; }));
+  ASSERT_EQUAL(server_side->name, "synth");
+
+  std::vector<std::vector<uint8_t>> at_server;
+  std::vector<std::vector<uint8_t>> at_client;
+  server_side->midi_event.connect([&](const rtpmidid::io_bytes_reader &data) {
+    at_server.push_back(std::vector<uint8_t>(data.start, data.end));
+  });
+  client->midi_event.connect([&](const rtpmidid::io_bytes_reader &data) {
+    at_client.push_back(std::vector<uint8_t>(data.start, data.end));
+  });
+
+  uint8_t note_on[] = {0x90, 0x40, 0x7F};
+  client->send_midi(rtpmidid::io_bytes_reader(note_on, sizeof(note_on)));
+  ASSERT_TRUE(wait_until([&] { return at_server.size() == 1; }));
+  std::vector<uint8_t> expected(note_on, note_on + sizeof(note_on));
+  ASSERT_TRUE(at_server[0] == expected);
+
+  // A burst is read at one wake up, in order
+  for (uint8_t i = 0; i < 100; i++) {
+    uint8_t note_off[] = {0x80, i, 0x00};
+    server_side->send_midi(
+        rtpmidid::io_bytes_reader(note_off, sizeof(note_off)));
+  }
+  ASSERT_TRUE(wait_until([&] { return at_client.size() == 100; }));
+  for (uint8_t i = 0; i < 100; i++)
+    ASSERT_EQUAL(at_client[i][1], i);
+  ASSERT_EQUAL(client->dropped, 0);
+}
+
+void test_session_full_and_disconnect() {
+  rtpmidid::local_server_t server(socket_path());
+  std::shared_ptr<rtpmidid::local_session_t> server_side;
+  server.session_event.connect(
+      [&](const std::shared_ptr<rtpmidid::local_session_t> &session) {
+        server_side = session;
+      });
+  auto client = rtpmidid::local_session_t::connect(socket_path(), "synth");
+  ASSERT_TRUE(wait_until([&] { return client->is_connected(); }));
+  ASSERT_TRUE(wait_until([&] { return server_side != nullptr; }));
+
+  int received = 0;
+  server_side->midi_event.connect(
+      [&](const rtpmidid::io_bytes_reader &) { received++; });
+  bool disconnected = false;
+  server_side->disconnect_event.connect([&] { disconnected = true; });
+
+  // The server does not read until the poller runs, so the ring fills
+  std::vector<uint8_t> sysex(1000, 0x01);
+  sysex.front() = 0xF0;
+  sysex.back() = 0xF7;
+  for (int i = 0; i < 100; i++)
+    client->send_midi(rtpmidid::io_bytes_reader(sysex.data(), sysex.size()));
+  ASSERT_GT(client->dropped, 0);
+  ASSERT_TRUE(wait_until([&] { return received > 0; }));
+  rtpmidid::poller.wait(10ms);
+  ASSERT_EQUAL(received + client->dropped, 100);
+
+  client = nullptr;
+  ASSERT_TRUE(wait_until([&] { return disconnected; }));
+}
+
+// A client that does the handshake by hand, and tries to shrink the memory
+void test_session_truncate() {
+  rtpmidid::local_server_t server(socket_path());
+  std::shared_ptr<rtpmidid::local_session_t> server_side;
+  server.session_event.connect(
+      [&](const std::shared_ptr<rtpmidid::local_session_t> &session) {
+        server_side = session;
+      });
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path().c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQUAL(connect(fd, (const sockaddr *)&addr, sizeof(addr)), 0);
+  ASSERT_EQUAL(send(fd, "evil", 4, 0), 4);
+  ASSERT_TRUE(wait_until([&] { return server_side != nullptr; }));
+
+  uint8_t data[8];
+  int fds[3];
+  union {
+    cmsghdr header;
+    uint8_t buffer[CMSG_SPACE(sizeof(fds))];
+  } control = {};
+  iovec iov = {data, sizeof(data)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  ASSERT_EQUAL(recvmsg(fd, &msg, 0), 2);
+  memcpy(fds, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(fds));
+
+  // Sealed, so the server map stays valid
+  ASSERT_EQUAL(ftruncate(fds[0], 0), -1);
+  ASSERT_EQUAL(errno, EPERM);
+  uint8_t note_on[] = {0x90, 0x40, 0x7F};
+  server_side->send_midi(rtpmidid::io_bytes_reader(note_on, sizeof(note_on)));
+  rtpmidid::poller.wait(10ms);
+
+  for (auto f : fds)
+    close(f);
+  close(fd);
+}
+
+void test_connect_no_server() {
+  try {
+    rtpmidid::local_session_t::connect("/tmp/rtpmidid-test-none.sock", "x");
+    FAIL("Should not connect");
+  } catch (const rtpmidid::exception &e) {
+    DEBUG("Expected error: {}", e.what());
+  }
+}
+
+int main(int argc, char **argv) {
+  test_case_t testcase{
+      TEST(test_ring_wrap),
+      TEST(test_ring_corrupt),
+      TEST(test_ring_threads),
+      TEST(test_session_round_trip),
+      TEST(test_session_full_and_disconnect),
+      TEST(test_session_truncate),
+      TEST(test_connect_no_server),
+  };
+
+  testcase.run(argc, argv);
+
+  return testcase.exit_code();
+}
@@ -17,11 +17,38 @@
  */
 
 #include "./test_case.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <new>
 #include <ratio>
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/logger.hpp>
 #include <rtpmidid/poller.hpp>
+#include <rtpmidid/signal.hpp>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 using namespace std::chrono_literals;
 
+// Counts all heap allocations, also the ones at librtpmidid
+static std::atomic<size_t> allocations{0};
+
+// GCC does not know these are the replaced new and delete
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void *operator new(size_t size) {
+  allocations++;
+  auto ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+#pragma GCC diagnostic pop
+
 /// To check for bug https://github.com/davidmoreno/rtpmidid/issues/39
 void test_timer_event_order() {
   int state = 0;
@@ -46,6 +73,53 @@ void test_timer_event_order() {
   }
 }
 
+void test_timer_heap() {
+  // Many timers, some removed, the rest called in deadline order
+  std::vector<rtpmidid::poller_t::timer_t> timers;
+  std::vector<int> called;
+  for (int i = 0; i < 200; i++) {
+    auto ms = std::chrono::milliseconds(1 + (i * 37) % 50);
+    timers.push_back(rtpmidid::poller.add_timer_event(
+        ms, [&called, ms] { called.push_back(ms.count()); }));
+  }
+  for (size_t i = 0; i < timers.size(); i += 3) {
+    timers[i].disable();
+  }
+  while (called.size() < 133) {
+    rtpmidid::poller.wait(100ms);
+  }
+  rtpmidid::poller.wait(60ms);
+  ASSERT_EQUAL(called.size(), 133);
+  ASSERT_TRUE(std::is_sorted(called.begin(), called.end()));
+
+  // A handle to an already called timer does not remove a new one that
+  // reuses its slot
+  bool first = false, second = false;
+  auto old_timer =
+      rtpmidid::poller.add_timer_event(1ms, [&first] { first = true; });
+  while (!first) {
+    rtpmidid::poller.wait(100ms);
+  }
+  auto new_timer =
+      rtpmidid::poller.add_timer_event(1ms, [&second] { second = true; });
+  ASSERT_EQUAL(old_timer.id & 0xFFFFFFFF, new_timer.id & 0xFFFFFFFF);
+  old_timer.disable();
+  while (!second) {
+    rtpmidid::poller.wait(100ms);
+  }
+}
+
+void test_timer_exception() {
+  bool called = false;
+  auto t1 = rtpmidid::poller.add_timer_event(
+      1ms, [] { throw rtpmidid::exception("Bad timer"); });
+  auto t2 = rtpmidid::poller.add_timer_event(2ms, [&called] { called = true; });
+  // Does not throw out of the poller, and the next timer still runs
+  for (int i = 0; i < 10 && !called; i++)
+    rtpmidid::poller.wait(10ms);
+  ASSERT_TRUE(called);
+}
+
 int32_t to_ms(std::chrono::milliseconds ms) { return ms.count(); }
 
 template <typename T> int32_t to_ms(T mc) {
@@ -85,10 +159,278 @@ void test_wait_ms() {
   }
 }
 
+void test_timer_precision() {
+  // Sub ms timers, on time and not rounded up to the next ms
+  for (auto us : {200us, 500us, 1500us}) {
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration elapsed{};
+    bool called = false;
+    auto timer = rtpmidid::poller.add_timer_event(us, [&] {
+      elapsed = std::chrono::steady_clock::now() - start;
+      called = true;
+    });
+    while (!called) {
+      rtpmidid::poller.wait(1000ms);
+    }
+    auto elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+    DEBUG("Timer {} us called at {} us", us.count(), elapsed_us.count());
+    ASSERT_GTE(elapsed_us.count(), us.count());
+    ASSERT_LT(elapsed_us.count(), us.count() + 1000);
+  }
+}
+
+void test_remove_fd_in_batch() {
+  // Both ready at the same wait. The first called removes the other, and
+  // adds a new pipe at the same fd number, which is not ready.
+  int a[2], b[2];
+  ASSERT_EQUAL(pipe(a), 0);
+  ASSERT_EQUAL(pipe(b), 0);
+  int calls = 0, new_calls = 0;
+  int new_fds[2] = {-1, -1};
+  auto remove_other = [&](int other[2]) {
+    rtpmidid::poller.remove_fd(other[0]);
+    close(other[0]);
+    ASSERT_EQUAL(pipe(new_fds), 0);
+    ASSERT_EQUAL(new_fds[0], other[0]);
+    rtpmidid::poller.add_fd_in(new_fds[0], [&new_calls](int) { new_calls++; });
+  };
+  rtpmidid::poller.add_fd_in(a[0], [&](int) {
+    calls++;
+    remove_other(b);
+  });
+  rtpmidid::poller.add_fd_in(b[0], [&](int) {
+    calls++;
+    remove_other(a);
+  });
+  ASSERT_EQUAL(write(a[1], "x", 1), 1);
+  ASSERT_EQUAL(write(b[1], "x", 1), 1);
+  rtpmidid::poller.wait(100ms);
+  ASSERT_EQUAL(calls, 1);
+  ASSERT_EQUAL(new_calls, 0);
+
+  // The one that was called is still there
+  int remaining = (new_fds[0] == a[0]) ? b[0] : a[0];
+  rtpmidid::poller.remove_fd(remaining);
+  rtpmidid::poller.remove_fd(new_fds[0]);
+  for (auto fd : {a[0], a[1], b[0], b[1], new_fds[1]}) {
+    close(fd);
+  }
+}
+
+void test_no_alloc() {
+  // As a rtpclient: a CK timer re-armed at each call, with more state than
+  // std::function keeps inline, calls later, signals and fd events.
+  struct state_t {
+    rtpmidid::poller_t::timer_t timer;
+    signal_t<int> event;
+    int fds[2];
+    int ticks = 0, laters = 0, events = 0, reads = 0;
+  } state;
+  // Copied at each lambda, too big for std::function inline storage
+  struct peer_t {
+    uint32_t ssrc = 0xBEEF;
+    char name[36] = "peer";
+  } peer;
+  ASSERT_EQUAL(pipe(state.fds), 0);
+  state.event.connect([&state, peer](int n) { state.events += n; });
+  rtpmidid::poller.add_fd_in(state.fds[0], [&state](int fd) {
+    char c;
+    ASSERT_EQUAL(read(fd, &c, 1), 1);
+    state.reads++;
+  });
+
+  std::function<void(void)> tick;
+  tick = [&state, &tick, peer] {
+    state.ticks++;
+    state.event(1);
+    ASSERT_EQUAL(write(state.fds[1], "x", 1), 1);
+    rtpmidid::poller.call_later([&state, peer] { state.laters++; });
+    state.timer =
+        rtpmidid::poller.add_timer_event(100us, [&tick, peer] { tick(); });
+  };
+  tick();
+
+  // Warm up, so vectors are at their size
+  while (state.ticks < 20) {
+    rtpmidid::poller.wait(100ms);
+  }
+  size_t start_allocations = allocations;
+  while (state.ticks < 1000) {
+    rtpmidid::poller.wait(100ms);
+  }
+  auto steady_allocations = allocations - start_allocations;
+  state.timer.disable();
+  rtpmidid::poller.wait(1ms);
+
+  DEBUG("{} ticks, {} allocations", state.ticks, steady_allocations);
+  ASSERT_EQUAL(steady_allocations, 0);
+  ASSERT_GTE(state.laters, 999);
+  ASSERT_GTE(state.reads, 999);
+  ASSERT_EQUAL(state.events, state.ticks);
+
+  rtpmidid::poller.remove_fd(state.fds[0]);
+  close(state.fds[0]);
+  close(state.fds[1]);
+}
+
+void test_poller_per_thread() {
+  // Each with its own fds and timers, and the timer handles remove from
+  // the right poller.
+  const int THREADS = 4;
+  int ticks[THREADS] = {};
+  bool removed_called[THREADS] = {};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < THREADS; i++) {
+    threads.emplace_back([&ticks, &removed_called, i] {
+      rtpmidid::poller_t poller;
+      int fds[2];
+      ASSERT_EQUAL(pipe(fds), 0);
+      poller.add_fd_in(fds[0], [&ticks, i](int fd) {
+        char c;
+        ASSERT_EQUAL(read(fd, &c, 1), 1);
+        ticks[i]++;
+      });
+      auto removed = poller.add_timer_event(
+          5ms, [&removed_called, i] { removed_called[i] = true; });
+      ASSERT_TRUE(removed.poller == &poller);
+      removed.disable();
+
+      rtpmidid::poller_t::timer_t timer;
+      std::function<void(void)> tick = [&] {
+        ASSERT_EQUAL(write(fds[1], "x", 1), 1);
+        timer = poller.add_timer_event(1ms, tick);
+      };
+      tick();
+      while (ticks[i] < 20) {
+        poller.wait(100ms);
+      }
+      timer.disable();
+      poller.remove_fd(fds[0]);
+      close(fds[0]);
+      close(fds[1]);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int i = 0; i < THREADS; i++) {
+    ASSERT_EQUAL(ticks[i], 20);
+    ASSERT_FALSE(removed_called[i]);
+  }
+}
+
+void test_busy_poll() {
+  rtpmidid::poller.set_busy_poll(2000us);
+
+  int fds[2];
+  ASSERT_EQUAL(pipe(fds), 0);
+  bool called = false;
+  rtpmidid::poller.add_fd_in(fds[0], [&called](int fd) {
+    char c;
+    ASSERT_EQUAL(read(fd, &c, 1), 1);
+    called = true;
+  });
+
+  // Events ready are got while spinning
+  ASSERT_EQUAL(write(fds[1], "x", 1), 1);
+  rtpmidid::poller.wait(1000ms);
+  ASSERT_TRUE(called);
+
+  // And timers still work, after spinning falls back to sleep
+  bool timer_called = false;
+  auto start = std::chrono::steady_clock::now();
+  auto timer = rtpmidid::poller.add_timer_event(
+      20ms, [&timer_called] { timer_called = true; });
+  while (!timer_called) {
+    rtpmidid::poller.wait(1000ms);
+  }
+  auto elapsed = to_ms(std::chrono::steady_clock::now() - start);
+  ASSERT_GTE(elapsed, 20);
+  ASSERT_LT(elapsed, 1000);
+
+  rtpmidid::poller.remove_fd(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+  rtpmidid::poller.set_busy_poll(0us);
+}
+
+void test_io_uring() {
+  try {
+    rtpmidid::poller.set_backend(rtpmidid::poller_t::IO_URING);
+  } catch (const std::exception &e) {
+    WARNING("No io_uring here ({}). Skipping.", e.what());
+    return;
+  }
+
+  int fds[2];
+  ASSERT_EQUAL(pipe(fds), 0);
+  int reads = 0;
+  rtpmidid::poller.add_fd_in(fds[0], [&reads](int fd) {
+    char c;
+    ASSERT_EQUAL(read(fd, &c, 1), 1);
+    reads++;
+  });
+
+  // Level triggered: one byte read per call, both read
+  ASSERT_EQUAL(write(fds[1], "xy", 2), 2);
+  rtpmidid::poller.wait(1000ms);
+  ASSERT_EQUAL(reads, 1);
+  rtpmidid::poller.wait(1000ms);
+  ASSERT_EQUAL(reads, 2);
+
+  // Can not change with fds in
+  bool thrown = false;
+  try {
+    rtpmidid::poller.set_backend(rtpmidid::poller_t::EPOLL);
+  } catch (const rtpmidid::exception &e) {
+    thrown = true;
+  }
+  ASSERT_TRUE(thrown);
+
+  // Write ready
+  int writes = 0;
+  rtpmidid::poller.add_fd_out(fds[1], [&writes](int fd) { writes++; });
+  rtpmidid::poller.wait(1000ms);
+  ASSERT_EQUAL(writes, 1);
+  rtpmidid::poller.remove_fd(fds[1]);
+  rtpmidid::poller.wait(10ms);
+  ASSERT_EQUAL(writes, 1);
+
+  // Timers and call later still work
+  bool timer_called = false, later_called = false;
+  auto timer = rtpmidid::poller.add_timer_event(
+      20ms, [&timer_called] { timer_called = true; });
+  rtpmidid::poller.call_later([&later_called] { later_called = true; });
+  while (!timer_called) {
+    rtpmidid::poller.wait(1000ms);
+  }
+  ASSERT_TRUE(later_called);
+  ASSERT_GT(rtpmidid::poller.syscalls(), 0);
+
+  // Removed, no more calls
+  rtpmidid::poller.remove_fd(fds[0]);
+  ASSERT_EQUAL(write(fds[1], "z", 1), 1);
+  rtpmidid::poller.wait(10ms);
+  ASSERT_EQUAL(reads, 2);
+
+  close(fds[0]);
+  close(fds[1]);
+  rtpmidid::poller.set_backend(rtpmidid::poller_t::EPOLL);
+}
+
 int main(int argc, char **argv) {
   test_case_t testcase{
       TEST(test_timer_event_order),
+      TEST(test_timer_heap),
+      TEST(test_timer_exception),
       TEST(test_wait_ms),
+      TEST(test_timer_precision),
+      TEST(test_remove_fd_in_batch),
+      TEST(test_no_alloc),
+      TEST(test_poller_per_thread),
+      TEST(test_busy_poll),
+      TEST(test_io_uring),
   };
 
   testcase.run(argc, argv);
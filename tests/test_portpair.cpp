@@ -0,0 +1,171 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "./test_case.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <netinet/in.h>
+#include <rtpmidid/exceptions.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/portpair.hpp>
+#include <rtpmidid/rtpclient.hpp>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+static uint16_t bound_port(int fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (sockaddr *)&addr, &len);
+  if (addr.ss_family == AF_INET6)
+    return ntohs(((sockaddr_in6 *)&addr)->sin6_port);
+  return ntohs(((sockaddr_in *)&addr)->sin_port);
+}
+
+void test_pairs_are_consecutive() {
+  std::vector<rtpmidid::port_pair_t> pairs;
+  for (auto family : {AF_INET, AF_INET6}) {
+    for (int i = 0; i < 50; i++) {
+      auto pair = rtpmidid::port_pair_allocator_t::bind_pair(family);
+      ASSERT_EQUAL(pair.family, family);
+      ASSERT_EQUAL(pair.control_port % 2, 0);
+      ASSERT_EQUAL(bound_port(pair.control_socket), pair.control_port);
+      ASSERT_EQUAL(bound_port(pair.midi_socket), pair.control_port + 1);
+      pairs.push_back(pair);
+    }
+  }
+  for (auto &pair : pairs)
+    rtpmidid::port_pair_allocator_t::close_pair(pair);
+}
+
+void test_skips_taken_ports() {
+  // Takes many odd ports, so the allocator must skip those pairs
+  std::vector<rtpmidid::port_pair_t> blockers;
+  for (int i = 0; i < 20; i++) {
+    auto pair = rtpmidid::port_pair_allocator_t::bind_pair(AF_INET);
+    close(pair.control_socket);
+    pair.control_socket = -1;
+    blockers.push_back(pair);
+  }
+  auto pair = rtpmidid::port_pair_allocator_t::bind_pair(AF_INET);
+  for (auto &blocker : blockers)
+    ASSERT_NOT_EQUAL(pair.control_port, blocker.control_port);
+  ASSERT_EQUAL(bound_port(pair.midi_socket), pair.control_port + 1);
+
+  rtpmidid::port_pair_allocator_t::close_pair(pair);
+  for (auto &blocker : blockers)
+    rtpmidid::port_pair_allocator_t::close_pair(blocker);
+}
+
+void test_warm_pool() {
+  rtpmidid::port_pair_allocator_t allocator;
+  allocator.pool_size = 3;
+
+  auto first = allocator.get(AF_INET);
+  ASSERT_EQUAL(allocator.from_pool, 0);
+  ASSERT_EQUAL(allocator.pooled(AF_INET), 0);
+
+  // Refilled later, out of the connection path
+  rtpmidid::poller.wait(10ms);
+  ASSERT_EQUAL(allocator.pooled(AF_INET), 3);
+
+  auto second = allocator.get(AF_INET);
+  ASSERT_EQUAL(allocator.from_pool, 1);
+  ASSERT_EQUAL(allocator.pooled(AF_INET), 2);
+  ASSERT_EQUAL(bound_port(second.midi_socket), second.control_port + 1);
+  ASSERT_NOT_EQUAL(first.control_port, second.control_port);
+  rtpmidid::poller.wait(10ms);
+  ASSERT_EQUAL(allocator.pooled(AF_INET), 3);
+  ASSERT_EQUAL(allocator.allocated, 2);
+
+  rtpmidid::port_pair_allocator_t::close_pair(first);
+  rtpmidid::port_pair_allocator_t::close_pair(second);
+  allocator.clear();
+  ASSERT_EQUAL(allocator.pooled(AF_INET), 0);
+}
+
+// Runs f with very few file descriptors allowed
+template <typename F> static void with_no_fds(F f) {
+  struct rlimit old;
+  getrlimit(RLIMIT_NOFILE, &old);
+  struct rlimit limit = old;
+  // Below the fds already open
+  limit.rlim_cur = 3;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  f();
+  setrlimit(RLIMIT_NOFILE, &old);
+}
+
+void test_allocation_failure() {
+  rtpmidid::port_pair_allocator_t allocator;
+  bool thrown = false;
+  with_no_fds([&] {
+    try {
+      allocator.get(AF_INET);
+    } catch (const rtpmidid::port_allocation_error &e) {
+      thrown = true;
+    }
+  });
+  ASSERT_TRUE(thrown);
+  ASSERT_EQUAL(allocator.failures, 1);
+  rtpmidid::poller.wait(10ms);
+}
+
+void test_client_reports_allocation_failure() {
+  rtpmidid::port_pairs.clear();
+  rtpmidid::rtpclient client("client");
+  std::vector<rtpmidid::rtppeer::disconnect_reason_e> reasons;
+  client.peer.disconnect_event.connect(
+      [&](rtpmidid::rtppeer::disconnect_reason_e reason) {
+        reasons.push_back(reason);
+      });
+
+  struct rtpmidid::resolved_address_t address = {};
+  auto addr = (sockaddr_in *)&address.addr;
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr->sin_port = htons(5004);
+  address.family = AF_INET;
+  address.socktype = SOCK_DGRAM;
+  address.addrlen = sizeof(sockaddr_in);
+
+  with_no_fds([&] { client.connect_to({address}, "127.0.0.1", "5004"); });
+  ASSERT_EQUAL(reasons.size(), 1);
+  ASSERT_EQUAL(reasons[0],
+               rtpmidid::rtppeer::disconnect_reason_e::PORT_ALLOCATION_FAILED);
+  ASSERT_EQUAL(client.control_socket, -1);
+  ASSERT_EQUAL(client.midi_socket, -1);
+  rtpmidid::poller.wait(10ms);
+}
+
+int main(int argc, char **argv) {
+  test_case_t testcase{
+      TEST(test_pairs_are_consecutive),
+      TEST(test_skips_taken_ports),
+      TEST(test_warm_pool),
+      TEST(test_allocation_failure),
+      TEST(test_client_reports_allocation_failure),
+  };
+
+  testcase.run(argc, argv);
+
+  return testcase.exit_code();
+}
@@ -0,0 +1,620 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "./test_case.hpp"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <netdb.h>
+#include <thread>
+#include <unistd.h>
+#include <rtpmidid/logger.hpp>
+#include <rtpmidid/multicast.hpp>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/portpair.hpp>
+#include <rtpmidid/resolver.hpp>
+#include <rtpmidid/rtpclient.hpp>
+#include <rtpmidid/rtpserver.hpp>
+
+using namespace std::chrono_literals;
+
+// Runs the poller until f() is true, or timeout
+template <typename F> static bool wait_until(F f) {
+  auto until = std::chrono::steady_clock::now() + 5s;
+  while (!f() && std::chrono::steady_clock::now() < until) {
+    rtpmidid::poller.wait(100ms);
+  }
+  return f();
+}
+
+void test_resolve_and_cache() {
+  rtpmidid::resolver.clear_cache();
+  auto hits = rtpmidid::resolver.cache_hits;
+
+  int called = 0;
+  size_t naddresses = 0;
+  rtpmidid::resolver.resolve(
+      "localhost", "5004",
+      [&](const std::vector<rtpmidid::resolved_address_t> &addresses,
+          int error) {
+        ASSERT_EQUAL(error, 0);
+        naddresses = addresses.size();
+        called++;
+      });
+  // Never called from inside resolve
+  ASSERT_EQUAL(called, 0);
+  ASSERT_TRUE(wait_until([&] { return called == 1; }));
+  ASSERT_GT(naddresses, 0);
+
+  // Now from the cache, but still later
+  rtpmidid::resolver.resolve(
+      "localhost", "5004",
+      [&](const std::vector<rtpmidid::resolved_address_t> &addresses,
+          int error) {
+        ASSERT_EQUAL(addresses.size(), naddresses);
+        called++;
+      });
+  ASSERT_EQUAL(called, 1);
+  ASSERT_TRUE(wait_until([&] { return called == 2; }));
+  ASSERT_EQUAL(rtpmidid::resolver.cache_hits, hits + 1);
+}
+
+void test_resolve_error() {
+  int error = 0;
+  bool called = false;
+  rtpmidid::resolver.resolve(
+      "localhost", "no-such-rtpmidi-service",
+      [&](const std::vector<rtpmidid::resolved_address_t> &addresses,
+          int error_) {
+        ASSERT_EQUAL(addresses.size(), 0);
+        error = error_;
+        called = true;
+      });
+  ASSERT_TRUE(wait_until([&] { return called; }));
+  DEBUG("Error is {}", gai_strerror(error));
+  ASSERT_NOT_EQUAL(error, 0);
+}
+
+void test_resolve_cancel() {
+  rtpmidid::resolver.clear_cache();
+  bool called = false;
+  auto id = rtpmidid::resolver.resolve(
+      "localhost", "5004",
+      [&](const std::vector<rtpmidid::resolved_address_t> &, int) {
+        called = true;
+      });
+  rtpmidid::resolver.cancel(id);
+
+  // Another one to know when the first is done
+  bool done = false;
+  rtpmidid::resolver.resolve(
+      "localhost", "5005",
+      [&](const std::vector<rtpmidid::resolved_address_t> &, int) {
+        done = true;
+      });
+  ASSERT_TRUE(wait_until([&] { return done; }));
+  ASSERT_FALSE(called);
+}
+
+// A DNS that takes 1s to answer for "slow"
+static int slow_lookup(const char *node, const char *service,
+                       const struct addrinfo *hints, struct addrinfo **res) {
+  if (std::string(node) == "slow")
+    std::this_thread::sleep_for(1s);
+  return getaddrinfo("127.0.0.1", service, hints, res);
+}
+
+void test_resolve_slow() {
+  rtpmidid::poller_t poller;
+  auto resolver = std::make_unique<rtpmidid::resolver_t>(poller);
+  resolver->lookup = slow_lookup;
+
+  bool slow = false, fast = false;
+  resolver->resolve("slow", "5004",
+                    [&](const std::vector<rtpmidid::resolved_address_t> &,
+                        int) { slow = true; });
+  resolver->resolve("fast", "5004",
+                    [&](const std::vector<rtpmidid::resolved_address_t> &,
+                        int) { fast = true; });
+
+  // The slow one does not hold the other
+  auto until = std::chrono::steady_clock::now() + 500ms;
+  while (!fast && std::chrono::steady_clock::now() < until)
+    poller.wait(100ms);
+  ASSERT_TRUE(fast);
+  ASSERT_FALSE(slow);
+
+  // Nor the destruction
+  auto start = std::chrono::steady_clock::now();
+  resolver.reset();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  DEBUG("Destroyed in {} us",
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  ASSERT_LT(elapsed, 100ms);
+  ASSERT_FALSE(slow);
+}
+
+void test_connect_to_server() {
+  rtpmidid::resolver.clear_cache();
+  rtpmidid::rtpserver server("server", "0");
+  rtpmidid::rtpclient client("client");
+
+  client.connect_to("localhost", std::to_string(server.control_port));
+  // Not blocking, still resolving
+  ASSERT_EQUAL(client.control_socket, -1);
+  ASSERT_NOT_EQUAL(client.resolve_id, 0);
+
+  ASSERT_TRUE(wait_until([&] { return client.peer.is_connected(); }));
+  ASSERT_EQUAL(client.resolve_id, 0);
+}
+
+void test_poller_per_thread() {
+  // A server and a client on their own poller, at each thread
+  const int THREADS = 2;
+  bool connected[THREADS] = {};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < THREADS; i++) {
+    threads.emplace_back([&connected, i] {
+      rtpmidid::poller_t poller;
+      rtpmidid::resolver_t resolver(poller);
+      rtpmidid::port_pair_allocator_t port_pairs(poller);
+      rtpmidid::rtpserver server("server", "0", false, poller);
+      rtpmidid::rtpclient client("client", poller, resolver, port_pairs);
+      client.connect_to("localhost", std::to_string(server.control_port));
+
+      auto until = std::chrono::steady_clock::now() + 5s;
+      while (!client.peer.is_connected() &&
+             std::chrono::steady_clock::now() < until) {
+        poller.wait(100ms);
+      }
+      connected[i] = client.peer.is_connected();
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int i = 0; i < THREADS; i++) {
+    ASSERT_TRUE(connected[i]);
+  }
+
+  // The resolver must be at the client poller
+  rtpmidid::poller_t poller;
+  bool thrown = false;
+  try {
+    rtpmidid::rtpclient client("client", poller);
+  } catch (const rtpmidid::exception &e) {
+    thrown = true;
+  }
+  ASSERT_TRUE(thrown);
+}
+
+void test_destroy_while_resolving() {
+  rtpmidid::resolver.clear_cache();
+  {
+    rtpmidid::rtpclient client("client");
+    client.connect_to("localhost", "5004");
+  }
+  // The result arrives for a deleted client, and is ignored
+  bool done = false;
+  rtpmidid::resolver.resolve(
+      "localhost", "5006",
+      [&](const std::vector<rtpmidid::resolved_address_t> &, int) {
+        done = true;
+      });
+  ASSERT_TRUE(wait_until([&] { return done; }));
+}
+
+static std::vector<rtpmidid::resolved_address_t> localhost(uint16_t port) {
+  rtpmidid::resolved_address_t address = {};
+  auto addr = (sockaddr_in *)&address.addr;
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr->sin_port = htons(port);
+  address.family = AF_INET;
+  address.socktype = SOCK_DGRAM;
+  address.addrlen = sizeof(sockaddr_in);
+  return {address};
+}
+
+/**
+ * Answers the invitations after some delay, as a far away peer. Can also
+ * ignore or reject the MIDI invitation before the control one.
+ */
+class slow_server_t {
+public:
+  enum early_midi_e { ACCEPT, IGNORE, REJECT };
+
+  rtpmidid::port_pair_t ports;
+  std::chrono::milliseconds delay;
+  early_midi_e early_midi;
+  bool control_connected = false;
+  int midi_invites = 0;
+  std::vector<rtpmidid::poller_t::timer_t> timers;
+
+  slow_server_t(std::chrono::milliseconds delay_, early_midi_e early_midi_)
+      : delay(delay_), early_midi(early_midi_) {
+    ports = rtpmidid::port_pair_allocator_t::bind_pair(AF_INET);
+    rtpmidid::poller.add_fd_in(ports.control_socket,
+                               [this](int fd) { packet_ready(fd, true); });
+    rtpmidid::poller.add_fd_in(ports.midi_socket,
+                               [this](int fd) { packet_ready(fd, false); });
+  }
+  ~slow_server_t() {
+    rtpmidid::poller.remove_fd(ports.control_socket);
+    rtpmidid::poller.remove_fd(ports.midi_socket);
+    rtpmidid::port_pair_allocator_t::close_pair(ports);
+  }
+
+  void packet_ready(int fd, bool control) {
+    uint8_t data[1500];
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    auto n = recvfrom(fd, data, sizeof(data), 0, (sockaddr *)&from, &len);
+    if (n < 16 || data[0] != 0xFF || data[2] != 'I' || data[3] != 'N')
+      return;
+    rtpmidid::io_bytes_reader in(data, n);
+    in.seek(8);
+    auto initiator_id = in.read_uint32();
+
+    uint16_t answer = rtpmidid::rtppeer::OK;
+    if (!control) {
+      midi_invites++;
+      if (!control_connected && early_midi == IGNORE)
+        return;
+      if (!control_connected && early_midi == REJECT)
+        answer = rtpmidid::rtppeer::NO;
+    }
+
+    timers.push_back(rtpmidid::poller.add_timer_event(
+        delay, [this, fd, control, from, initiator_id, answer] {
+          rtpmidid::io_bytes_writer_static<64> reply;
+          reply.write_uint16(0xFFFF);
+          reply.write_uint16(answer);
+          reply.write_uint32(2);
+          reply.write_uint32(initiator_id);
+          reply.write_uint32(0x1234);
+          reply.write_str0("slow");
+          sendto(fd, reply.start, reply.pos(), 0, (const sockaddr *)&from,
+                 sizeof(from));
+          if (control)
+            control_connected = true;
+        }));
+  }
+};
+
+// Returns the ms until connected, or -1
+static int64_t time_to_connected(slow_server_t &server) {
+  rtpmidid::rtpclient client("client");
+  bool disconnected = false;
+  client.peer.disconnect_event.connect(
+      [&](rtpmidid::rtppeer::disconnect_reason_e) { disconnected = true; });
+
+  auto start = std::chrono::steady_clock::now();
+  client.connect_to(localhost(server.ports.control_port), "localhost",
+                    std::to_string(server.ports.control_port));
+  if (!wait_until([&] { return client.peer.is_connected() || disconnected; }))
+    return -1;
+  if (disconnected)
+    return -1;
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  INFO("Connected in {} ms, {} MIDI invitations", ms, server.midi_invites);
+  return ms;
+}
+
+void test_parallel_handshake() {
+  // One round trip, not two
+  slow_server_t server(50ms, slow_server_t::ACCEPT);
+  auto ms = time_to_connected(server);
+  ASSERT_GTE(ms, 50);
+  ASSERT_LT(ms, 90);
+  ASSERT_EQUAL(server.midi_invites, 1);
+}
+
+void test_handshake_fallback_rejected() {
+  slow_server_t server(50ms, slow_server_t::REJECT);
+  auto ms = time_to_connected(server);
+  ASSERT_GTE(ms, 100);
+  ASSERT_EQUAL(server.midi_invites, 2);
+}
+
+void test_handshake_fallback_ignored() {
+  slow_server_t server(50ms, slow_server_t::IGNORE);
+  auto ms = time_to_connected(server);
+  ASSERT_GTE(ms, 100);
+  ASSERT_LT(ms, 1000);
+  ASSERT_EQUAL(server.midi_invites, 2);
+}
+
+// Some sandboxes and CI machines have no multicast route
+static bool multicast_works(const rtpmidid::multicast_group_t &group) {
+  int receiver, sender;
+  try {
+    receiver = rtpmidid::multicast_join(group);
+    sender = rtpmidid::multicast_sender_socket(group);
+  } catch (const std::exception &e) {
+    WARNING("No multicast: {}", e.what());
+    return false;
+  }
+  char data[1] = {0};
+  sendto(sender, data, 1, 0, (const sockaddr *)&group.addr, group.addrlen);
+  struct timeval timeout = {0, 200'000};
+  setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  bool works = recv(receiver, data, 1, 0) == 1;
+  close(sender);
+  close(receiver);
+  return works;
+}
+
+void test_multicast() {
+  auto group = rtpmidid::multicast_group_t::parse(
+      "239.255.42.99", std::to_string(40000 + rand() % 10000));
+  if (!multicast_works(group)) {
+    WARNING("Multicast not available here. Skipping.");
+    return;
+  }
+
+  rtpmidid::rtpserver server("server", "0");
+  server.enable_multicast(group);
+
+  rtpmidid::rtpclient client("client");
+  rtpmidid::rtpclient legacy("legacy");
+  legacy.peer.local_features = 0;
+  int events = 0, legacy_events = 0;
+  client.peer.midi_event.connect(
+      [&](const rtpmidid::io_bytes_reader &) { events++; });
+  legacy.peer.midi_event.connect(
+      [&](const rtpmidid::io_bytes_reader &) { legacy_events++; });
+
+  client.connect_to("127.0.0.1", std::to_string(server.control_port));
+  legacy.connect_to("127.0.0.1", std::to_string(server.control_port));
+  ASSERT_TRUE(wait_until([&] {
+    return client.peer.is_connected() && legacy.peer.is_connected();
+  }));
+  ASSERT_NOT_EQUAL(client.multicast_socket, -1);
+  ASSERT_EQUAL(legacy.multicast_socket, -1);
+
+  rtpmidid::io_bytes_writer_static<4> midi;
+  midi.write_uint8(0x90);
+  midi.write_uint8(0x40);
+  midi.write_uint8(0x7F);
+  server.send_midi_to_all_peers(midi);
+
+  ASSERT_TRUE(wait_until([&] { return events == 1 && legacy_events == 1; }));
+  ASSERT_EQUAL(server.multicast_drops, 0);
+  // Only one copy for the multicast peer
+  rtpmidid::poller.wait(50ms);
+  ASSERT_EQUAL(events, 1);
+
+  // Split once, in the group sequence, with no packets of its own
+  auto server_peer = server.initiator_to_peer[client.peer.initiator_id];
+  auto seq_nr = server_peer->seq_nr;
+  std::vector<uint8_t> sysex = {0xF0};
+  for (int i = 0; i < 3000; i++)
+    sysex.push_back(i & 0x7F);
+  sysex.push_back(0xF7);
+  server.send_midi_to_all_peers(
+      rtpmidid::io_bytes_reader(sysex.data(), sysex.size()));
+  server.send_midi_to_all_peers(midi);
+  ASSERT_TRUE(wait_until([&] { return events == 3 && legacy_events == 3; }));
+  rtpmidid::poller.wait(50ms);
+  ASSERT_EQUAL(events, 3);
+  ASSERT_EQUAL(server_peer->seq_nr, seq_nr);
+  ASSERT_EQUAL(client.peer.lost_packets, 0);
+  ASSERT_EQUAL(client.peer.duplicates, 0);
+}
+
+void test_multicast_join_fails() {
+  auto group = rtpmidid::multicast_group_t::parse(
+      "239.255.42.98", std::to_string(40000 + rand() % 10000));
+  rtpmidid::rtpserver server("server", "0");
+  try {
+    server.enable_multicast(group);
+  } catch (const std::exception &e) {
+    WARNING("Multicast not available here. Skipping: {}", e.what());
+    return;
+  }
+  // Without SO_REUSEADDR, so the client can not bind to the group
+  int blocker = socket(group.family(), SOCK_DGRAM, 0);
+  ASSERT_EQUAL(bind(blocker, (const sockaddr *)&group.addr, group.addrlen), 0);
+
+  rtpmidid::rtpclient client("client");
+  int events = 0;
+  client.peer.midi_event.connect(
+      [&](const rtpmidid::io_bytes_reader &) { events++; });
+  client.connect_to("127.0.0.1", std::to_string(server.control_port));
+  ASSERT_TRUE(wait_until([&] { return client.peer.is_connected(); }));
+  ASSERT_EQUAL(client.multicast_socket, -1);
+
+  // Back to unicast
+  auto server_peer = server.initiator_to_peer.begin()->second;
+  ASSERT_TRUE(wait_until([&] {
+    return !(server_peer->remote_features & rtpmidid::rtppeer::FEATURE_MULTICAST);
+  }));
+  ASSERT_TRUE(server_peer->is_connected());
+  rtpmidid::io_bytes_writer_static<4> midi;
+  midi.write_uint8(0x90);
+  midi.write_uint8(0x40);
+  midi.write_uint8(0x7F);
+  server.send_midi_to_all_peers(midi);
+  ASSERT_TRUE(wait_until([&] { return events == 1; }));
+  close(blocker);
+}
+
+void test_redundancy_fanout() {
+  rtpmidid::rtpserver server("server", "0");
+  server.redundancy.copies = 3;
+  server.redundancy.gap = 1ms;
+
+  rtpmidid::rtpclient client("client");
+  int events = 0;
+  client.peer.midi_event.connect(
+      [&](const rtpmidid::io_bytes_reader &) { events++; });
+  client.connect_to("127.0.0.1", std::to_string(server.control_port));
+  ASSERT_TRUE(wait_until([&] { return client.peer.is_connected(); }));
+
+  rtpmidid::io_bytes_writer_static<4> midi;
+  midi.write_uint8(0x90);
+  midi.write_uint8(0x40);
+  midi.write_uint8(0x7F);
+  server.send_midi_to_all_peers(midi);
+
+  ASSERT_TRUE(wait_until([&] { return client.peer.duplicates == 2; }));
+  ASSERT_EQUAL(events, 1);
+}
+
+void test_fec_fanout_order() {
+  rtpmidid::rtpserver server("server", "0");
+  server.fec_group = 2;
+
+  rtpmidid::rtpclient client("client");
+  int events = 0;
+  client.peer.midi_event.connect(
+      [&](const rtpmidid::io_bytes_reader &) { events++; });
+  client.connect_to("127.0.0.1", std::to_string(server.control_port));
+  ASSERT_TRUE(wait_until([&] { return client.peer.is_connected(); }));
+
+  rtpmidid::io_bytes_writer_static<4> midi;
+  midi.write_uint8(0x90);
+  midi.write_uint8(0x40);
+  midi.write_uint8(0x7F);
+  for (auto i = 0; i < 4; i++)
+    server.send_midi_to_all_peers(midi);
+
+  // The parity comes after its packets, so nothing to recover
+  ASSERT_TRUE(wait_until([&] { return events == 4; }));
+  rtpmidid::poller.wait(10ms);
+  ASSERT_EQUAL(client.peer.fec_recovered, 0);
+  ASSERT_EQUAL(client.peer.duplicates, 0);
+}
+
+void test_big_mtu() {
+  rtpmidid::rtpserver server("server", "0");
+  server.mtu = rtpmidid::rtppeer::MAX_PACKET_SIZE;
+  server.fec_group = 2;
+
+  rtpmidid::rtpclient client("client");
+  std::vector<std::vector<uint8_t>> got;
+  client.peer.midi_event.connect([&](const rtpmidid::io_bytes_reader &data) {
+    got.emplace_back(data.start, data.end);
+  });
+  client.connect_to("127.0.0.1", std::to_string(server.control_port));
+  ASSERT_TRUE(wait_until([&] { return client.peer.is_connected(); }));
+
+  // Over the usual 1500 bytes, in one packet, and its FEC parity too
+  std::vector<uint8_t> sysex = {0xF0};
+  for (int i = 0; i < 3000; i++)
+    sysex.push_back(i & 0x7F);
+  sysex.push_back(0xF7);
+  rtpmidid::io_bytes_reader data(sysex.data(), sysex.size());
+  server.send_midi_to_all_peers(data);
+  server.send_midi_to_all_peers(data);
+
+  ASSERT_TRUE(wait_until([&] { return got.size() == 2; }));
+  ASSERT_TRUE(got[0] == sysex);
+  ASSERT_TRUE(got[1] == sysex);
+
+  // Too big even for the biggest packet, it is split
+  sysex.pop_back();
+  for (int i = 0; i < 3000; i++)
+    sysex.push_back(i & 0x7F);
+  sysex.push_back(0xF7);
+  server.send_midi_to_all_peers(
+      rtpmidid::io_bytes_reader(sysex.data(), sysex.size()));
+  ASSERT_TRUE(wait_until([&] { return got.size() == 3; }));
+  ASSERT_TRUE(got[2] == sysex);
+  rtpmidid::poller.wait(20ms);
+  ASSERT_EQUAL(client.recv_batch.truncated, 0);
+}
+
+void test_shared_port() {
+  rtpmidid::rtpserver server("shared", "0");
+  server.add_session("piano");
+  server.add_session("drums");
+
+  rtpmidid::rtpclient piano("client");
+  rtpmidid::rtpclient drums("client");
+  rtpmidid::rtpclient legacy("client");
+  piano.peer.local_extension[rtpmidid::rtppeer::EXT_SESSION] = "piano";
+  drums.peer.local_extension[rtpmidid::rtppeer::EXT_SESSION] = "drums";
+  std::map<rtpmidid::rtpclient *, int> events;
+  for (auto client : {&piano, &drums, &legacy}) {
+    client->peer.midi_event.connect(
+        [&events, client](const rtpmidid::io_bytes_reader &) {
+          events[client]++;
+        });
+    client->connect_to("127.0.0.1", std::to_string(server.control_port));
+  }
+  ASSERT_TRUE(wait_until([&] {
+    return piano.peer.is_connected() && drums.peer.is_connected() &&
+           legacy.peer.is_connected();
+  }));
+  // Each answered with its own name. The one that did not choose is at the
+  // first session, not at all of them.
+  ASSERT_EQUAL(piano.peer.remote_name, "piano");
+  ASSERT_EQUAL(drums.peer.remote_name, "drums");
+  ASSERT_EQUAL(legacy.peer.remote_name, "piano");
+
+  rtpmidid::io_bytes_writer_static<4> midi;
+  midi.write_uint8(0x90);
+  midi.write_uint8(0x40);
+  midi.write_uint8(0x7F);
+  server.send_midi_to_session("piano", midi);
+  server.send_midi_to_session("piano", midi);
+  server.send_midi_to_session("drums", midi);
+  ASSERT_TRUE(wait_until([&] {
+    return events[&piano] == 2 && events[&drums] == 1 && events[&legacy] == 2;
+  }));
+  rtpmidid::poller.wait(20ms);
+  ASSERT_EQUAL(events[&legacy], 2);
+
+  // Only the peers of the session are disconnected
+  server.remove_session("drums");
+  ASSERT_TRUE(wait_until([&] { return !drums.peer.is_connected(); }));
+  ASSERT_TRUE(piano.peer.is_connected());
+  ASSERT_TRUE(legacy.peer.is_connected());
+  ASSERT_EQUAL(server.ssrc_to_peer.size(), 2);
+
+  // The first one stays the default until removed
+  ASSERT_EQUAL(server.default_session, "piano");
+  server.remove_session("piano");
+  ASSERT_TRUE(server.default_session.empty());
+}
+
+int main(int argc, char **argv) {
+  test_case_t testcase{
+      TEST(test_resolve_and_cache),       TEST(test_resolve_error),
+      TEST(test_resolve_cancel),          TEST(test_resolve_slow),
+      TEST(test_connect_to_server),
+      TEST(test_destroy_while_resolving), TEST(test_multicast),
+      TEST(test_multicast_join_fails),
+      TEST(test_poller_per_thread),
+      TEST(test_parallel_handshake),
+      TEST(test_handshake_fallback_rejected),
+      TEST(test_handshake_fallback_ignored),
+      TEST(test_redundancy_fanout),
+      TEST(test_fec_fanout_order),
+      TEST(test_big_mtu),
+      TEST(test_shared_port),
+  };
+
+  testcase.run(argc, argv);
+
+  return testcase.exit_code();
+}
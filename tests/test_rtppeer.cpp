@@ -20,9 +20,12 @@
 #include "./test_case.hpp"
 #include <algorithm>
 #include <memory>
+#include <set>
 #include <rtpmidid/iobytes.hpp>
 #include <rtpmidid/logger.hpp>
+#include <rtpmidid/poller.hpp>
 #include <rtpmidid/rtppeer.hpp>
+#include <unistd.h>
 
 auto CONNECT_MSG = hex_to_bin("FF FF 'IN'"
                               "0000 0002"
@@ -111,6 +114,448 @@ void test_connect_disconnect_reverse_order() {
   ASSERT_EQUAL(peer.is_connected(), false);
 }
 
+void test_ck_uses_rx_time() {
+  rtpmidid::rtppeer peer("test");
+
+  uint64_t ck2 = 0;
+  peer.send_event.connect([&peer, &ck2](const rtpmidid::io_bytes_reader &data,
+                                        rtpmidid::rtppeer::port_e port) {
+    if (!peer.is_connected())
+      return;
+    rtpmidid::io_bytes_reader reader(data);
+    reader.seek(20);
+    ck2 = reader.read_uint64();
+  });
+
+  peer.data_ready(CONNECT_MSG, rtpmidid::rtppeer::CONTROL_PORT);
+  peer.data_ready(CONNECT_MSG, rtpmidid::rtppeer::MIDI_PORT);
+
+  // Received by the kernel 50ms ago, after the peer was created
+  usleep(60'000);
+  struct timespec rx_time;
+  clock_gettime(CLOCK_REALTIME, &rx_time);
+  rx_time.tv_sec -= 1;
+  rx_time.tv_nsec += 950'000'000;
+  if (rx_time.tv_nsec >= 1'000'000'000) {
+    rx_time.tv_sec += 1;
+    rx_time.tv_nsec -= 1'000'000'000;
+  }
+
+  auto ck0 = hex_to_bin("FF FF 'CK' 'BEEF' 00 000000"
+                        "0000 0000 0000 0001"
+                        "0000 0000 0000 0000"
+                        "0000 0000 0000 0000");
+  peer.data_ready(ck0, rtpmidid::rtppeer::MIDI_PORT, rx_time);
+
+  ASSERT_EQUAL(ck2, peer.to_timestamp(rx_time));
+  ASSERT_LT(ck2 + 400, peer.get_timestamp());
+  ASSERT_EQUAL(peer.internal_latency.count, 1);
+  ASSERT_GTE(peer.internal_latency.max_us, 50'000);
+}
+
+void test_extension() {
+  rtpmidid::rtppeer server("test");
+  server.local_features = rtpmidid::rtppeer::FEATURE_MULTICAST;
+  server.local_extension[rtpmidid::rtppeer::EXT_MULTICAST_GROUP] = "group";
+
+  // Other implementations get the plain OK
+  size_t ok_size = 0;
+  auto send_conn = server.send_event.connect(
+      [&ok_size](const rtpmidid::io_bytes_reader &data,
+                 rtpmidid::rtppeer::port_e port) { ok_size = data.size(); });
+  server.data_ready(CONNECT_MSG, rtpmidid::rtppeer::CONTROL_PORT);
+  ASSERT_EQUAL(ok_size, 16 + sizeof("test"));
+  ASSERT_FALSE(server.remote_has_extension);
+  server.send_event.disconnect(send_conn);
+  server.reset();
+
+  // rtpmidid peers get the extension back
+  rtpmidid::rtppeer client("client");
+  client.initiator_id = 0x1234;
+  client.local_features = rtpmidid::rtppeer::FEATURE_MULTICAST;
+  client.send_event.connect(
+      [&server](const rtpmidid::io_bytes_reader &data,
+                rtpmidid::rtppeer::port_e port) {
+        server.data_ready(rtpmidid::io_bytes_reader(data), port);
+      });
+  server.send_event.connect([&client](const rtpmidid::io_bytes_reader &data,
+                                      rtpmidid::rtppeer::port_e port) {
+    client.data_ready(rtpmidid::io_bytes_reader(data), port);
+  });
+  client.connect_to(rtpmidid::rtppeer::CONTROL_PORT);
+
+  ASSERT_TRUE(server.remote_has_extension);
+  ASSERT_EQUAL(server.remote_features, rtpmidid::rtppeer::FEATURE_MULTICAST);
+  ASSERT_TRUE(client.remote_has_extension);
+  ASSERT_EQUAL(client.remote_features, rtpmidid::rtppeer::FEATURE_MULTICAST);
+  ASSERT_EQUAL(
+      client.remote_extension[rtpmidid::rtppeer::EXT_MULTICAST_GROUP],
+      "group");
+  ASSERT_EQUAL(client.remote_name, "test");
+  ASSERT_EQUAL(client.status, rtpmidid::rtppeer::CONTROL_CONNECTED);
+}
+
+// Connects both ports of two peers, talking to each other. Returns the client
+// to server connection id.
+static int connect_peers(rtpmidid::rtppeer &client,
+                         rtpmidid::rtppeer &server) {
+  client.initiator_id = 0x1234;
+  auto id = client.send_event.connect(
+      [&server](const rtpmidid::io_bytes_reader &data,
+                rtpmidid::rtppeer::port_e port) {
+        server.data_ready(rtpmidid::io_bytes_reader(data), port);
+      });
+  server.send_event.connect([&client](const rtpmidid::io_bytes_reader &data,
+                                      rtpmidid::rtppeer::port_e port) {
+    client.data_ready(rtpmidid::io_bytes_reader(data), port);
+  });
+  client.connect_to(rtpmidid::rtppeer::CONTROL_PORT);
+  client.connect_to(rtpmidid::rtppeer::MIDI_PORT);
+  ASSERT_TRUE(client.is_connected());
+  ASSERT_TRUE(server.is_connected());
+  return id;
+}
+
+void test_redundancy() {
+  rtpmidid::rtppeer client("client");
+  rtpmidid::rtppeer server("server");
+  client.local_features = rtpmidid::rtppeer::FEATURE_REDUNDANCY;
+  server.local_features = rtpmidid::rtppeer::FEATURE_REDUNDANCY;
+  client.redundancy.copies = 3;
+  connect_peers(client, server);
+
+  int sent = 0;
+  client.send_event.connect(
+      [&sent](const rtpmidid::io_bytes_reader &data,
+              rtpmidid::rtppeer::port_e port) { sent++; });
+  int got = 0;
+  server.midi_event.connect([&got](const rtpmidid::io_bytes_reader &data) {
+    ASSERT_TRUE(data.compare(hex_to_bin("90 64 7F")));
+    got++;
+  });
+
+  client.send_midi(hex_to_bin("90 64 7F"));
+  ASSERT_EQUAL(sent, 3);
+  ASSERT_EQUAL(got, 1);
+  ASSERT_EQUAL(server.duplicates, 2);
+
+  // Next packet is new, even if repeated too
+  client.send_midi(hex_to_bin("90 64 7F"));
+  ASSERT_EQUAL(sent, 6);
+  ASSERT_EQUAL(got, 2);
+  ASSERT_EQUAL(server.duplicates, 4);
+
+  // Late copies in the window are dropped, too old ones pass
+  ASSERT_TRUE(server.is_duplicate(server.seq_window_last - 1));
+  ASSERT_FALSE(server.is_duplicate(server.seq_window_last - 10));
+  ASSERT_TRUE(server.is_duplicate(server.seq_window_last - 10));
+  ASSERT_FALSE(server.is_duplicate(server.seq_window_last -
+                                   rtpmidid::rtppeer::DEDUPE_WINDOW));
+}
+
+void test_redundancy_gap() {
+  rtpmidid::rtppeer client("client");
+  rtpmidid::rtppeer server("server");
+  client.local_features = rtpmidid::rtppeer::FEATURE_REDUNDANCY;
+  server.local_features = rtpmidid::rtppeer::FEATURE_REDUNDANCY;
+  client.redundancy.copies = 3;
+  client.redundancy.gap = std::chrono::microseconds(5000);
+  connect_peers(client, server);
+
+  std::vector<std::chrono::steady_clock::time_point> sent;
+  client.send_event.connect(
+      [&sent](const rtpmidid::io_bytes_reader &data,
+              rtpmidid::rtppeer::port_e port) {
+        sent.push_back(std::chrono::steady_clock::now());
+      });
+  int got = 0;
+  server.midi_event.connect(
+      [&got](const rtpmidid::io_bytes_reader &data) { got++; });
+
+  client.send_midi(hex_to_bin("90 64 7F"));
+  client.send_midi(hex_to_bin("80 64 00"));
+  ASSERT_EQUAL(sent.size(), 2);
+  ASSERT_EQUAL(got, 2);
+
+  for (int i = 0; i < 100 && sent.size() < 6; i++)
+    rtpmidid::poller.wait(std::chrono::milliseconds(10));
+  ASSERT_EQUAL(sent.size(), 6);
+  ASSERT_EQUAL(got, 2);
+  ASSERT_EQUAL(server.duplicates, 4);
+  auto gap = std::chrono::duration_cast<std::chrono::microseconds>(sent[5] -
+                                                                   sent[0]);
+  INFO("Last copy after {} us", gap.count());
+  ASSERT_GTE(gap.count(), 10000);
+}
+
+void test_redundancy_legacy_peer() {
+  rtpmidid::rtppeer client("client");
+  rtpmidid::rtppeer server("server");
+  client.local_features = rtpmidid::rtppeer::FEATURE_REDUNDANCY;
+  client.redundancy.copies = 3;
+  connect_peers(client, server);
+
+  // The server may not drop copies, so it gets no copies
+  int sent = 0;
+  client.send_event.connect(
+      [&sent](const rtpmidid::io_bytes_reader &data,
+              rtpmidid::rtppeer::port_e port) { sent++; });
+  client.send_midi(hex_to_bin("90 64 7F"));
+  ASSERT_EQUAL(sent, 1);
+
+  // And we do not drop its packets, even if the sequence is repeated
+  int got = 0;
+  client.midi_event.connect(
+      [&got](const rtpmidid::io_bytes_reader &data) { got++; });
+  server.send_midi(hex_to_bin("90 64 7F"));
+  server.seq_nr--;
+  server.send_midi(hex_to_bin("90 64 7F"));
+  ASSERT_EQUAL(got, 2);
+  ASSERT_EQUAL(client.duplicates, 0);
+}
+
+void test_fec() {
+  rtpmidid::rtppeer client("client");
+  rtpmidid::rtppeer server("server");
+  client.local_features = rtpmidid::rtppeer::FEATURE_FEC;
+  server.local_features = rtpmidid::rtppeer::FEATURE_FEC;
+  client.fec_group = 4;
+  client.send_event.disconnect(connect_peers(client, server));
+
+  // A lossy network
+  int sent = 0, parity = 0;
+  std::set<int> lost;
+  client.send_event.connect([&](const rtpmidid::io_bytes_reader &data,
+                                rtpmidid::rtppeer::port_e port) {
+    auto packet = rtpmidid::io_bytes_reader(data);
+    sent++;
+    if (rtpmidid::rtppeer::is_fec(packet))
+      parity++;
+    if (lost.count(sent))
+      return;
+    server.data_ready(std::move(packet), port);
+  });
+  std::vector<uint8_t> notes;
+  server.midi_event.connect([&notes](const rtpmidid::io_bytes_reader &data) {
+    notes.push_back(data.start[1]);
+  });
+  auto send_note = [&client](uint8_t note) {
+    uint8_t data[] = {0x90, note, 0x7F};
+    client.send_midi(rtpmidid::io_bytes_reader(data, sizeof(data)));
+  };
+
+  // One lost, rebuilt after the parity
+  lost = {2};
+  for (uint8_t note = 0x40; note < 0x44; note++)
+    send_note(note);
+  ASSERT_EQUAL(sent, 5);
+  ASSERT_EQUAL(parity, 1);
+  std::vector<uint8_t> expected = {0x40, 0x42, 0x43, 0x41};
+  ASSERT_TRUE(notes == expected);
+  ASSERT_EQUAL(server.fec_recovered, 1);
+
+  // Two lost, can not
+  notes.clear();
+  lost = {7, 9};
+  for (uint8_t note = 0x40; note < 0x44; note++)
+    send_note(note);
+  ASSERT_EQUAL(parity, 2);
+  expected = {0x40, 0x42};
+  ASSERT_TRUE(notes == expected);
+  ASSERT_EQUAL(server.fec_recovered, 1);
+  ASSERT_GTE(server.fec_unrecoverable, 2);
+
+  // Incomplete group, parity after a while
+  notes.clear();
+  lost = {12};
+  send_note(0x40);
+  send_note(0x41);
+  expected = {0x40};
+  ASSERT_TRUE(notes == expected);
+  for (int i = 0; i < 10 && parity < 3; i++)
+    rtpmidid::poller.wait(std::chrono::milliseconds(10));
+  ASSERT_EQUAL(parity, 3);
+  expected = {0x40, 0x41};
+  ASSERT_TRUE(notes == expected);
+  ASSERT_EQUAL(server.fec_recovered, 2);
+
+  // Peers without FEC get no parity
+  rtpmidid::rtppeer legacy("legacy");
+  rtpmidid::rtppeer legacy_client("client");
+  legacy_client.fec_group = 4;
+  connect_peers(legacy_client, legacy);
+  int legacy_sent = 0;
+  legacy_client.send_event.connect(
+      [&legacy_sent](const rtpmidid::io_bytes_reader &data,
+                     rtpmidid::rtppeer::port_e port) { legacy_sent++; });
+  for (int i = 0; i < 4; i++)
+    legacy_client.send_midi(hex_to_bin("F8"));
+  ASSERT_EQUAL(legacy_sent, 4);
+}
+
+// A note on from the 'BEEF' SSRC
+static void recv_note(rtpmidid::rtppeer &peer, uint16_t seq_nr, uint8_t note) {
+  rtpmidid::io_bytes_writer_static<32> packet;
+  packet.write_uint8(0x80);
+  packet.write_uint8(0x61);
+  packet.write_uint16(seq_nr);
+  packet.write_uint32(0);
+  packet.write_uint32(0x42454546);
+  packet.write_uint8(0x03);
+  packet.write_uint8(0x90);
+  packet.write_uint8(note);
+  packet.write_uint8(0x7F);
+  peer.data_ready(rtpmidid::io_bytes_reader(packet),
+                  rtpmidid::rtppeer::MIDI_PORT);
+}
+
+void test_reorder() {
+  rtpmidid::rtppeer peer("test");
+  peer.data_ready(CONNECT_MSG, rtpmidid::rtppeer::CONTROL_PORT);
+  peer.data_ready(CONNECT_MSG, rtpmidid::rtppeer::MIDI_PORT);
+  peer.reorder_window = std::chrono::microseconds(20000);
+
+  std::vector<uint8_t> notes;
+  peer.midi_event.connect([&notes](const rtpmidid::io_bytes_reader &data) {
+    notes.push_back(data.start[1]);
+  });
+
+  // Reordered at the network, delivered in order
+  recv_note(peer, 1, 1);
+  recv_note(peer, 3, 3);
+  ASSERT_EQUAL(notes.size(), 1);
+  ASSERT_EQUAL(peer.lost_packets, 1);
+  recv_note(peer, 2, 2);
+  std::vector<uint8_t> expected = {1, 2, 3};
+  ASSERT_TRUE(notes == expected);
+  ASSERT_EQUAL(peer.lost_packets, 0);
+  ASSERT_EQUAL(peer.reordered_packets, 1);
+
+  recv_note(peer, 3, 3);
+  ASSERT_EQUAL(peer.duplicates, 1);
+  ASSERT_EQUAL(notes.size(), 3);
+
+  // Lost, the next ones wait for the window
+  recv_note(peer, 5, 5);
+  recv_note(peer, 6, 6);
+  ASSERT_EQUAL(notes.size(), 3);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 10 && notes.size() < 5; i++)
+    rtpmidid::poller.wait(std::chrono::milliseconds(10));
+  auto waited = std::chrono::steady_clock::now() - start;
+  expected = {1, 2, 3, 5, 6};
+  ASSERT_TRUE(notes == expected);
+  ASSERT_GTE(waited, std::chrono::milliseconds(15));
+  ASSERT_EQUAL(peer.lost_packets, 1);
+
+  // Too late, at once
+  recv_note(peer, 4, 4);
+  ASSERT_EQUAL(notes.back(), 4);
+  ASSERT_EQUAL(peer.lost_packets, 0);
+  ASSERT_EQUAL(peer.reordered_packets, 2);
+
+  // Disabled, as they arrive
+  peer.reorder_window = std::chrono::microseconds(0);
+  recv_note(peer, 8, 8);
+  recv_note(peer, 7, 7);
+  ASSERT_EQUAL(notes.back(), 7);
+  ASSERT_EQUAL(peer.lost_packets, 0);
+
+  // A malformed one after a gap is held. At the timer it is skipped, and the
+  // rest still delivered.
+  peer.reorder_window = std::chrono::microseconds(20000);
+  recv_note(peer, 10, 10);
+  rtpmidid::io_bytes_writer_static<32> bad;
+  bad.write_uint8(0x80);
+  bad.write_uint8(0x61);
+  bad.write_uint16(11);
+  bad.write_uint32(0);
+  bad.write_uint32(0x42454546);
+  bad.write_uint8(0x05); // More than there is
+  bad.write_uint8(0x90);
+  bad.write_uint8(0x60);
+  peer.data_ready(rtpmidid::io_bytes_reader(bad),
+                  rtpmidid::rtppeer::MIDI_PORT);
+  recv_note(peer, 12, 12);
+  ASSERT_EQUAL(notes.back(), 7);
+  for (int i = 0; i < 10 && notes.back() != 12; i++)
+    rtpmidid::poller.wait(std::chrono::milliseconds(10));
+  expected = {10, 12};
+  ASSERT_TRUE(std::vector<uint8_t>(notes.end() - 2, notes.end()) == expected);
+}
+
+void test_mtu_split() {
+  rtpmidid::rtppeer client("client");
+  rtpmidid::rtppeer server("server");
+  connect_peers(client, server);
+  client.mtu = 100;
+
+  size_t packets = 0, max_size = 0;
+  client.send_event.connect([&](const rtpmidid::io_bytes_reader &data,
+                                rtpmidid::rtppeer::port_e port) {
+    packets++;
+    max_size = std::max(max_size, data.size());
+  });
+  std::vector<std::vector<uint8_t>> got;
+  server.midi_event.connect([&got](const rtpmidid::io_bytes_reader &data) {
+    got.emplace_back(data.start, data.end);
+  });
+
+  // 40 notes, with running status after the first 20
+  std::vector<uint8_t> events;
+  for (uint8_t note = 0; note < 40; note++) {
+    if (note <= 20)
+      events.push_back(0x90);
+    events.push_back(note);
+    events.push_back(0x7F);
+  }
+  client.send_midi(rtpmidid::io_bytes_reader(events.data(), events.size()));
+
+  ASSERT_GT(packets, 1);
+  ASSERT_LTE(max_size, 100);
+  ASSERT_EQUAL(got.size(), 40);
+  for (uint8_t note = 0; note < 40; note++) {
+    std::vector<uint8_t> expected = {0x90, note, 0x7F};
+    ASSERT_TRUE(got[note] == expected);
+  }
+}
+
+void test_mtu_sysex() {
+  rtpmidid::rtppeer client("client");
+  rtpmidid::rtppeer server("server");
+  connect_peers(client, server);
+  client.mtu = 100;
+
+  size_t packets = 0, max_size = 0;
+  client.send_event.connect([&](const rtpmidid::io_bytes_reader &data,
+                                rtpmidid::rtppeer::port_e port) {
+    packets++;
+    max_size = std::max(max_size, data.size());
+  });
+  std::vector<std::vector<uint8_t>> got;
+  server.midi_event.connect([&got](const rtpmidid::io_bytes_reader &data) {
+    got.emplace_back(data.start, data.end);
+  });
+
+  // A note, a SysEx in 6 segments, and a note in a packet after them
+  std::vector<uint8_t> note = {0x90, 0x40, 0x7F};
+  std::vector<uint8_t> sysex = {0xF0};
+  for (int i = 0; i < 498; i++)
+    sysex.push_back(i & 0x7F);
+  sysex.push_back(0xF7);
+  std::vector<uint8_t> events = note;
+  events.insert(events.end(), sysex.begin(), sysex.end());
+  events.insert(events.end(), note.begin(), note.end());
+  client.send_midi(rtpmidid::io_bytes_reader(events.data(), events.size()));
+
+  ASSERT_EQUAL(packets, 1 + 6 + 1);
+  ASSERT_LTE(max_size, 100);
+  ASSERT_EQUAL(got.size(), 3);
+  ASSERT_TRUE(got[0] == note);
+  ASSERT_TRUE(got[1] == sysex);
+  ASSERT_TRUE(got[2] == note);
+}
+
 void test_send_short_midi() {
   rtpmidid::rtppeer peer("test");
 
@@ -457,6 +902,15 @@ int main(int argc, char **argv) {
   test_case_t testcase{
       TEST(test_connect_disconnect),
       TEST(test_connect_disconnect_reverse_order),
+      TEST(test_ck_uses_rx_time),
+      TEST(test_extension),
+      TEST(test_redundancy),
+      TEST(test_redundancy_gap),
+      TEST(test_redundancy_legacy_peer),
+      TEST(test_fec),
+      TEST(test_reorder),
+      TEST(test_mtu_split),
+      TEST(test_mtu_sysex),
       TEST(test_send_short_midi),
       TEST(test_send_long_midi),
       TEST(test_recv_some_midi),
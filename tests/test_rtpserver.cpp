@@ -19,8 +19,10 @@
 #include "../tests/test_case.hpp"
 #include "../tests/test_utils.hpp"
 #include "rtpmidid/iobytes.hpp"
+#include <arpa/inet.h>
 #include <rtpmidid/poller.hpp>
 #include <rtpmidid/rtpserver.hpp>
+#include <rtpmidid/sockopts.hpp>
 
 auto connect_msg = hex_to_bin("FF FF 'IN'"
                               "0000 0002"    // Protocol
@@ -153,10 +155,297 @@ void test_connect_disconnect_send() {
   ASSERT_EQUAL(*nmidievents, 1);
 }
 
+void test_batch_receive() {
+  rtpmidid::rtpserver server("test", "0");
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+
+  int nmidievents = 0;
+  server.midi_event.connect(
+      [&nmidievents](const rtpmidid::io_bytes_reader &) { nmidievents += 1; });
+
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+
+  // Several packets waiting at the socket, all read at one poller wakeup
+  struct sockaddr_in servaddr;
+  memset(&servaddr, 0, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_port = htons(server.midi_port);
+  inet_aton("127.0.0.1", &servaddr.sin_addr);
+  for (auto i = 0; i < 5; i++) {
+    auto len = ::sendto(midi_client.sockfd, midi_msg.start, midi_msg.size(), 0,
+                        (struct sockaddr *)&servaddr, sizeof(servaddr));
+    ASSERT_EQUAL(static_cast<uint32_t>(len), midi_msg.size());
+  }
+  rtpmidid::poller.wait();
+
+  DEBUG("Got {} events", nmidievents);
+  ASSERT_EQUAL(nmidievents, 5);
+
+  // All with kernel receive timestamps
+  auto peer = server.initiator_to_peer.begin()->second;
+  ASSERT_EQUAL(peer->internal_latency.count, 7);
+
+  control_client.send(disconnect_msg);
+  midi_client.send(disconnect_msg);
+}
+
+void test_truncated_packet() {
+  rtpmidid::rtpserver server("test", "0");
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+
+  int nmidievents = 0;
+  server.midi_event.connect(
+      [&nmidievents](const rtpmidid::io_bytes_reader &) { nmidievents += 1; });
+
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+
+  // A valid MIDI packet, padded over the receive buffer size, between two
+  // good ones at the same batch
+  std::vector<uint8_t> big(rtpmidid::recv_batch_t::PACKET_SIZE + 100, 0);
+  memcpy(big.data(), midi_msg.start, midi_msg.size());
+  struct sockaddr_in servaddr;
+  memset(&servaddr, 0, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_port = htons(server.midi_port);
+  inet_aton("127.0.0.1", &servaddr.sin_addr);
+  for (auto packet : {std::make_pair(midi_msg.start, midi_msg.size()),
+                      std::make_pair(big.data(), big.size()),
+                      std::make_pair(midi_msg.start, midi_msg.size())}) {
+    auto len = ::sendto(midi_client.sockfd, packet.first, packet.second, 0,
+                        (struct sockaddr *)&servaddr, sizeof(servaddr));
+    ASSERT_EQUAL(static_cast<size_t>(len), packet.second);
+  }
+  rtpmidid::poller.wait();
+
+  DEBUG("Got {} events, {} truncated", nmidievents,
+        server.recv_batch.truncated);
+  ASSERT_EQUAL(nmidievents, 2);
+  ASSERT_EQUAL(server.recv_batch.truncated, 1);
+
+  control_client.send(disconnect_msg);
+  midi_client.send(disconnect_msg);
+}
+
+void test_send_midi_to_all_peers() {
+  rtpmidid::rtpserver server("test", "0");
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+
+  test_client_t control_client2(0, server.control_port);
+  test_client_t midi_client2(control_client2.local_port + 1, server.midi_port);
+  control_client2.send(connect_msg2);
+  midi_client2.send(connect_msg2);
+
+  ASSERT_EQUAL(server.ssrc_to_conn.size(), 2);
+
+  server.send_midi_to_all_peers(hex_to_bin("90 60 7f"));
+
+  for (auto client : {&midi_client, &midi_client2}) {
+    uint8_t data[1500];
+    // First there is the OK answer to the IN
+    auto len = ::recv(client->sockfd, data, sizeof(data), 0);
+    ASSERT_EQUAL(data[2], 'O');
+    len = ::recv(client->sockfd, data, sizeof(data), 0);
+    DEBUG("Got packet of {} bytes", len);
+    ASSERT_EQUAL(len, 16);
+    rtpmidid::io_bytes_reader reader(data, len);
+    ASSERT_EQUAL(reader.read_uint8(), 0x80);
+    ASSERT_EQUAL(reader.read_uint8(), 0x61);
+    reader.seek(12);
+    ASSERT_EQUAL(reader.read_uint8(), 0x03);
+    ASSERT_EQUAL(reader.read_uint8(), 0x90);
+    ASSERT_EQUAL(reader.read_uint8(), 0x60);
+    ASSERT_EQUAL(reader.read_uint8(), 0x7f);
+  }
+
+  control_client.send(disconnect_msg);
+  control_client2.send(disconnect_msg2);
+  ASSERT_EQUAL(server.ssrc_to_conn.size(), 0);
+}
+
+void test_peer_sockets() {
+  rtpmidid::rtpserver server("test", "0", true);
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+
+  int nmidievents = 0;
+  server.midi_event.connect(
+      [&nmidievents](const rtpmidid::io_bytes_reader &) { nmidievents += 1; });
+
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+
+  ASSERT_EQUAL(server.ssrc_to_conn.size(), 1);
+  auto conn = server.ssrc_to_conn.begin()->second;
+  ASSERT_GTE(conn->control_socket, 0);
+  ASSERT_GTE(conn->midi_socket, 0);
+
+  // Now this arrives at the peer socket
+  midi_client.send(midi_msg);
+  ASSERT_EQUAL(nmidievents, 1);
+
+  // And answers come from the server port
+  server.initiator_to_peer.begin()->second->send_midi(hex_to_bin("90 60 7f"));
+  uint8_t data[1500];
+  struct sockaddr_in6 from;
+  socklen_t fromlen = sizeof(from);
+  // Skip the OK answer
+  ::recv(midi_client.sockfd, data, sizeof(data), 0);
+  auto len = ::recvfrom(midi_client.sockfd, data, sizeof(data), 0,
+                        (struct sockaddr *)&from, &fromlen);
+  ASSERT_EQUAL(len, 16);
+  ASSERT_EQUAL(htons(from.sin6_port), server.midi_port);
+
+  // The fan-out goes by the peer socket too
+  server.send_midi_to_all_peers(hex_to_bin("80 60 00"));
+  len = ::recvfrom(midi_client.sockfd, data, sizeof(data), 0,
+                   (struct sockaddr *)&from, &fromlen);
+  ASSERT_EQUAL(len, 16);
+  ASSERT_EQUAL(htons(from.sin6_port), server.midi_port);
+  ASSERT_EQUAL(data[13], 0x80);
+
+  control_client.send(disconnect_msg);
+  ASSERT_EQUAL(server.ssrc_to_conn.size(), 0);
+  ASSERT_EQUAL(conn->control_socket, -1);
+  ASSERT_EQUAL(conn->midi_socket, -1);
+}
+
+void test_kernel_drops() {
+  // A tiny buffer, so the kernel drops packets
+  rtpmidid::socket_options.rcvbuf = 1024;
+  rtpmidid::rtpserver server("test", "0");
+  rtpmidid::socket_options.rcvbuf = 0;
+
+  int rcvbuf = 0;
+  socklen_t len = sizeof(rcvbuf);
+  getsockopt(server.midi_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+  auto initial_rcvbuf = rcvbuf;
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+
+  struct sockaddr_in servaddr;
+  memset(&servaddr, 0, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_port = htons(server.midi_port);
+  inet_aton("127.0.0.1", &servaddr.sin_addr);
+  for (auto i = 0; i < 100; i++) {
+    ::sendto(midi_client.sockfd, midi_msg.start, midi_msg.size(), 0,
+             (struct sockaddr *)&servaddr, sizeof(servaddr));
+  }
+  // Only the packets that fit. The next one has the count of the dropped.
+  rtpmidid::poller.wait();
+  midi_client.send(midi_msg);
+
+  DEBUG("Kernel drops: {}", server.midi_drops.drops);
+  ASSERT_GT(server.midi_drops.drops, 0);
+  ASSERT_EQUAL(server.kernel_drops(), server.midi_drops.drops);
+
+  getsockopt(server.midi_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+  DEBUG("Receive buffer grown from {} to {}", initial_rcvbuf, rcvbuf);
+  ASSERT_GT(rcvbuf, initial_rcvbuf);
+
+  control_client.send(disconnect_msg);
+}
+
+void test_packet_filter() {
+  rtpmidid::socket_options.filter = true;
+  rtpmidid::socket_options.filter_ssrc = true;
+  rtpmidid::rtpserver server("test", "0");
+  int events = 0;
+  server.midi_event.connect([&](const rtpmidid::io_bytes_reader &) {
+    events++;
+  });
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+
+  // Not RTP MIDI, other RTP payload, and MIDI from an unknown SSRC
+  auto junk = hex_to_bin("'GET / HTTP/1.0' 0D 0A 0D 0A");
+  auto audio = hex_to_bin("80 0A 0000 0000 0000 00BE EF00 0102 0304");
+  auto unknown = hex_to_bin("80 61 0000 0000 0000 0012 3400 03 90 60 7f");
+  struct sockaddr_in servaddr;
+  memset(&servaddr, 0, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_port = htons(server.midi_port);
+  inet_aton("127.0.0.1", &servaddr.sin_addr);
+  for (auto packet : {&junk, &audio, &unknown}) {
+    for (auto i = 0; i < 10; i++) {
+      ::sendto(midi_client.sockfd, packet->start, packet->size(), 0,
+               (struct sockaddr *)&servaddr, sizeof(servaddr));
+    }
+  }
+  // Nothing to read, nothing woke up
+  rtpmidid::poller.wait(std::chrono::milliseconds(50));
+  uint8_t data[64];
+  ASSERT_EQUAL(::recv(server.midi_socket, data, sizeof(data),
+                      MSG_PEEK | MSG_DONTWAIT),
+               -1);
+  ASSERT_EQUAL(events, 0);
+
+  // The count comes with the next accepted packet
+  midi_client.send(midi_msg);
+  ASSERT_EQUAL(events, 1);
+  ASSERT_EQUAL(server.filtered_packets(), 30);
+  ASSERT_EQUAL(server.kernel_drops(), 0);
+
+  control_client.send(disconnect_msg);
+  rtpmidid::socket_options.filter = false;
+  rtpmidid::socket_options.filter_ssrc = false;
+}
+
+void test_unknown_ssrc_ck() {
+  rtpmidid::rtpserver server("shared", "0");
+  server.add_session("piano");
+  server.add_session("drums");
+
+  test_client_t control_client(0, server.control_port);
+  test_client_t midi_client(control_client.local_port + 1, server.midi_port);
+  control_client.send(connect_msg);
+  midi_client.send(connect_msg);
+  ASSERT_EQUAL(server.ssrc_to_peer.size(), 1);
+
+  // A stray CK, from an SSRC the server does not know
+  auto ck = hex_to_bin("FF FF 'CK' 0012 3456 00 000000"
+                       "0000 0000 0000 0001"
+                       "0000 0000 0000 0000"
+                       "0000 0000 0000 0000");
+  midi_client.send(ck);
+  ASSERT_EQUAL(server.ssrc_to_peer.size(), 1);
+
+  // Goes through all the peers. This one is at piano, the default.
+  server.remove_session("drums");
+  server.update_ssrc_filter();
+  ASSERT_EQUAL(server.ssrc_to_peer.size(), 1);
+
+  control_client.send(disconnect_msg);
+}
+
 int main(void) {
   test_case_t testcase{
       TEST(test_several_connect_to_server),
       TEST(test_connect_disconnect_send),
+      TEST(test_batch_receive),
+      TEST(test_truncated_packet),
+      TEST(test_send_midi_to_all_peers),
+      TEST(test_peer_sockets),
+      TEST(test_kernel_drops),
+      TEST(test_packet_filter),
+      TEST(test_unknown_ssrc_ck),
   };
 
   testcase.run();
@@ -0,0 +1,210 @@
+/**
+ * Real Time Protocol Music Instrument Digital Interface Daemon
+ * Copyright (C) 2019-2021 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "./test_case.hpp"
+#include "./test_utils.hpp"
+#include <chrono>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <rtpmidid/poller.hpp>
+#include <rtpmidid/sendqueue.hpp>
+#include <rtpmidid/sockopts.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using rtpmidid::send_queue_t;
+
+auto note_on = hex_to_bin("80 61 0000 0000 0000 00BE EF00 03 90 60 7f");
+auto midi_clock = hex_to_bin("80 61 0000 0000 0000 00BE EF00 01 F8");
+auto ck = hex_to_bin("FF FF 'CK' 00BE EF00 00 000000");
+
+// Unix datagram sockets return EAGAIN when the receiver is full.
+struct socket_pair_t {
+  int sender, receiver;
+  socket_pair_t() {
+    int fds[2];
+    ASSERT_EQUAL(::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    sender = fds[0];
+    receiver = fds[1];
+  }
+  ~socket_pair_t() {
+    ::close(sender);
+    ::close(receiver);
+  }
+  // Fills the socket until a packet is queued
+  void fill(send_queue_t &queue) {
+    while (queue.send(sender, note_on) == send_queue_t::SENT)
+      ;
+  }
+  int drain() {
+    uint8_t data[1500];
+    int n = 0;
+    while (::recv(receiver, data, sizeof(data), MSG_DONTWAIT) > 0)
+      n++;
+    return n;
+  }
+};
+
+void test_packet_kind() {
+  ASSERT_EQUAL(send_queue_t::packet_kind(note_on), send_queue_t::NORMAL);
+  ASSERT_EQUAL(send_queue_t::packet_kind(midi_clock), send_queue_t::REALTIME);
+  ASSERT_EQUAL(send_queue_t::packet_kind(ck), send_queue_t::COMMAND);
+}
+
+void test_queue_and_flush() {
+  socket_pair_t sockets;
+  send_queue_t queue(8);
+
+  sockets.fill(queue);
+  ASSERT_EQUAL(queue.size(), 1);
+  ASSERT_TRUE(queue.pending(sockets.sender));
+  ASSERT_FALSE(queue.flush());
+
+  // In order, even if there is room now
+  auto sent = sockets.drain();
+  ASSERT_GT(sent, 0);
+  ASSERT_EQUAL(queue.send(sockets.sender, note_on), send_queue_t::QUEUED);
+  ASSERT_EQUAL(queue.size(), 2);
+
+  ASSERT_TRUE(queue.flush());
+  ASSERT_TRUE(queue.empty());
+  ASSERT_EQUAL(sockets.drain(), 2);
+  ASSERT_EQUAL(queue.drops, 0);
+}
+
+void test_send_error() {
+  socket_pair_t sockets;
+  send_queue_t queue(8);
+
+  // The other end is gone. Dropped and counted, not thrown, so a fan-out
+  // still sends to the rest of the peers.
+  ::close(sockets.receiver);
+  ASSERT_EQUAL(queue.send(sockets.sender, note_on), send_queue_t::DROPPED);
+  ASSERT_EQUAL(queue.send(sockets.sender, note_on), send_queue_t::DROPPED);
+  ASSERT_TRUE(queue.empty());
+  ASSERT_EQUAL(queue.drops, 2);
+
+  sockets.receiver = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+}
+
+void test_drop_oldest_non_realtime() {
+  socket_pair_t sockets;
+  send_queue_t queue(4);
+
+  sockets.fill(queue);
+  queue.push(sockets.sender, midi_clock);
+  queue.push(sockets.sender, ck);
+  queue.push(sockets.sender, note_on);
+  ASSERT_EQUAL(queue.size(), 4);
+
+  // Drops the normal ones, first the older
+  queue.push(sockets.sender, midi_clock);
+  ASSERT_EQUAL(queue.size(), 4);
+  ASSERT_EQUAL(queue.drops, 1);
+  queue.push(sockets.sender, midi_clock);
+  ASSERT_EQUAL(queue.drops, 2);
+
+  // Now only midi_clock and commands, a new normal is dropped
+  ASSERT_EQUAL(queue.push(sockets.sender, note_on), send_queue_t::DROPPED);
+  ASSERT_EQUAL(queue.drops, 3);
+  ASSERT_EQUAL(queue.size(), 4);
+
+  sockets.drain();
+  ASSERT_TRUE(queue.flush());
+
+  uint8_t data[1500];
+  int nclock = 0, nck = 0;
+  ssize_t len;
+  while ((len = ::recv(sockets.receiver, data, sizeof(data), MSG_DONTWAIT)) >
+         0) {
+    auto kind = send_queue_t::packet_kind(rtpmidid::io_bytes_reader(data, len));
+    ASSERT_NOT_EQUAL(kind, send_queue_t::NORMAL);
+    if (kind == send_queue_t::REALTIME)
+      nclock++;
+    else
+      nck++;
+  }
+  ASSERT_EQUAL(nclock, 3);
+  ASSERT_EQUAL(nck, 1);
+}
+
+void test_drop_newest() {
+  socket_pair_t sockets;
+  send_queue_t queue(2, send_queue_t::DROP_NEWEST);
+
+  sockets.fill(queue);
+  queue.push(sockets.sender, midi_clock);
+  ASSERT_EQUAL(queue.push(sockets.sender, ck), send_queue_t::DROPPED);
+  ASSERT_EQUAL(queue.size(), 2);
+  ASSERT_EQUAL(queue.drops, 1);
+}
+
+void test_txtime() {
+  rtpmidid::socket_options.txtime_offset_us = 2000;
+  int receiver = socket(AF_INET6, SOCK_DGRAM, 0);
+  struct sockaddr_in6 address = {};
+  address.sin6_family = AF_INET6;
+  address.sin6_addr = in6addr_loopback;
+  socklen_t len = sizeof(address);
+  ASSERT_EQUAL(bind(receiver, (sockaddr *)&address, len), 0);
+  getsockname(receiver, (sockaddr *)&address, &len);
+
+  int sender = socket(AF_INET6, SOCK_DGRAM, 0);
+  rtpmidid::setup_socket(sender);
+  // Some kernels do not have it, and then it is just disabled
+  if (rtpmidid::socket_options.txtime_offset_us > 0) {
+    struct sock_txtime txtime = {};
+    socklen_t txtime_len = sizeof(txtime);
+    getsockopt(sender, SOL_SOCKET, SO_TXTIME, &txtime, &txtime_len);
+    ASSERT_EQUAL(txtime.clockid, CLOCK_MONOTONIC);
+  }
+
+  // Without the fq qdisc at loopback they arrive at once
+  send_queue_t queue;
+  rtpmidid::poller.set_event_time(std::chrono::steady_clock::now());
+  ASSERT_EQUAL(queue.send(sender, midi_clock, &address), send_queue_t::SENT);
+  ASSERT_EQUAL(queue.send(sender, ck, &address), send_queue_t::SENT);
+  int received = 0;
+  struct pollfd pfd = {receiver, POLLIN, 0};
+  while (received < 2 && poll(&pfd, 1, 1000) > 0) {
+    uint8_t data[64];
+    if (recv(receiver, data, sizeof(data), 0) > 0)
+      received++;
+  }
+  ASSERT_EQUAL(received, 2);
+
+  rtpmidid::socket_options.txtime_offset_us = 0;
+  close(sender);
+  close(receiver);
+}
+
+int main(void) {
+  test_case_t testcase{
+      TEST(test_packet_kind),
+      TEST(test_queue_and_flush),
+      TEST(test_send_error),
+      TEST(test_drop_oldest_non_realtime),
+      TEST(test_drop_newest),
+      TEST(test_txtime),
+  };
+
+  testcase.run();
+
+  return testcase.exit_code();
+}